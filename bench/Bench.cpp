@@ -0,0 +1,247 @@
+#include <ncnet/Server.h>
+#include <ncnet/Client.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Echo round trips over loopback TCP, a unix domain socket or shared memory, every client keeps window packets in flight
+struct Config {
+    size_t size;
+    size_t connections;
+    size_t workers;
+    bool encryption;
+    string transport; // tcp, unix or shm
+    string poller; // epoll, poll or io_uring
+};
+
+struct Load {
+    ncnet::Client client;
+    vector<double> latencies; // Microseconds, only touched by the client's transfer loop
+    atomic<size_t> received{0};
+};
+
+static long long now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Comma separated values of --name=, or fallback
+static vector<size_t> parse_list(int argc, char **argv, const string &name, const vector<size_t> &fallback) {
+    auto prefix = "--" + name + "=";
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], prefix.c_str(), prefix.size()) != 0) {
+            continue;
+        }
+
+        vector<size_t> values;
+        for (auto *value = argv[i] + prefix.size(); *value != '\0';) {
+            char *end;
+            values.push_back(strtoull(value, &end, 10));
+            value = *end == ',' ? end + 1 : end;
+            if (end == value && *value != '\0') {
+                break; // Garbage
+            }
+        }
+
+        return values;
+    }
+
+    return fallback;
+}
+
+// Comma separated names of --name=, or fallback
+static vector<string> parse_names(int argc, char **argv, const string &name, const vector<string> &fallback) {
+    auto prefix = "--" + name + "=";
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], prefix.c_str(), prefix.size()) != 0) {
+            continue;
+        }
+
+        vector<string> values;
+        string value;
+        for (auto *c = argv[i] + prefix.size(); ; c++) {
+            if (*c == ',' || *c == '\0') {
+                values.push_back(value);
+                value.clear();
+            } else {
+                value.push_back(*c);
+            }
+
+            if (*c == '\0') {
+                break;
+            }
+        }
+
+        return values;
+    }
+
+    return fallback;
+}
+
+static ncnet::PollerType poller_type(const string &name) {
+    if (name == "poll") {
+        return ncnet::PollerType::POLL;
+    }
+
+    return name == "io_uring" ? ncnet::PollerType::IO_URING : ncnet::PollerType::EPOLL;
+}
+
+static double percentile(const vector<double> &sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    return sorted[min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()))];
+}
+
+static void run(const Config &config, int port, int duration, size_t window, bool first) {
+    ncnet::Server server;
+    server.set_encoding(ncnet::Encoding::BINARY);
+    server.set_encryption(config.encryption);
+    server.set_poller_type(poller_type(config.poller));
+
+    // Abstract socket named after the port, nothing to clean up
+    auto tcp = config.transport == "tcp";
+    auto hostname = tcp ? string("localhost") : config.transport + ":@ncnet_bench_" + to_string(port);
+    if (!server.start(tcp ? "" : hostname, port)) {
+        fprintf(stderr, "Failed to start server on %s port %d\n", hostname.c_str(), port);
+        exit(1);
+    }
+
+    for (size_t i = 0; i < config.workers; i++) {
+        server.register_transfer_loop([&server] (auto &transfer) {
+            server.send_packet(move(transfer.get_packet()), transfer.get_connection_id());
+        });
+    }
+
+    atomic<bool> running(true);
+    atomic<bool> measuring(false);
+    string padding(config.size > 16 ? config.size - 16 : 0, 'x');
+    vector<unique_ptr<Load>> loads;
+
+    auto send = [&padding] (Load &load) {
+        auto packet = load.client.create_packet();
+        packet << now_ns() << padding;
+        load.client.send_packet(move(packet));
+    };
+
+    for (size_t i = 0; i < config.connections; i++) {
+        loads.emplace_back(new Load());
+        auto &load = *loads.back();
+        load.client.set_encoding(ncnet::Encoding::BINARY);
+        load.client.set_encryption(config.encryption);
+        load.client.set_poller_type(poller_type(config.poller));
+
+        if (!load.client.start(hostname, port)) {
+            fprintf(stderr, "Failed to connect to %s port %d\n", hostname.c_str(), port);
+            exit(1);
+        }
+
+        load.client.register_transfer_loop([&load, &running, &measuring, &send] (auto &transfer) {
+            long long sent;
+            transfer.get_packet() >> sent;
+
+            if (measuring) {
+                load.latencies.push_back((now_ns() - sent) / 1000.0);
+                load.received++;
+            }
+
+            if (running) {
+                send(load);
+            }
+        });
+    }
+
+    for (auto &load : loads) {
+        for (size_t i = 0; i < window; i++) {
+            send(*load);
+        }
+    }
+
+    // Skip connection setup and warm up caches before measuring
+    this_thread::sleep_for(chrono::milliseconds(duration / 10));
+    measuring = true;
+    auto start = chrono::steady_clock::now();
+    this_thread::sleep_for(chrono::milliseconds(duration));
+    measuring = false;
+    auto seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    running = false;
+
+    // Let packets in flight drain before stopping
+    this_thread::sleep_for(chrono::milliseconds(50));
+    for (auto &load : loads) {
+        load->client.stop();
+    }
+
+    server.stop();
+
+    size_t messages = 0;
+    vector<double> latencies;
+    for (auto &load : loads) {
+        messages += load->received;
+        latencies.insert(latencies.end(), load->latencies.begin(), load->latencies.end());
+    }
+
+    sort(latencies.begin(), latencies.end());
+
+    printf("%s  {\"transport\": \"%s\", \"poller\": \"%s\", \"size\": %zu, \"connections\": %zu, \"workers\": %zu, \"encryption\": %s, \"messages\": %zu, "
+           "\"msgs_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f}}",
+           first ? "" : ",\n", config.transport.c_str(), config.poller.c_str(), config.size, config.connections, config.workers, config.encryption ? "true" : "false",
+           messages, messages / seconds, messages * config.size / seconds / (1024 * 1024),
+           percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999));
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--help") == 0) {
+        printf("Usage: %s [--sizes=64,1024,16384] [--connections=1,8] [--workers=1,4] [--encryption=1,0]\n"
+               "          [--transports=tcp,unix,shm] [--pollers=epoll,poll,io_uring] [--duration=1000] [--window=16]\n"
+               "          [--port=15800]\n"
+               "Prints one JSON object per combination, sizes in bytes and duration in ms. Local transports use\n"
+               "abstract unix domain sockets, shm exchanges data through shared memory rings. Pollers default to\n"
+               "epoll, shm always polls with epoll\n", argv[0]);
+        return 0;
+    }
+
+    auto sizes = parse_list(argc, argv, "sizes", { 64, 1024, 16384 });
+    auto connections = parse_list(argc, argv, "connections", { 1, 8 });
+    auto workers = parse_list(argc, argv, "workers", { 1, 4 });
+    auto encryption = parse_list(argc, argv, "encryption", { 1, 0 });
+    auto transports = parse_names(argc, argv, "transports", { "tcp", "unix", "shm" });
+    auto pollers = parse_names(argc, argv, "pollers", { "epoll" });
+    auto duration = static_cast<int>(parse_list(argc, argv, "duration", { 1000 }).front());
+    auto window = parse_list(argc, argv, "window", { 16 }).front();
+    auto port = static_cast<int>(parse_list(argc, argv, "port", { 15800 }).front());
+
+    printf("[\n");
+    bool first = true;
+
+    for (auto size : sizes) {
+        for (auto connection_count : connections) {
+            for (auto worker_count : workers) {
+                for (auto encrypted : encryption) {
+                    for (auto &transport : transports) {
+                        for (auto &poller : pollers) {
+                            // New port for every run, avoids waiting for the previous listener
+                            Config config = { size, connection_count, worker_count, encrypted != 0, transport, poller };
+                            run(config, port++, duration, window, first);
+                            first = false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("\n]\n");
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,72 @@
+#include <ncnet/Packet.h>
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+
+using namespace std;
+
+// Text encoded records, numbers become decimal strings
+static ncnet::Packet create_records(size_t size) {
+    ncnet::Packet packet;
+    for (int i = 0; packet.size() < size; i++) {
+        packet << i << "player" << i % 100 << 1.5 * i << string("position");
+    }
+
+    return packet;
+}
+
+// Incompressible payload
+static ncnet::Packet create_random(size_t size) {
+    mt19937 random(size);
+    string data(size, '\0');
+    for (auto &c : data) {
+        c = static_cast<char>(random());
+    }
+
+    ncnet::Packet packet(ncnet::Encoding::BINARY);
+    packet << data;
+    return packet;
+}
+
+// Encrypt and decrypt copies of packet, prints wire size and time per packet
+static void run(const char *name, const function<ncnet::Packet(size_t)> &create, size_t size, size_t threshold,
+                ncnet::Security &sender, ncnet::Security &receiver) {
+    auto original = create(size);
+    original.finalize();
+
+    size_t iterations = max<size_t>(100, 32 * 1024 * 1024 / original.size());
+    size_t wire = 0;
+    auto start = chrono::steady_clock::now();
+
+    for (size_t i = 0; i < iterations; i++) {
+        auto packet = original.clone();
+        packet.encrypt(sender, threshold);
+        wire = packet.size();
+
+        ncnet::Packet received;
+        received.decrypt(receiver, packet.get_send_buffer(), packet.size());
+    }
+
+    auto elapsed = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    printf("%-8s %8zu %-6s %8zu bytes %10.2f us/packet\n", name, original.size(), threshold > 0 ? "lz4" : "plain",
+        wire, elapsed / iterations);
+}
+
+int main() {
+    ncnet::Security server, client;
+    auto cek = server.compute_shared_key(client.get_pub_dh_key(), client.get_pub_sign_key());
+    client.compute_shared_key(server.get_pub_dh_key(), server.get_pub_sign_key());
+    client.set_encrypted_cek(cek);
+
+    for (auto size : { 64, 512, 4096, 65536 }) {
+        for (auto threshold : { 0, 1 }) {
+            run("records", create_records, size, threshold, server, client);
+            run("random", create_random, size, threshold, server, client);
+        }
+    }
+
+    return 0;
+}
\ No newline at end of file
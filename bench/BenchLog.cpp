@@ -0,0 +1,37 @@
+#include "Microbench.h"
+
+#include <ncnet/Log.h>
+
+int main(int argc, char **argv) {
+    bench::Runner runner(argc, argv);
+
+    // Logging is disabled by default, this is the cost paid on the hot paths
+    runner.run("log/disabled", [] (size_t iterations) {
+        for (size_t i = 0; i < iterations; i++) {
+            ncnet::Log(ncnet::DEBUG) << "Writing " << i << " packets to " << 42;
+        }
+    });
+
+    runner.run("log/macro_disabled", [] (size_t iterations) {
+        for (size_t i = 0; i < iterations; i++) {
+            NCNET_LOG(ncnet::DEBUG) << "Writing " << i << " packets to " << 42;
+        }
+    });
+
+    // Enabled but filtered by level
+    ncnet::Log::enable(true);
+    ncnet::Log::set_log_level(ncnet::ERROR);
+    runner.run("log/filtered", [] (size_t iterations) {
+        for (size_t i = 0; i < iterations; i++) {
+            ncnet::Log(ncnet::DEBUG) << "Writing " << i << " packets to " << 42;
+        }
+    });
+
+    runner.run("log/macro_filtered", [] (size_t iterations) {
+        for (size_t i = 0; i < iterations; i++) {
+            NCNET_LOG(ncnet::DEBUG) << "Writing " << i << " packets to " << 42;
+        }
+    });
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,165 @@
+#include "Microbench.h"
+
+#include <ncnet/Packet.h>
+
+#include <limits>
+
+using namespace std;
+
+static constexpr size_t VALUES_PER_PACKET = 1024; // Bounds packet growth while writing
+
+static const char *encoding_name(ncnet::Encoding encoding) {
+    return encoding == ncnet::Encoding::BINARY ? "binary" : "text";
+}
+
+// operator<< and operator>> for one type, per value
+template<class T>
+static void bench_type(bench::Runner &runner, const string &type, T value, ncnet::Encoding encoding) {
+    runner.run("write/" + type + "/" + encoding_name(encoding), [value, encoding] (size_t iterations) {
+        ncnet::Packet packet(encoding);
+        for (size_t i = 0; i < iterations; i++) {
+            if (i % VALUES_PER_PACKET == 0) {
+                packet = ncnet::Packet(encoding);
+            }
+
+            packet << value;
+        }
+
+        bench::keep(packet);
+    });
+
+    ncnet::Packet source(encoding);
+    for (size_t i = 0; i < VALUES_PER_PACKET; i++) {
+        source << value;
+    }
+
+    source.finalize();
+
+    // Includes copying the frame once per VALUES_PER_PACKET reads
+    runner.run("read/" + type + "/" + encoding_name(encoding), [&source] (size_t iterations) {
+        ncnet::Packet packet(source.get_send_buffer(), source.size());
+        T read;
+
+        for (size_t i = 0; i < iterations; i++) {
+            if (i % VALUES_PER_PACKET == 0 && i > 0) {
+                packet = ncnet::Packet(source.get_send_buffer(), source.size());
+            }
+
+            packet >> read;
+            bench::keep(read);
+        }
+    });
+}
+
+static void bench_types(bench::Runner &runner, ncnet::Encoding encoding) {
+    bench_type(runner, "bool", true, encoding);
+    bench_type(runner, "short", static_cast<short>(-1234), encoding);
+    bench_type(runner, "unsigned_short", static_cast<unsigned short>(1234), encoding);
+    bench_type(runner, "int", -123456, encoding);
+    bench_type(runner, "unsigned_int", 123456U, encoding);
+    bench_type(runner, "long", -123456789L, encoding);
+    bench_type(runner, "unsigned_long", 123456789UL, encoding);
+    bench_type(runner, "long_long", -1234567890123LL, encoding);
+    bench_type(runner, "unsigned_long_long", numeric_limits<unsigned long long>::max(), encoding);
+    bench_type(runner, "float", 1.25f, encoding);
+    bench_type(runner, "double", 3.14159, encoding);
+    bench_type(runner, "long_double", 2.5L, encoding);
+}
+
+// add_string and read_string for a string length
+static void bench_string(bench::Runner &runner, size_t length, ncnet::Encoding encoding) {
+    auto name = "string/" + to_string(length) + "/" + encoding_name(encoding);
+    string value(length, 'x');
+    auto per_packet = max<size_t>(1, 64 * 1024 / (length + 1));
+
+    runner.run("write/" + name, [&value, encoding, per_packet] (size_t iterations) {
+        ncnet::Packet packet(encoding);
+        for (size_t i = 0; i < iterations; i++) {
+            if (i % per_packet == 0) {
+                packet = ncnet::Packet(encoding);
+            }
+
+            packet.add_string(value);
+        }
+
+        bench::keep(packet);
+    });
+
+    ncnet::Packet source(encoding);
+    for (size_t i = 0; i < per_packet; i++) {
+        source.add_string(value);
+    }
+
+    source.finalize();
+
+    runner.run("read/" + name, [&source, per_packet] (size_t iterations) {
+        ncnet::Packet packet(source.get_send_buffer(), source.size());
+        string read;
+
+        for (size_t i = 0; i < iterations; i++) {
+            if (i % per_packet == 0 && i > 0) {
+                packet = ncnet::Packet(source.get_send_buffer(), source.size());
+            }
+
+            packet.read_string(read);
+            bench::keep(read);
+        }
+    });
+}
+
+// Packet::encrypt and Packet::decrypt for a payload size
+static void bench_encryption(bench::Runner &runner, size_t size, ncnet::Security &sender, ncnet::Security &receiver) {
+    ncnet::Packet original(ncnet::Encoding::BINARY);
+    original << string(size, 'x');
+    original.finalize();
+
+    // Encrypting a clone, the clone is measured separately
+    runner.run("clone/" + to_string(size), [&original] (size_t iterations) {
+        for (size_t i = 0; i < iterations; i++) {
+            auto packet = original.clone();
+            bench::keep(packet);
+        }
+    });
+
+    runner.run("encrypt/" + to_string(size), [&original, &sender] (size_t iterations) {
+        for (size_t i = 0; i < iterations; i++) {
+            auto packet = original.clone();
+            packet.encrypt(sender);
+            bench::keep(packet);
+        }
+    });
+
+    // Every frame is only accepted once, decrypt fresh encryptions
+    runner.run("encrypt_decrypt/" + to_string(size), [&original, &sender, &receiver] (size_t iterations) {
+        ncnet::Packet received;
+        for (size_t i = 0; i < iterations; i++) {
+            auto packet = original.clone();
+            packet.encrypt(sender);
+            received.decrypt(receiver, packet.get_send_buffer(), packet.size());
+            bench::keep(received);
+        }
+    });
+}
+
+int main(int argc, char **argv) {
+    bench::Runner runner(argc, argv);
+
+    bench_types(runner, ncnet::Encoding::TEXT);
+    bench_types(runner, ncnet::Encoding::BINARY);
+
+    for (auto length : { 8, 256, 4096 }) {
+        bench_string(runner, length, ncnet::Encoding::TEXT);
+        bench_string(runner, length, ncnet::Encoding::BINARY);
+    }
+
+    ncnet::Security server, client;
+    auto cek = server.compute_shared_key(client.get_pub_dh_key(), client.get_pub_sign_key());
+    client.compute_shared_key(server.get_pub_dh_key(), server.get_pub_sign_key());
+    client.set_encrypted_cek(cek);
+
+    for (auto size : { 64, 1024, 16 * 1024, 256 * 1024 }) {
+        bench_encryption(runner, size, server, client);
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#include "Microbench.h"
+
+#include <ncnet/Security.h>
+
+int main(int argc, char **argv) {
+    bench::Runner runner(argc, argv);
+
+    // Every connection constructs one, including DH key generation
+    runner.run("security/construct", [] (size_t iterations) {
+        for (size_t i = 0; i < iterations; i++) {
+            ncnet::Security security;
+            bench::keep(security);
+        }
+    });
+
+    // Server side of the key exchange
+    ncnet::Security client;
+    runner.run("security/compute_shared_key", [&client] (size_t iterations) {
+        for (size_t i = 0; i < iterations; i++) {
+            ncnet::Security server;
+            auto cek = server.compute_shared_key(client.get_pub_dh_key(), client.get_pub_sign_key());
+            bench::keep(cek);
+        }
+    });
+
+    return 0;
+}
\ No newline at end of file
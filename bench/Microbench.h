@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Minimal benchmark harness. Iterations are calibrated until a run takes at least --min-time ms
+// (or fixed with --iterations), every benchmark is repeated --repeat times and the median is reported.
+namespace bench {
+    // Keep the compiler from optimizing away value
+    template<class T>
+    void keep(T &&value) {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    class Runner {
+    public:
+        Runner(int argc, char **argv) {
+            for (int i = 1; i < argc; i++) {
+                if (strncmp(argv[i], "--min-time=", 11) == 0) {
+                    min_seconds_ = atof(argv[i] + 11) / 1000;
+                } else if (strncmp(argv[i], "--iterations=", 13) == 0) {
+                    iterations_ = strtoull(argv[i] + 13, nullptr, 10);
+                } else if (strncmp(argv[i], "--repeat=", 9) == 0) {
+                    repeat_ = std::max(1ULL, strtoull(argv[i] + 9, nullptr, 10));
+                } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+                    filter_ = argv[i] + 9;
+                } else {
+                    printf("Usage: %s [--min-time=200] [--iterations=N] [--repeat=5] [--filter=name]\n", argv[0]);
+                    exit(0);
+                }
+            }
+
+            printf("[\n");
+        }
+
+        ~Runner() {
+            printf("\n]\n");
+        }
+
+        // Body runs the measured operation the given amount of times
+        void run(const std::string &name, const std::function<void(size_t iterations)> &body) {
+            if (!filter_.empty() && name.find(filter_) == std::string::npos) {
+                return;
+            }
+
+            auto iterations = iterations_;
+            if (iterations == 0) {
+                // Double until a run is long enough, then scale to the minimum time
+                iterations = 1;
+                double seconds;
+                while ((seconds = time(body, iterations)) < min_seconds_ / 10) {
+                    iterations *= 2;
+                }
+
+                iterations = std::max<size_t>(1, iterations * (min_seconds_ / seconds));
+            }
+
+            std::vector<double> results;
+            for (size_t i = 0; i < repeat_; i++) {
+                results.push_back(time(body, iterations) * 1e9 / iterations);
+            }
+
+            std::sort(results.begin(), results.end());
+            printf("%s  {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f}",
+                   first_ ? "" : ",\n", name.c_str(), iterations, results[results.size() / 2], results.front());
+            fflush(stdout);
+            first_ = false;
+        }
+
+    private:
+        static double time(const std::function<void(size_t iterations)> &body, size_t iterations) {
+            auto start = std::chrono::steady_clock::now();
+            body(iterations);
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        double min_seconds_ = 0.2;
+        size_t iterations_ = 0; // Calibrated if 0
+        size_t repeat_ = 5;
+        std::string filter_;
+        bool first_ = true;
+    };
+}
\ No newline at end of file
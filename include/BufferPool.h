@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace ncnet {
+    struct PoolStats {
+        size_t hits = 0; // Buffers reused from a cache
+        size_t misses = 0; // Buffers allocated from the heap
+        size_t bytes_held = 0; // Capacity of buffers waiting in caches
+    };
+
+    // Pooled storage, reference counted by Buffer
+    struct BufferBlock {
+        std::atomic<size_t> references{0};
+        std::vector<unsigned char> data;
+    };
+
+    // Size-class buffer pool. Each thread has a small cache, spilling to a
+    // lock-free global cache which is shared between threads.
+    class BufferPool {
+    public:
+        static BufferBlock *acquire(size_t size); // Returns empty block with at least size capacity
+        static void release(BufferBlock *block); // Return block for reuse
+        static PoolStats get_stats(); // Totals over all threads
+    };
+
+    // Reference counted handle to a pooled byte vector, returned to the pool with the last reference
+    class Buffer {
+    public:
+        Buffer() {}
+        explicit Buffer(size_t capacity) : block_(BufferPool::acquire(capacity)) {
+            block_->references.store(1, std::memory_order_relaxed);
+        }
+
+        Buffer(const Buffer &other) : block_(other.block_) {
+            if (block_) {
+                block_->references.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        Buffer(Buffer &&other) noexcept : block_(other.block_) {
+            other.block_ = nullptr;
+        }
+
+        Buffer &operator=(Buffer other) noexcept {
+            std::swap(block_, other.block_);
+            return *this;
+        }
+
+        ~Buffer() {
+            if (block_ && block_->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                BufferPool::release(block_);
+            }
+        }
+
+        std::vector<unsigned char> *operator->() const { return &block_->data; }
+        std::vector<unsigned char> &operator*() const { return block_->data; }
+        explicit operator bool() const { return block_ != nullptr; }
+        // Whether this is the only reference
+        bool unique() const { return block_ && block_->references.load(std::memory_order_acquire) == 1; }
+
+    private:
+        BufferBlock *block_ = nullptr;
+    };
+}
\ No newline at end of file
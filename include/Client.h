@@ -5,6 +5,12 @@
 namespace ncnet {
     class Client : public Network {
     public:
+        // Resolves hostname with getaddrinfo and connects to its IPv6 and IPv4 addresses happy-eyeballs style,
+        // or to a unix: or shm: endpoint. Fails after the connect timeout
         virtual bool start(const std::string& hostname, int port);
+        BP_SET(connect_timeout, int) // Milliseconds for resolving and connecting, -1 waits forever. Default 5000
+
+    private:
+        int connect_timeout_ = 5000;
     };
 }
\ No newline at end of file
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Client.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ncnet {
+    // How the pool picks a connection for each packet
+    enum class Balance {
+        ROUND_ROBIN, // Rotate through connections (default)
+        LEAST_OUTSTANDING // Connection with the fewest unanswered requests, ties rotate
+    };
+
+    struct Endpoint {
+        std::string hostname; // Also unix: and shm: endpoints
+        int port;
+    };
+
+    // Keeps several connections to one or more servers, each a Client with its own network thread, and spreads
+    // packets and requests over them so throughput is not limited to a single TCP stream. Packets sent through
+    // the pool are not ordered between connections. Lost connections are replaced by a background thread,
+    // retrying with exponential backoff, so the pool returns to its configured size.
+    class ClientPool {
+    public:
+        ~ClientPool();
+
+        BP_SET(balance, Balance) // Set before sending
+        // Called for every client before it connects, including replacements on the reconnect thread
+        BP_SET(configure, const std::function<void(Client &)> &)
+
+        // Open connections to every endpoint, returns false if none connected. Failed ones are retried in the background
+        bool start(const std::vector<Endpoint> &endpoints, size_t connections_per_endpoint);
+        bool start(const std::string &hostname, int port, size_t connections);
+        void stop(); // Waits for a reconnect in progress, up to the connect timeout
+
+        // A connection refusing the packet, e.g. above its send limit or lost, passes it on to the next one
+        SendResult send_packet(Packet &&packet);
+        std::future<Packet> request(Packet &&packet, int timeout = -1); // See Network::request
+        SendResult request(Packet &&packet, const ResponseFunction &func, int timeout = -1);
+        // Registered with every client, also ones replacing lost connections. Packets arrive on the loops of the
+        // connection they came from
+        void register_transfer_loop(const TransferFunction &func);
+
+        size_t size() const { return members_.size(); } // Configured connections
+        size_t connected() const; // Connections currently open
+        // Current client of a connection, nullptr while reconnecting. Replaced once it is lost
+        std::shared_ptr<Client> get_client(size_t index) const { return std::atomic_load(&members_[index]->client); }
+        size_t get_outstanding(size_t index) const { return members_[index]->outstanding.load(); }
+
+    private:
+        struct Member {
+            Endpoint endpoint;
+            std::shared_ptr<Client> client; // Accessed atomically, swapped by the reconnect thread
+            std::atomic<size_t> outstanding{0}; // Requests sent and not yet answered, timed out or failed
+            int backoff = 0; // Milliseconds until the next reconnect attempt after a failure
+            std::chrono::steady_clock::time_point retry; // Reconnect thread only
+        };
+
+        bool connect(Member &member); // Start a configured client and make it the member's, false on failure
+        void reconnect_loop(); // Replace lost clients until stopped
+        size_t pick(); // Index of the first connection to try
+        // Offer the packet to connections starting with the picked one until one queues it
+        SendResult dispatch(const std::function<SendResult(Client &client, Member &member)> &send);
+
+        std::vector<std::unique_ptr<Member>> members_; // Fixed between start and stop
+        Balance balance_ = Balance::ROUND_ROBIN;
+        std::function<void(Client &)> configure_ = nullptr;
+        std::atomic<size_t> next_{0};
+
+        std::mutex loops_lock_;
+        std::vector<TransferFunction> loops_;
+
+        std::thread reconnect_thread_;
+        std::mutex reconnect_lock_;
+        std::condition_variable reconnect_cv_;
+        bool stop_ = false;
+        bool lost_ = false; // A send found a lost connection, check now instead of waiting for the next round
+    };
+}
\ No newline at end of file
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace ncnet {
+    // Self-contained codec producing the LZ4 block format, tuned for speed over ratio
+    class Compression {
+    public:
+        static size_t bound(size_t size); // Worst case compressed size
+        // Append compressed input to output, returns compressed size
+        static size_t compress(const unsigned char *input, size_t size, std::vector<unsigned char> &output);
+        // Append decompressed input to output, returns false if malformed or larger than max bytes
+        static bool decompress(const unsigned char *input, size_t size, std::vector<unsigned char> &output, size_t max);
+    };
+}
\ No newline at end of file
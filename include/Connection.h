@@ -1,43 +1,103 @@
 #pragma once
 
 #include "Boilerplate.h"
+#include "Flow.h"
+#include "Metrics.h"
 #include "Packet.h"
+#include "ReceiveBuffer.h"
 #include "Security.h"
+#include "SharedChannel.h"
 
-#include <list>
+#include <deque>
+#include <memory>
+#include <string>
+#include <sys/uio.h>
 
 namespace ncnet {
     class Connection {
     public:
-        explicit Connection(); // Force new connection IDs
+        explicit Connection(size_t id); // IDs are assigned by the owning reactor
         BP_SET_GET(socket, int)
         BP_SET_GET(key_exchange, bool)
+        BP_SET_GET(encoding, Encoding) // Negotiated during key exchange
         BP_GET(id, size_t)
         BP_GET(connected, bool)
         BP_GET(security, Security &)
+        BP_GET(receive_buffer, ReceiveBuffer &)
+        BP_SET_GET(zerocopy_threshold, size_t) // Send packets of at least this size with MSG_ZEROCOPY, 0 disables
+        BP_SET_GET(compression_threshold, size_t) // Compress payloads of at least this size, 0 if the peer can't decompress
+        BP_SET_GET(resume_random, const std::string &) // Sent when resuming a session, until the server answers
+        // Shared memory transport, the socket then only reports hang-ups. Closed on disconnect
+        void set_channel(std::unique_ptr<SharedChannel> channel) { channel_ = std::move(channel); }
+        SharedChannel *get_channel() { return channel_.get(); }
+
+        // Flow control
+        BP_GET(queued_bytes, size_t) // Bytes waiting in the send queue
+        size_t get_queued_packets() const;
+        BP_SET_GET(send_blocked, bool) // Above the send high watermark
+        BP_SET_GET(read_paused, bool) // Read interest removed
+        BP_SET_GET(receive_flow, const std::shared_ptr<ReceiveFlow> &) // Unhandled received packets, if limited
+
+        // Metrics, only touched by the owning network thread
+        BP_SET_GET(close_reason, Counter) // Disconnect reason counted when closed
+        void received(size_t bytes) { bytes_received_ += bytes; }
+        void received_packet() { packets_received_++; }
+        void sent(size_t bytes, size_t packets) { bytes_sent_ += bytes; packets_sent_ += packets; }
+        ConnectionMetrics get_metrics() const;
 
         // Status
         void disconnect();
-        bool has_incoming_packets() const;
         bool has_outgoing_packets() const;
 
         // Packet modifiers
-        Packet get_incoming_packet(); // Pops incoming packet if any
         Packet& get_outgoing_packet(); // Returns next packet to send
         void pop_outgoing(); // Remove first packet when done sending
-        void add_outgoing_packet(const Packet& packet); // Add packet to send
-        Packet& get_packet_skeleton(); // Get skeleton to insert data to
+        void add_outgoing_packet(Packet &&packet); // Add packet to send
+
+        // Batched sending
+        // Fill buffers with queued packets, returns amount used. Zero-copy packets are sent alone
+        size_t get_send_buffers(iovec *buffers, size_t max, bool &zerocopy);
+        void sent_data(size_t sent, bool zerocopy); // Advance queue after sending
+        void zerocopy_completed(uint32_t high); // Release packets acknowledged up to call high
+        bool sent_zerocopy() const { return zerocopy_calls_ > 0; } // Completions may be in the error queue
+        BP_SET_GET(send_in_flight, bool) // Completion-based poller is sending the front of the queue
 
     private:
         int socket_ = -1;
+        std::unique_ptr<SharedChannel> channel_;
         bool connected_ = true;
         size_t id_ = 0;
 
-        std::list<Packet> incoming_;
-        std::list<Packet> outgoing_;
+        ReceiveBuffer receive_buffer_;
+        std::deque<Packet> outgoing_;
+
+        size_t queued_bytes_ = 0;
+        bool send_in_flight_ = false;
+        bool send_blocked_ = false;
+        bool read_paused_ = false;
+        std::shared_ptr<ReceiveFlow> receive_flow_;
+
+        Counter close_reason_ = Counter::DISCONNECTS_ERROR;
+        uint64_t bytes_received_ = 0;
+        uint64_t bytes_sent_ = 0;
+        uint64_t packets_received_ = 0;
+        uint64_t packets_sent_ = 0;
+
+        // Packets sent with MSG_ZEROCOPY, kept alive until the kernel is done with them
+        struct ZerocopyPacket {
+            Packet packet;
+            uint32_t call; // Last zero-copy send touching the packet
+        };
+
+        size_t zerocopy_threshold_ = 0;
+        size_t compression_threshold_ = 0;
+        uint32_t zerocopy_calls_ = 0; // Counter matching the kernel's notification IDs
+        std::deque<ZerocopyPacket> zerocopy_pending_;
 
         // Secure transfer
         bool key_exchange_ = true;
+        Encoding encoding_ = Encoding::TEXT;
+        std::string resume_random_;
         Security security_;
     };
 }
\ No newline at end of file
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "Connection.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace ncnet {
+    // Generational slot map owning connections. IDs are laid out as
+    // [generation:24][slot:32][shard:8] which gives O(1) lookup and removal,
+    // stale IDs never resolve to a newer connection in a reused slot and
+    // connections never move once created.
+    class ConnectionTable {
+    public:
+        explicit ConnectionTable(size_t shard);
+
+        Connection &emplace(); // Create connection with a new ID
+        Connection *find(size_t id); // Returns connection or nullptr
+        bool erase(size_t id); // Destroy connection and free its slot
+        bool is_live(size_t id) const; // Thread-safe and lock-free, false once erased
+        size_t size() const;
+        bool empty() const;
+
+        // Call func for every connection
+        template<class Function>
+        void for_each(Function func) {
+            for (auto &slot : slots_) {
+                if (slot.connection) {
+                    func(*slot.connection);
+                }
+            }
+        }
+
+    private:
+        struct Slot {
+            std::unique_ptr<Connection> connection;
+            uint32_t generation = 1;
+        };
+
+        // Generation of the connection in every slot, 0 if empty, readable by any thread. Chunks never move,
+        // the directory is replaced when it grows and old ones are kept until destruction for late readers
+        struct Directory {
+            std::vector<std::atomic<uint32_t>*> chunks;
+        };
+
+        Slot *lookup(size_t id);
+        void set_live(uint32_t index, uint32_t generation); // Owner thread only
+
+        size_t shard_ = 0;
+        size_t size_ = 0;
+        std::vector<Slot> slots_;
+        std::vector<uint32_t> free_; // Unused slots
+        std::vector<std::unique_ptr<std::atomic<uint32_t>[]>> live_chunks_;
+        std::vector<std::unique_ptr<Directory>> directories_;
+        std::atomic<Directory*> directory_{nullptr};
+    };
+}
\ No newline at end of file
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "Transfer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ncnet {
+    using TransferFunction = std::function<void(Transfer&)>;
+    using BatchTransferFunction = std::function<void(std::vector<Transfer>&)>;
+
+    constexpr size_t MAX_WORKERS = 256;
+
+    // Pool of transfer loops. Every worker has its own queue and condition variable,
+    // received batches go to one worker and idle workers steal half of a busy
+    // worker's queue. With connection affinity each connection maps to one worker
+    // and nothing is stolen, so its packets are processed in order. The mapping is pinned to the workers
+    // present when the first packet arrives, workers added later are not given connections.
+    class Dispatcher {
+    public:
+        BP_SET(affinity, bool) // Set before adding workers
+        size_t add_worker(); // Returns worker index or MAX_WORKERS if full
+        bool has_workers() const;
+        void run_worker(size_t index, const TransferFunction &func); // Process packets until stopped
+        void run_batch_worker(size_t index, const BatchTransferFunction &func, size_t max); // Up to max packets per call
+
+        // Thread-safe
+        size_t push(std::list<Transfer> &transfers); // Distribute received packets, returns the deepest queue delivered to
+        void stop(); // Make all workers exit
+
+    private:
+        struct Worker {
+            std::mutex lock;
+            std::condition_variable cv;
+            std::list<Transfer> queue;
+            bool idle = false; // Waiting on cv
+            bool woken = false; // Asked to look for work to steal
+        };
+
+        // Wait for packets and move up to max of them, false when stopping
+        bool next(size_t index, std::vector<Transfer> &transfers, size_t max);
+        bool steal(size_t index); // Move half of another worker's queue, true if anything was taken
+        // Move [first, last) to the worker's queue, returns its size
+        size_t deliver(size_t index, std::list<Transfer> &transfers, std::list<Transfer>::iterator first, std::list<Transfer>::iterator last);
+        void wake_idle(size_t except); // Wake one idle worker to steal
+        size_t worker_for(size_t connection_id, size_t count) const; // Affinity mapping
+        size_t affinity_workers(); // Worker count the mapping was pinned to
+
+        bool affinity_ = false;
+        std::unique_ptr<Worker> workers_[MAX_WORKERS]; // Fixed so producers never see reallocation
+        std::atomic<size_t> worker_count_{0};
+        std::mutex add_lock_;
+        std::atomic<size_t> next_worker_{0}; // Round-robin target
+        std::atomic<size_t> idle_count_{0};
+        std::atomic<size_t> affinity_count_{0}; // 0 until the first packet is pushed
+        std::atomic<bool> stop_{false};
+    };
+}
\ No newline at end of file
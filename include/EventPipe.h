@@ -1,21 +1,18 @@
 #pragma once
 
-#include <memory>
-#include <mutex>
-
 namespace ncnet {
+    // Wakes a poller from another thread, backed by an eventfd
     class EventPipe {
     public:
         explicit EventPipe();
         ~EventPipe();
 
-        void activate(); // Trigger pipe socket
+        void activate(); // Trigger pipe socket, thread-safe
         void reset(); // Reset pipe socket
 
-        int get_socket(); // Returns writable pipe
+        int get_socket(); // Returns readable socket
 
     private:
-        int pipes_[2] = { -1, -1 };
-        std::shared_ptr<std::mutex> event_mutex_;
+        int fd_ = -1;
     };
 }
\ No newline at end of file
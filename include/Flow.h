@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+namespace ncnet {
+    // Queue limits acting as high watermark, the low watermark is half of them
+    struct QueueLimits {
+        size_t bytes = 0; // 0 is unlimited
+        size_t packets = 0; // 0 is unlimited
+    };
+
+    enum class Watermark {
+        SEND_HIGH, // send_packet returns WOULD_BLOCK for the connection until SEND_LOW
+        SEND_LOW,
+        RECEIVE_HIGH, // Reading from the connection is paused until RECEIVE_LOW
+        RECEIVE_LOW
+    };
+
+    // Whether amounts reach the limits, or have dropped to half of them
+    bool above_high(const QueueLimits &limits, size_t bytes, size_t packets);
+    bool below_low(const QueueLimits &limits, size_t bytes, size_t packets);
+
+    using WatermarkFunction = std::function<void(size_t id, Watermark watermark)>;
+
+    enum class SendResult {
+        QUEUED,
+        WOULD_BLOCK, // Over a send limit, the packet is left untouched
+        FAILED // Unknown or closed connection, stopped network, or packet above PACKET_SEND_MAX_SIZE
+    };
+
+    // Thread-safe byte and packet counters checked against limits
+    class FlowCounter {
+    public:
+        explicit FlowCounter(const QueueLimits &limits = QueueLimits()) : limits_(limits) {}
+        void set_limits(const QueueLimits &limits) { limits_ = limits; } // Not thread-safe
+        bool enabled() const { return limits_.bytes > 0 || limits_.packets > 0; }
+
+        void add(size_t bytes, size_t packets = 1);
+        void remove(size_t bytes, size_t packets = 1);
+        bool above_high() const;
+        bool below_low() const;
+
+    private:
+        QueueLimits limits_;
+        std::atomic<size_t> bytes_{0};
+        std::atomic<size_t> packets_{0};
+    };
+
+    // Received packets not yet handled by the application. Shared between the
+    // network thread pausing reads and the transfer loops releasing packets.
+    struct ReceiveFlow {
+        void release(size_t bytes); // Packet handled, resumes reading when dropping below the low watermark
+        // Drop resume once its network thread goes away, waits for a call in progress. Tickets can outlive it
+        void detach();
+
+        FlowCounter counter;
+        std::atomic<bool> paused{false}; // Reading is paused, cleared by whoever resumes
+        std::mutex resume_lock;
+        std::function<void()> resume; // Ask the network thread to resume reading, guarded by resume_lock once shared
+        std::shared_ptr<ReceiveFlow> parent; // Network total, also has to be below its low watermark
+    };
+
+    // Carried by received transfers, releases the packet from its flow when destroyed
+    class FlowTicket {
+    public:
+        FlowTicket() {}
+        FlowTicket(const std::shared_ptr<ReceiveFlow> &flow, size_t bytes);
+        FlowTicket(FlowTicket &&ticket) noexcept;
+        FlowTicket &operator=(FlowTicket &&ticket) noexcept;
+        ~FlowTicket();
+
+    private:
+        std::shared_ptr<ReceiveFlow> flow_;
+        size_t bytes_ = 0;
+    };
+}
\ No newline at end of file
@@ -1,9 +1,19 @@
 #pragma once
 
+#include <atomic>
 #include <iostream>
 #include <sstream>
 #include <mutex>
 
+// Messages below this level are compiled out, set by the build
+#ifndef NCNET_MIN_LOG_LEVEL
+#define NCNET_MIN_LOG_LEVEL ncnet::NONE
+#endif
+
+// Log with level, the message is only formatted if the level is enabled. Use as NCNET_LOG(WARN) << "text";
+#define NCNET_LOG(level) \
+    if ((level) < NCNET_MIN_LOG_LEVEL || !ncnet::Log::is_enabled(level)) {} else ncnet::Log(level)
+
 namespace ncnet {
     // Log levels/prefixes
     enum LogLevel {
@@ -19,7 +29,7 @@ namespace ncnet {
     public:
         // Creates no prefix log, always shown unless fully disabled
         Log();
-        // Log with prefix
+        // Log with prefix, prefer NCNET_LOG to skip formatting disabled messages
         Log(LogLevel level);
         // Sync and output current stream
         ~Log();
@@ -28,14 +38,23 @@ namespace ncnet {
         static void enable(bool enabled);
         // Set log level
         static void set_log_level(LogLevel level);
+        // Whether messages with level are written, lock-free
+        static bool is_enabled(LogLevel level) {
+            return enabled_.load(std::memory_order_relaxed) && level >= log_level_.load(std::memory_order_relaxed);
+        }
+
+        // Queue lines in a lock-free ring written by a background thread instead of writing under a lock.
+        // Lines are dropped if the ring is full. Disabling flushes the ring.
+        static void set_async(bool async);
 
     private:
         // Global output sync
         static std::mutex lock_;
         // Enable/disable
-        static bool enabled_;
+        static std::atomic<bool> enabled_;
         // Log level
-        static LogLevel log_level_;
+        static std::atomic<LogLevel> log_level_;
+        static std::atomic<bool> async_;
 
         // Current output prefix
         LogLevel prefix_ = LogLevel::NONE;
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace ncnet {
+    // Bounded lock-free multi-producer/multi-consumer ring (Vyukov), ABA-safe through
+    // per-cell sequence numbers. Capacity has to be a power of two.
+    template<class T>
+    class MPMCQueue {
+    public:
+        explicit MPMCQueue(size_t capacity) : cells_(new Cell[capacity]), mask_(capacity - 1) {
+            for (size_t i = 0; i < capacity; i++) {
+                cells_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        MPMCQueue(const MPMCQueue &) = delete;
+        MPMCQueue &operator=(const MPMCQueue &) = delete;
+
+        // Returns false if full, value is then left untouched
+        bool push(T &&value) {
+            auto position = enqueue_.load(std::memory_order_relaxed);
+
+            while (true) {
+                auto &cell = cells_[position & mask_];
+                auto sequence = cell.sequence.load(std::memory_order_acquire);
+                auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+                if (difference == 0) {
+                    if (enqueue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        cell.value = std::move(value);
+                        cell.sequence.store(position + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (difference < 0) {
+                    return false; // Full
+                } else {
+                    position = enqueue_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Returns false if empty
+        bool pop(T &value) {
+            auto position = dequeue_.load(std::memory_order_relaxed);
+
+            while (true) {
+                auto &cell = cells_[position & mask_];
+                auto sequence = cell.sequence.load(std::memory_order_acquire);
+                auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+
+                if (difference == 0) {
+                    if (dequeue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        value = std::move(cell.value);
+                        cell.sequence.store(position + mask_ + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (difference < 0) {
+                    return false; // Empty
+                } else {
+                    position = dequeue_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        std::unique_ptr<Cell[]> cells_;
+        size_t mask_;
+        std::atomic<size_t> enqueue_{0};
+        char padding_[64]; // Keep producer and consumer positions on separate cache lines
+        std::atomic<size_t> dequeue_{0};
+    };
+}
\ No newline at end of file
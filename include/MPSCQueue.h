@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace ncnet {
+    // Unbounded lock-free multi-producer/single-consumer queue (Vyukov). Producers
+    // only do one atomic exchange, the consumer never touches shared counters.
+    template<class T>
+    class MPSCQueue {
+    public:
+        MPSCQueue() : tail_(new Node()) {
+            head_.store(tail_, std::memory_order_relaxed);
+        }
+
+        ~MPSCQueue() {
+            T value;
+            while (pop(value)) {}
+            delete tail_;
+        }
+
+        MPSCQueue(const MPSCQueue &) = delete;
+        MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+        // Thread-safe
+        void push(T value) {
+            auto *node = new Node(std::move(value));
+            auto *previous = head_.exchange(node, std::memory_order_acq_rel);
+            previous->next.store(node, std::memory_order_release);
+        }
+
+        // Thread-safe, links all values with a single exchange and returns how many were pushed
+        template<class Iterator>
+        size_t push(Iterator first, Iterator last) {
+            if (first == last) {
+                return 0;
+            }
+
+            auto *front = new Node(std::move(*first++));
+            auto *back = front;
+            size_t count = 1;
+
+            for (; first != last; ++first, count++) {
+                auto *node = new Node(std::move(*first));
+                back->next.store(node, std::memory_order_relaxed);
+                back = node;
+            }
+
+            auto *previous = head_.exchange(back, std::memory_order_acq_rel);
+            previous->next.store(front, std::memory_order_release);
+            return count;
+        }
+
+        // Consumer only, false if empty or the next producer has not finished linking yet
+        bool pop(T &value) {
+            auto *next = tail_->next.load(std::memory_order_acquire);
+            if (next == nullptr) {
+                return false;
+            }
+
+            value = std::move(next->value);
+            delete tail_;
+            tail_ = next;
+            return true;
+        }
+
+    private:
+        struct Node {
+            Node() {}
+            explicit Node(T &&value) : value(std::move(value)) {}
+
+            std::atomic<Node*> next{nullptr};
+            T value;
+        };
+
+        std::atomic<Node*> head_; // Last pushed, written by producers
+        Node *tail_; // Already consumed, next is the front
+    };
+}
\ No newline at end of file
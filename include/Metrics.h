@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ncnet {
+    enum class Counter {
+        BYTES_RECEIVED,
+        BYTES_SENT,
+        PACKETS_RECEIVED,
+        PACKETS_SENT,
+        CONNECTIONS_OPENED, // Accepted or connected
+        DISCONNECTS_PEER, // Peer closed the connection
+        DISCONNECTS_ERROR, // Socket error
+        DISCONNECTS_PROTOCOL, // Invalid packet, key exchange or decryption
+        DISCONNECTS_LOCAL, // disconnect() or stop()
+        HANDSHAKES_FULL, // Key exchanges using DH
+        HANDSHAKES_RESUMED, // Key exchanges resuming a session
+        HANDSHAKES_PLAINTEXT, // Key exchanges skipped by peers agreeing on plaintext
+        COUNT
+    };
+
+    enum class Histogram {
+        ENCRYPT_NS,
+        DECRYPT_NS,
+        LOOP_NS, // Event loop iteration, excluding the wait
+        INCOMING_QUEUE, // Packets waiting for a transfer loop, sampled when received packets are queued
+        OUTGOING_QUEUE, // Packets drained from a network thread's outgoing queue per iteration
+        CONNECTION_QUEUE, // Packets in the connection send queue, sampled when queueing
+        COUNT
+    };
+
+    constexpr size_t COUNTER_COUNT = static_cast<size_t>(Counter::COUNT);
+    constexpr size_t HISTOGRAM_COUNT = static_cast<size_t>(Histogram::COUNT);
+
+    // Log-linear buckets with 8 sub-buckets per power of two, values are within 12.5%
+    constexpr int HISTOGRAM_SUB_BITS = 3;
+    constexpr size_t HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS;
+
+    struct HistogramSnapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        std::vector<uint64_t> buckets = std::vector<uint64_t>(HISTOGRAM_BUCKETS);
+
+        uint64_t percentile(double fraction) const; // Lower bound of the bucket holding the fraction
+        double mean() const;
+        static size_t bucket_of(uint64_t value);
+        static uint64_t bucket_value(size_t bucket); // Smallest value in bucket
+    };
+
+    struct MetricsSnapshot {
+        uint64_t counters[COUNTER_COUNT] = {};
+        HistogramSnapshot histograms[HISTOGRAM_COUNT];
+
+        uint64_t get(Counter counter) const { return counters[static_cast<size_t>(counter)]; }
+        const HistogramSnapshot &get(Histogram histogram) const { return histograms[static_cast<size_t>(histogram)]; }
+        std::string to_prometheus() const; // Prometheus text exposition format
+    };
+
+    struct ConnectionMetrics {
+        size_t id = 0;
+        uint64_t bytes_received = 0;
+        uint64_t bytes_sent = 0;
+        uint64_t packets_received = 0;
+        uint64_t packets_sent = 0;
+        size_t queued_bytes = 0;
+        size_t queued_packets = 0;
+    };
+
+    // Updated by a single thread without atomic read-modify-write, read by snapshots
+    class MetricsShard {
+    public:
+        void add(Counter counter, uint64_t amount = 1) {
+            increase(counters_[static_cast<size_t>(counter)], amount);
+        }
+
+        void record(Histogram histogram, uint64_t value) {
+            auto &data = histograms_[static_cast<size_t>(histogram)];
+            increase(data.buckets[HistogramSnapshot::bucket_of(value)], 1);
+            increase(data.count, 1);
+            increase(data.sum, value);
+
+            if (value > data.max.load(std::memory_order_relaxed)) {
+                data.max.store(value, std::memory_order_relaxed);
+            }
+        }
+
+        void merge(MetricsSnapshot &snapshot) const;
+
+    private:
+        static void increase(std::atomic<uint64_t> &value, uint64_t amount) {
+            value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+
+        struct HistogramData {
+            std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS] = {};
+            std::atomic<uint64_t> count{0};
+            std::atomic<uint64_t> sum{0};
+            std::atomic<uint64_t> max{0};
+        };
+
+        std::atomic<uint64_t> counters_[COUNTER_COUNT] = {};
+        HistogramData histograms_[HISTOGRAM_COUNT];
+    };
+
+    // Counters and histograms sharded per network thread, merged at snapshot time
+    class Metrics {
+    public:
+        MetricsShard *add_shard(); // Owned by the caller's thread, lives as long as Metrics
+        MetricsSnapshot snapshot();
+
+    private:
+        std::mutex shards_lock_;
+        std::vector<std::unique_ptr<MetricsShard>> shards_;
+    };
+}
\ No newline at end of file
@@ -1,69 +1,177 @@
 #pragma once
 
 #include "Connection.h"
-#include "EventPipe.h"
+#include "Dispatcher.h"
+#include "Metrics.h"
+#include "Poller.h"
+#include "Reactor.h"
+#include "Session.h"
 #include "Transfer.h"
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <atomic>
 #include <thread>
 #include <vector>
 #include <condition_variable>
 #include <functional>
+#include <future>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace ncnet {
-    using TransferFunction = std::function<void(Transfer&)>;
+    constexpr size_t TRANSFER_BATCH_SIZE = 64; // Default max packets per batch transfer loop call
 
     class Network {
     public:
-        static bool prepare_socket(int fd);
-        virtual void send_packet(Packet &packet, size_t peer_id = 0) final;
+        static bool prepare_socket(int fd, bool tcp = true); // Non-blocking, and TCP_NODELAY unless tcp is false
+        virtual SendResult send_packet(Packet &packet, size_t peer_id = 0) final; // Sends a copy, prefer moving the packet
+        // The packet is only moved from if it was queued. FAILED for packets above PACKET_SEND_MAX_SIZE
+        virtual SendResult send_packet(Packet &&packet, size_t peer_id = 0) final;
+        // Send many packets with one wakeup per network thread. Queued packets are removed from transfers,
+        // blocked ones are left in order. Returns the amount queued.
+        size_t send_packets(std::vector<Transfer> &transfers);
+        // Send request and wait for the peer's send_reply, timeout in ms or -1. Many requests can be outstanding
+        // per connection. The future throws if the request times out or the connection is lost.
+        std::future<Packet> request(Packet &&packet, size_t peer_id = 0, int timeout = -1);
+        // As above, func is called on a network thread with the response or nullptr. It is not called unless queued.
+        SendResult request(Packet &&packet, const ResponseFunction &func, size_t peer_id = 0, int timeout = -1);
+        SendResult send_reply(Transfer &request, Packet &&reply); // Answer a received request
+        // Send to many connections, the packet is finalized once and its buffer shared by all of them until
+        // encrypted. Connections above their send limits are skipped, WOULD_BLOCK only refers to the total limit.
+        SendResult broadcast(Packet &&packet, const std::vector<size_t> &ids);
+        SendResult broadcast(Packet &&packet, const std::string &group); // Current members of group
+        // Every connection for which predicate returns true, called on the network threads
+        SendResult broadcast(Packet &&packet, const std::function<bool(size_t id)> &predicate);
+        // Named connection groups, disconnected connections leave all groups. Thread-safe
+        void join_group(const std::string &group, size_t id);
+        void leave_group(const std::string &group, size_t id);
+        std::vector<size_t> get_group(const std::string &group);
         virtual void disconnect(size_t id) final; // Disconnect connection
         BP_SET(disconnect_callback, const std::function<void(size_t)> &)
         BP_GET(socket, int)
         BP_GET(port, int)
+        BP_SET(poller_type, PollerType) // Event loop backend, set before start
+        BP_SET(reactor_count, size_t) // Network threads in server-mode, set before start
+        BP_SET(zerocopy_threshold, size_t) // Send packets of at least this size with MSG_ZEROCOPY, 0 disables (default)
+        BP_SET_GET(encoding, Encoding) // Preferred encoding, negotiated with peers during key exchange
+        // Compress packets with payloads of at least this size if the peer supports it, 0 disables (default)
+        BP_SET(compression_threshold, size_t)
+        // Encrypt packets, default unless using unix domain sockets. Disabling only takes effect with peers which
+        // also disabled it, for trusted networks. The key exchange is then skipped
+        void set_encryption(bool encryption);
+        // Flow control, set before start. Limits are high watermarks, the low watermarks are half of them
+        BP_SET(send_limits, const QueueLimits &) // Per connection, packets are refused once the network thread queued them
+        void set_total_send_limits(const QueueLimits &limits); // All packets not yet written, checked on every send
+        BP_SET(receive_limits, const QueueLimits &) // Per connection received packets not yet handled, reading pauses above
+        BP_SET(total_receive_limits, const QueueLimits &)
+        BP_SET(watermark_callback, const WatermarkFunction &) // Called from network threads when crossing a watermark
+        // Key exchange, set before start
+        BP_SET(key_pool_size, size_t) // Key pairs generated ahead on a background thread, 0 generates when needed (default)
+        // Server-mode: issue session tickets valid for this many seconds, returning clients skip DH. 0 disables (default)
+        BP_SET(session_lifetime, int)
+        // Client-mode: resume session on start, falls back to a full key exchange if the server refuses it
+        void set_session(const Session &session);
+        Session get_session(); // Client-mode: latest ticket from the server, empty until the key exchange is done
+        Packet create_packet() const; // Returns empty packet using the preferred encoding
 
         virtual bool start(const std::string &hostname, int port) = 0;
         virtual void stop(bool wait = true) final; // Flush and shutdown
-        Transfer get_packet(); // Wait and return when a packet is received
+        bool stopping(); // Stop was called, in client-mode also once the connection to the server is lost
+        // Wait and return when a packet is received, only used when no transfer loops are registered
+        Transfer get_packet();
+        // Wait up to timeout ms (-1 forever) and append up to max received packets, returns 0 on timeout or stop
+        size_t get_packets(std::vector<Transfer> &transfers, size_t max, int timeout = -1);
         void register_transfer_loop(const TransferFunction &func);
+        // Handler is called with up to max packets at a time
+        void register_batch_transfer_loop(const BatchTransferFunction &func, size_t max = TRANSFER_BATCH_SIZE);
         void run_transfer_loop(const TransferFunction &func); // Run blocking transfer loop
+        // Process packets from a connection in order on a single transfer loop, set before registering loops.
+        // Connections are spread over the loops registered when the first packet arrives, later ones stay idle
+        void set_connection_affinity(bool affinity);
 
         // Stats
         // Returns a list of all network interfaces' IP
         std::vector<std::string> get_interface_ips() const;
-
-        // Starts internal loop
-        void run();
+        MetricsSnapshot get_metrics(); // Counters and histograms merged from all network threads
+        std::string export_metrics(); // Prometheus text exposition format
+        // Counters of every open connection, asks the network threads and waits for them to answer
+        std::vector<ConnectionMetrics> get_connection_metrics();
 
     protected:
-        void start_key_exchange(Connection &connection); // Send public keys
-        bool respond_key_exchange(Connection &connection, Transfer &transfer); // Process response from key exchange
+        friend class Reactor;
+
+        void create_reactors(size_t count); // Create reactors before adding connections
+        void start_reactors(); // Start network threads
+
+        // Parses unix:/path or unix:@name (abstract namespace) endpoints, false for other hostnames. Length is 0 if invalid.
+        // shm: instead of unix: sets shared, the socket is then only used to hand over the shared memory segment
+        static bool unix_address(const std::string &endpoint, sockaddr_un &address, socklen_t &length, bool &shared);
+        void use_local_transport(); // Unix domain sockets, encrypt only if asked to
 
-        std::thread network_; // Main network thread
         int socket_ = -1; // Main listening socket
         bool is_client_ = false;
+        bool local_ = false; // Unix domain sockets
+        bool shared_memory_ = false; // Connections exchange data through shared memory rings
+        std::string local_path_; // Socket file created by the server, removed when stopping
+        bool single_acceptor_ = false; // First reactor accepts for all reactors
         int port_ = -1;
+        size_t server_id_ = 0; // Connection ID of the server in client-mode
+        size_t reactor_count_ = 1;
 
-        std::vector<Connection> connections_; // First connection is server in client case
-        EventPipe pipe_; // Needed to interrupt when adding queued packets
+        Metrics metrics_; // Outlives the reactors writing to it
+        std::vector<std::unique_ptr<Reactor>> reactors_; // Network threads, each owning a set of connections
 
     private:
-        void sort_outgoing_packets(); // Moves outgoing packets to the correct connection queue
-        // Selects sockets to listen on
-        void select_connections(fd_set& read_set, fd_set& write_set, fd_set& error_set);
-        // Read from connection
-        bool read_data(Connection& connection);
-        // Write to connection
-        bool write_data(Connection& connection);
+        Reactor *find_reactor(size_t id); // Returns reactor owning connection ID or nullptr
+        size_t add_incoming(std::list<Transfer> &incoming); // Add packets to process queue, returns queue depth
+        size_t add_transfer_worker(); // Register transfer loop with the dispatcher
+        SendResult send_correlated(Packet &&packet, size_t peer_id); // Send keeping correlation flags
+        SendResult can_send(Reactor *reactor, size_t peer_id); // Check connection is open and send limits
+        static bool too_large(const Packet &packet); // Above PACKET_SEND_MAX_SIZE, logs the refusal
+        void push_packet(Reactor *reactor, Packet &&packet, size_t peer_id); // Hand packet to the network thread
+        size_t resolve_peer(size_t peer_id) const; // Client-mode only has the server connection
+        void notify_watermark(size_t id, Watermark watermark);
+        // Hand targets and a shared copy of the finalized packet to each network thread
+        SendResult push_broadcast(Packet &&packet, std::vector<std::shared_ptr<BroadcastTargets>> &targets);
+        void leave_groups(size_t id); // Connection was removed
+
+        PollerType poller_type_ = PollerType::EPOLL;
+        Encoding encoding_ = Encoding::TEXT;
+        size_t zerocopy_threshold_ = 0;
+        size_t compression_threshold_ = 0;
+        bool encryption_ = true;
+        bool encryption_set_ = false; // Local transports default to plaintext
+        std::atomic<uint32_t> next_correlation_id_{0};
+
+        // Key exchange
+        size_t key_pool_size_ = 0;
+        std::unique_ptr<KeyPool> key_pool_;
+        int session_lifetime_ = 0;
+        std::unique_ptr<SessionTickets> session_tickets_; // Server-mode
+        std::mutex session_lock_;
+        Session session_; // Client-mode
+
+        // Flow control
+        QueueLimits send_limits_;
+        QueueLimits receive_limits_;
+        QueueLimits total_receive_limits_;
+        FlowCounter send_total_;
+        std::shared_ptr<ReceiveFlow> receive_total_; // Parent of every connection's receive flow, if limited
+        WatermarkFunction watermark_callback_ = nullptr;
+
+        // Broadcast groups
+        std::mutex groups_lock_;
+        std::unordered_map<std::string, std::unordered_set<size_t>> groups_;
 
+        // Received packets go to the dispatcher once transfer loops are registered
+        Dispatcher dispatcher_;
         std::mutex incoming_lock_;
         std::condition_variable incoming_cv_;
         std::list<Transfer> incoming_;
-        std::mutex outgoing_lock_;
-        std::vector<Transfer> outgoing_; // Outgoing packet queue
 
-        // Disconnecting
-        std::mutex disconnect_lock_;
-        std::vector<size_t> disconnect_connections_;
+        // Disconnecting, called from network threads
         std::function<void(size_t)> disconnect_callback_ = nullptr;
 
         // Transfer lambda loops
@@ -71,7 +179,6 @@ namespace ncnet {
         std::vector<std::thread> transfer_loops_;
 
         // If the network should be stopped
-        std::mutex stop_lock_;
-        bool stop_ = false;
+        std::atomic<bool> stop_{false}; // Read on every send
     };
 }
\ No newline at end of file
@@ -1,37 +1,71 @@
 #pragma once
 
+#include "BufferPool.h"
 #include "Security.h"
 
+#include <cstdint>
 #include <memory>
 #include <vector>
 #include <sstream>
+#include <type_traits>
 
 namespace ncnet {
-    using DataType = std::shared_ptr<std::vector<unsigned char>>;
+    using DataType = Buffer;
 
     constexpr auto PACKET_HEADER_SIZE = 4; // Limits to archs where sizeof(int) == 4
     constexpr auto MEMORY_DEFAULT_SIZE = 64 * 1024; // 64 KB
 
+    // Header is [flags:8][size:24]. The flags took the top byte of what was a 32-bit size, which lowers the
+    // largest frame from 4 GiB to 16 MiB - 1. Split larger data over several packets
+    constexpr size_t PACKET_MAX_SIZE = (1 << 24) - 1;
+    constexpr unsigned char PACKET_FLAG_BINARY = 1 << 0; // Payload uses Encoding::BINARY
+    constexpr unsigned char PACKET_FLAG_REQUEST = 1 << 1; // Expects a response, correlation ID follows the payload
+    constexpr unsigned char PACKET_FLAG_RESPONSE = 1 << 2; // Answers the request with the same correlation ID
+    constexpr unsigned char PACKET_FLAG_COMPRESSED = 1 << 3; // Payload is compressed, original size comes first
+    constexpr size_t PACKET_CORRELATION_SIZE = 4;
+    constexpr size_t PACKET_ORIGINAL_SIZE = 3; // Size of the uncompressed payload
+    // Largest packet the network accepts for sending, leaves room for the correlation ID and encryption
+    constexpr size_t PACKET_SEND_MAX_SIZE = PACKET_MAX_SIZE - PACKET_CORRELATION_SIZE - ENCRYPTION_OVERHEAD;
+
+    // How values are serialized by operator<< and operator>>
+    enum class Encoding : unsigned char {
+        TEXT, // Length-prefixed decimal strings, the default
+        BINARY // Varint/zigzag integers, raw IEEE-754 floats and varint string lengths
+    };
+
     class Packet {
     public:
         // Common
-        explicit Packet();
+        explicit Packet(Encoding encoding = Encoding::TEXT);
+        Encoding get_encoding() const;
+
+        // Packets are move-only, the payload is handed over from socket to handler without copies
+        Packet(Packet &&packet) = default;
+        Packet &operator=(Packet &&packet) = default;
+        Packet(const Packet &packet) = delete;
+        Packet &operator=(const Packet &packet) = delete;
+        Packet clone() const; // Explicit deep copy
+        Packet share() const; // Copy sharing the finalized buffer, for sending the same data to many connections
 
         // Receiving
-        unsigned char *get_writable_buffer(size_t size); // Returns allocated buffer
-        bool added_data(size_t size); // How much data was inserted? Disconnect on false
-        size_t left_in_packet() const; // Bytes left to receive
-        bool has_received_full_packet() const; // If full packet is received
+        explicit Packet(const unsigned char *frame, size_t size); // Copy received frame
+        static size_t frame_size(const unsigned char *header); // Full frame size from header
 
         // Sending
         void finalize(); // Calculate header size and packet data for sending
         unsigned char *get_send_buffer(); // Get current array for sending
         size_t left_to_send() const; // Bytes left to send
+        size_t size() const; // Full size including header
         bool sent_data(size_t sent); // Sent bytes
 
         // Adding
         template<class T>
         void add_data(T val) {
+            if (encoding_ == Encoding::BINARY) {
+                add_binary(static_cast<BinaryType<T>>(val));
+                return;
+            }
+
             auto str = std::to_string(val);
             data_->push_back(str.length());
             data_->insert(data_->end(), str.begin(), str.end());
@@ -57,6 +91,19 @@ namespace ncnet {
         // Reading
         template<class T>
         void read_data(T &val) {
+            if (encoding_ == Encoding::BINARY) {
+                BinaryType<T> raw;
+                read_binary(raw);
+                val = static_cast<T>(raw);
+
+                // Integers must fit the requested type
+                if (std::is_integral<T>::value && static_cast<BinaryType<T>>(val) != raw) {
+                    handle_error("Value out of range");
+                }
+
+                return;
+            }
+
             auto len = data_->at(read_position_++);
             auto str = std::string(data_->begin() + read_position_, data_->begin() + read_position_ + len);
             read_position_ += len;
@@ -72,6 +119,7 @@ namespace ncnet {
 
         void read_string(std::string &val);
         unsigned char read_byte();
+        size_t left_to_read() const; // Unread payload bytes
         Packet &operator>>(bool &val);
         Packet &operator>>(short &val);
         Packet &operator>>(unsigned short &val);
@@ -86,19 +134,51 @@ namespace ncnet {
         Packet &operator>>(long double &val);
         Packet &operator>>(std::string &val);
 
-        void encrypt(Security &security);
-        void decrypt(Security &security);
+        // Request/response correlation, the ID is sent encrypted after the payload
+        void set_correlation(unsigned char flag, uint32_t id); // PACKET_FLAG_REQUEST, PACKET_FLAG_RESPONSE or 0 to clear
+        bool is_request() const;
+        bool is_response() const;
+        uint32_t get_correlation_id() const;
+
+        // Compress payloads of at least threshold bytes (0 disables) before sending, done by encrypt if not already
+        void compress(size_t threshold);
+        // Compress payloads of at least compress_threshold bytes (0 disables) before encrypting
+        void encrypt(Security &security, size_t compress_threshold = 0);
+        void decrypt(Security &security, const unsigned char *frame, size_t size); // Replace content with decrypted frame
 
     private:
+        Packet(Encoding encoding, size_t capacity); // Reserve capacity bytes from the buffer pool
+        Packet(const DataType &data, Encoding encoding); // Reference existing buffer
+        // Wire type used for T in binary mode, long double is sent as double
+        template<class T>
+        using BinaryType = typename std::conditional<std::is_floating_point<T>::value,
+            typename std::conditional<std::is_same<T, float>::value, float, double>::type,
+            typename std::conditional<std::is_signed<T>::value, long long, unsigned long long>::type>::type;
+
+        void add_binary(unsigned long long val); // Varint
+        void add_binary(long long val); // Zigzag varint
+        void add_binary(float val); // IEEE-754 binary32, little-endian
+        void add_binary(double val); // IEEE-754 binary64, little-endian
+        void read_binary(unsigned long long &val);
+        void read_binary(long long &val);
+        void read_binary(float &val);
+        void read_binary(double &val);
+        void add_fixed(unsigned long long bits, size_t bytes); // Little-endian
+        unsigned long long read_fixed(size_t bytes);
+
+        void read_header(const unsigned char *header); // Read flags from header
+        void read_correlation(); // Strip correlation ID from received payload
+        void decompress(); // Restore received compressed payload
         void set_packet_size(); // Calculate the packet size
+        unsigned char get_flags() const; // First header byte
         void handle_error(const std::string &message) const; // Do something clever with errors
 
         // Common
         DataType data_;
-
-        // Receiving
-        size_t added_ = 0; // Actually received bytes
-        size_t full_size_ = 0;
+        Encoding encoding_ = Encoding::TEXT;
+        unsigned char correlation_flag_ = 0;
+        uint32_t correlation_id_ = 0;
+        bool compressed_ = false;
 
         // Sending
         size_t sent_ = 0; // Actually sent bytes
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <sys/uio.h>
+
+namespace ncnet {
+    // Event loop backends
+    enum class PollerType {
+        EPOLL, // Edge-triggered epoll (default)
+        POLL, // Level-triggered poll(), kept for comparison
+        IO_URING // Completion-based io_uring, falls back to epoll if the kernel lacks support (needs 6.0)
+    };
+
+    // Readiness flags reported by Poller::wait
+    enum PollEvent {
+        POLL_EVENT_READ = 1 << 0,
+        POLL_EVENT_WRITE = 1 << 1,
+        POLL_EVENT_ERROR = 1 << 2,
+        // Completion-based backends only
+        POLL_EVENT_ACCEPTED = 1 << 3, // Result is the accepted socket or -errno
+        POLL_EVENT_RECEIVED = 1 << 4, // Result bytes are in data, 0 if the peer closed or -errno
+        POLL_EVENT_SENT = 1 << 5 // Result bytes of the pending send were written or -errno
+    };
+
+    struct PollResult {
+        size_t token; // Token supplied when the socket was added
+        int events; // Mask of PollEvent
+        int result = 0; // Completion-based backends
+        const unsigned char *data = nullptr; // Received bytes, valid until the next wait
+    };
+
+    // Sockets are registered once and report readiness using the supplied token.
+    // Users must read and write until EAGAIN since backends may be edge-triggered.
+    // Completion-based backends read and write themselves: added sockets report received data instead
+    // of readiness, writes go through send() and write interest is ignored.
+    class Poller {
+    public:
+        // Returns the requested backend, io_uring falls back to epoll and epoll to poll() if unavailable
+        static std::unique_ptr<Poller> create(PollerType type);
+        virtual ~Poller() {}
+
+        // Start listening for read readiness, and write readiness if write is set
+        virtual bool add(int fd, size_t token, bool write) = 0;
+        // Change read and write interest for an added socket, errors and hang-ups are always reported
+        virtual bool set_events(int fd, size_t token, bool read, bool write) = 0;
+        // Stop listening, must be called before closing the socket
+        virtual bool remove(int fd) = 0;
+        // Wait for events, timeout is in milliseconds (-1 waits forever)
+        virtual bool wait(std::vector<PollResult> &results, int timeout) = 0;
+
+        virtual bool is_completion_based() const { return false; }
+        // Completion-based: report accepted sockets until removed
+        virtual bool accept(int /* fd */, size_t /* token */) { return false; }
+        // Completion-based: one send at a time per socket, the buffers must stay valid until it is reported
+        virtual bool send(int /* fd */, size_t /* token */, const iovec * /* buffers */, size_t /* count */) { return false; }
+    };
+}
\ No newline at end of file
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "ConnectionTable.h"
+#include "EventPipe.h"
+#include "Metrics.h"
+#include "MPSCQueue.h"
+#include "Poller.h"
+#include "Transfer.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace ncnet {
+    class Network;
+
+    // Called with the response, or nullptr if the request timed out or the connection was lost
+    using ResponseFunction = std::function<void(Packet *response)>;
+
+    // Connection IDs carry the index of the owning reactor in the lowest bits
+    constexpr auto REACTOR_SHARD_BITS = 8;
+    constexpr size_t MAX_REACTORS = 1 << REACTOR_SHARD_BITS;
+    constexpr size_t RESUME_ALL = SIZE_MAX;
+
+    // A reactor owns a disjoint set of connections and runs their event loop on its own thread.
+    class Reactor {
+    public:
+        explicit Reactor(Network &network, size_t index);
+        BP_GET(index, size_t)
+        BP_SET(listen_socket, int) // Accept connections on this socket, set before start
+
+        // Returns index of the reactor owning the connection ID
+        static size_t shard_of(size_t id);
+
+        // Create connection for already connected socket, not thread-safe
+        Connection &add_connection(int fd);
+        void start_key_exchange(Connection &connection); // Send public keys
+
+        void start(); // Start event loop thread
+        void join(); // Wait for event loop to exit
+        void wake(); // Interrupt event loop
+
+        // Thread-safe
+        void send_packet(Transfer &&transfer); // Queue packet for owned connection
+        void send_packets(std::vector<Transfer> &transfers); // Queue all with a single wakeup, moves packets out
+        void disconnect(size_t id); // Disconnect owned connection
+        void adopt(int fd); // Take ownership of accepted socket
+        // Wait for response with correlation ID from connection, timeout in ms or -1. Returns false without
+        // registering if the connection is closed or the event loop has exited
+        bool add_request(uint32_t id, size_t connection_id, const ResponseFunction &func, int timeout);
+        bool is_send_blocked(size_t id); // Connection is above its send high watermark
+        bool is_live(size_t id) const; // Connection exists and was not removed yet, lock-free
+        void resume_reading(size_t id); // Receive flow dropped below the low watermark, RESUME_ALL for every connection
+        void get_connection_metrics(std::vector<ConnectionMetrics> &metrics); // Append owned connections, waits for the event loop
+
+    private:
+        // Process response from key exchange, the connection leaves key exchange when done
+        bool respond_key_exchange(Connection &connection, Packet &packet);
+        void prepare_keys(Connection &connection); // Set key pairs from the pool, or generate them
+        void run(); // Event loop
+        // Moves outgoing packets to the correct connection queue, returns true if producers are still pushing
+        bool sort_outgoing_packets();
+        // Encrypt and queue transfer, returns false if it has to wait for key exchange
+        bool dispatch_transfer(Transfer &transfer);
+        void dispatch_broadcast(Transfer &transfer); // Queue shared packet for every targeted connection
+        void adopt_sockets(); // Register sockets handed over by the acceptor
+        // Queue packet on connection, enabling write interest if the queue was empty
+        void queue_packet(Connection &connection, Packet &&packet);
+        // Returns connection with ID or nullptr
+        Connection *find_connection(size_t id);
+        // Unregister from poller and close socket
+        void close_connection(Connection &connection);
+        // Accept all pending connections on the listening socket
+        void accept_connections();
+        void accepted(int fd); // Keep the accepted socket or hand it to another reactor
+        bool register_connection(Connection &connection); // Add socket, and eventfd of shared memory connections, to the poller
+        // Read from connection
+        bool read_data(Connection& connection);
+        // Handle bytes added to the receive buffer, returns false if the connection has to be closed
+        bool process_received(Connection &connection, size_t received);
+        // Write to connection
+        bool write_data(Connection& connection);
+        void sent_bytes(Connection &connection, size_t sent, bool zerocopy); // Advance the queue and account for it
+        // Completion-based poller: handle received data and finished sends, submit the next send
+        bool receive_completed(Connection &connection, int result, const unsigned char *data);
+        bool send_completed(Connection &connection, int result);
+        bool submit_send(Connection &connection);
+        // Shared memory connections: receive the rings once accepted, then read and write whenever woken
+        bool service_channel(Connection &connection);
+        void write_pending(); // Write connections without writable events which got packets queued
+        // Handle error event, returns false if the connection is broken
+        bool check_socket_error(Connection &connection);
+        // Pass response to its waiting request, returns false if nobody is waiting
+        bool complete_request(size_t connection_id, Packet &packet);
+        int expire_requests(); // Fail timed out requests, returns ms until the next deadline or -1
+        void fail_request(uint32_t id); // Request could not be sent
+        void fail_requests(size_t connection_id); // Connection is lost
+        // Flow control
+        void update_events(Connection &connection); // Poll for reading unless paused, writing if packets are queued
+        void check_send_watermark(Connection &connection); // Block or unblock sending after the queue changed
+        bool pause_reading(Connection &connection); // Pause if above receive limits, returns true if paused
+        void resume_connection(Connection &connection); // Enable reading again
+        void resume_connections(); // Handle resume requests from transfer loops
+        void sent_queued(size_t bytes, size_t packets); // Packets left the send queues
+        void answer_metrics_requests(bool exiting); // Fill waiting get_connection_metrics calls
+
+        Network &network_;
+        size_t index_ = 0;
+        size_t next_acceptor_target_ = 0; // Round-robin when only this reactor accepts
+
+        std::thread thread_;
+        int listen_socket_ = -1;
+        std::unique_ptr<Poller> poller_;
+        bool completion_ = false; // Poller reads and writes itself
+        EventPipe pipe_; // Needed to interrupt when adding queued packets
+
+        std::vector<iovec> send_buffers_; // Scratch space for batched sends
+        ConnectionTable connections_; // Only connection is server in client case
+        std::vector<size_t> closed_; // Connections to remove after this iteration
+        std::vector<size_t> pending_writes_; // Shared memory and completion-based connections to write before polling
+        std::vector<size_t> writing_;
+
+        // Only the producer that finds the queue empty wakes the reactor
+        MPSCQueue<Transfer> outgoing_; // Outgoing packet queue
+        std::atomic<size_t> outgoing_pending_{0}; // Pushed but not yet popped
+        std::vector<Transfer> held_; // Waiting for key exchange, reactor thread only
+
+        std::mutex adopted_lock_;
+        std::vector<int> adopted_; // Sockets accepted by another reactor
+
+        // Outstanding requests, the deadline heap may contain already completed requests
+        struct Request {
+            size_t connection_id;
+            ResponseFunction func;
+        };
+
+        using Deadline = std::pair<std::chrono::steady_clock::time_point, uint32_t>;
+
+        std::mutex requests_lock_;
+        std::unordered_map<uint32_t, Request> requests_;
+        std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> request_deadlines_;
+        std::atomic<bool> has_deadlines_{false};
+        bool exited_ = false; // Nobody answers requests anymore
+
+        // Flow control, blocked connections are looked up by sending threads
+        std::mutex flow_lock_;
+        std::unordered_set<size_t> send_blocked_;
+        std::atomic<size_t> send_blocked_count_{0};
+        std::vector<size_t> resumes_;
+
+        // Metrics, the shard is only written by this reactor's thread
+        MetricsShard *metrics_ = nullptr;
+        std::mutex metrics_lock_;
+        std::condition_variable metrics_cv_;
+        std::vector<std::vector<ConnectionMetrics>*> metrics_requests_;
+        uint64_t metrics_answers_ = 0; // Increased every time requests are answered
+        bool running_ = false; // Event loop answers requests
+
+        // Disconnecting
+        std::mutex disconnect_lock_;
+        std::vector<size_t> disconnect_connections_;
+    };
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "Packet.h"
+
+#include <vector>
+
+namespace ncnet {
+    // View of a complete frame, header included
+    struct Frame {
+        const unsigned char *data = nullptr;
+        size_t size = 0;
+    };
+
+    enum class FrameStatus {
+        COMPLETE, // Frame is returned
+        INCOMPLETE, // Wait for more data
+        INVALID // Bad header, disconnect
+    };
+
+    // Per-connection receive slab. Each recv() fills as much as possible and
+    // complete frames are returned as views, avoiding a recv() per header and body.
+    class ReceiveBuffer {
+    public:
+        explicit ReceiveBuffer(size_t capacity = MEMORY_DEFAULT_SIZE);
+
+        // Returns free space at the end, compacting or growing to fit the pending frame
+        unsigned char *get_writable_buffer(size_t &size);
+        void added_data(size_t size); // How much data was inserted
+        // Slice next frame, views are valid until the next get_writable_buffer
+        FrameStatus next_frame(Frame &frame);
+
+    private:
+        size_t pending_frame_size() const; // Size of frame at begin_ or 0 if header is incomplete
+
+        std::vector<unsigned char> data_;
+        size_t capacity_ = 0; // Default size to shrink back to
+        size_t begin_ = 0; // First unparsed byte
+        size_t end_ = 0; // End of received data
+    };
+}
\ No newline at end of file
@@ -4,32 +4,61 @@
 #include <cryptopp/osrng.h>
 #include <cryptopp/dh.h>
 #include <cryptopp/dh2.h>
+#include <cryptopp/aes.h>
+#include <cryptopp/gcm.h>
+
+#include <cstdint>
+#include <string>
 
 #if defined(CRYPTOPP_NO_GLOBAL_BYTE)
   using CryptoPP::byte;
 #endif
 
 namespace ncnet {
+    constexpr size_t ENCRYPTION_TAG_SIZE = 12; // GCM authentication tag
+    constexpr size_t ENCRYPTION_COUNTER_SIZE = 8; // Sent part of the nonce
+    constexpr size_t ENCRYPTION_OVERHEAD = ENCRYPTION_TAG_SIZE + ENCRYPTION_COUNTER_SIZE; // Bytes added by encrypt
+
     struct KeyPair {
         std::shared_ptr<CryptoPP::SecByteBlock> priv;
         std::shared_ptr<CryptoPP::SecByteBlock> pub;
     };
 
+    struct SecurityKeys {
+        KeyPair dh;
+        KeyPair sign;
+    };
+
     class Security {
     public:
-        explicit Security();
+        explicit Security(bool generate_keys = true); // Without keys, set_keys has to be called before the key exchange
+        static SecurityKeys create_keys(); // Generate key pairs, the expensive part of a full key exchange
+        void set_keys(SecurityKeys &&keys);
+        bool has_keys() const;
         std::string get_pub_dh_key() const;
         std::string get_pub_sign_key() const;
         // Returns string consisting of [Encrypted CEK][CMAC]
         std::string compute_shared_key(const std::string &client_dh_pub, const std::string &client_sign_pub);
         // Reads the string generated by compute_shared_key and sets the CEK
         void set_encrypted_cek(const std::string &cek);
-        // Encrypt plain using CEK and place it in cipher
-        void encrypt(const std::shared_ptr<std::vector<byte>> &plain, size_t start, std::shared_ptr<std::vector<byte>> &cipher);
-        // Decrypt cipher using CEK and place it in plain
-        void decrypt(const std::shared_ptr<std::vector<byte>> &cipher, size_t start, std::shared_ptr<std::vector<byte>> &plain);
+        // Encrypt data after start in place and append [Tag][Counter]. The header flags stay readable but are
+        // authenticated, so they can't be changed on the way
+        void encrypt(std::vector<byte> &data, size_t start, byte flags);
+        // Decrypt size bytes of cipher using CEK and place it in plain after start, flags as received
+        void decrypt(const byte *cipher, size_t size, size_t start, byte flags, std::vector<byte> &plain);
+        // Plaintext mode when disabled, encrypt does nothing and decrypt copies
+        void set_enabled(bool enabled);
+        bool is_enabled() const;
+
+        // Session resumption
+        std::string get_resumption_secret() const; // Derived from the CEK, known by both sides after the key exchange
+        // Derive a new CEK from a previous session's secret and both sides' random values, skipping DH
+        void resume(const std::string &secret, const std::string &client_random, const std::string &server_random, bool server);
+        std::string create_random(size_t size);
 
     private:
+        void set_cek(const CryptoPP::SecByteBlock &cek, bool server); // Key the ciphers once and pick nonce directions
+
         std::shared_ptr<CryptoPP::DH> dh_; // D-H parameters environment
         std::shared_ptr<CryptoPP::DH2> dh2_; // Key generator
         KeyPair dh_key_; // Key exchange keys
@@ -37,5 +66,14 @@ namespace ncnet {
         std::shared_ptr<CryptoPP::SecByteBlock> shared_key_; // Shared secret
         std::shared_ptr<CryptoPP::SecByteBlock> cek_; // Content encryption key, also shared secret
         std::shared_ptr<CryptoPP::AutoSeededRandomPool> rnd_; // Random generator pool
+
+        // Nonces are [Direction][Counter], the direction keeps both sides from reusing a nonce
+        CryptoPP::GCM<CryptoPP::AES>::Encryption encryption_;
+        CryptoPP::GCM<CryptoPP::AES>::Decryption decryption_;
+        uint32_t send_direction_ = 0;
+        uint32_t receive_direction_ = 0;
+        uint64_t send_counter_ = 0; // Last used
+        uint64_t receive_counter_ = 0; // Last accepted, has to increase
+        bool enabled_ = true;
     };
 }
\ No newline at end of file
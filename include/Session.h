@@ -0,0 +1,52 @@
+#pragma once
+
+#include "Security.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace ncnet {
+    // Resumable session kept by clients, valid until the server's ticket expires
+    struct Session {
+        std::string ticket; // Opaque, sealed by the server
+        std::string secret; // Resumption secret of the previous connection
+
+        bool empty() const { return ticket.empty(); }
+    };
+
+    // Stateless session tickets, the server seals the resumption secret with its own key.
+    // Tickets from other processes or older keys fail to open and fall back to a full key exchange.
+    class SessionTickets {
+    public:
+        explicit SessionTickets(int lifetime); // Seconds a ticket is accepted
+        std::string issue(const std::string &secret); // Thread-safe
+        bool open(const std::string &ticket, std::string &secret); // False if expired or not ours, thread-safe
+
+    private:
+        CryptoPP::SecByteBlock key_;
+        int lifetime_ = 0;
+    };
+
+    // Key pairs generated ahead of time on a background thread
+    class KeyPool {
+    public:
+        explicit KeyPool(size_t size); // Keeps up to size key pairs ready
+        ~KeyPool();
+
+        bool take(SecurityKeys &keys); // Never blocks, false if empty
+
+    private:
+        void run();
+
+        size_t size_ = 0;
+        std::mutex lock_;
+        std::condition_variable cv_;
+        std::deque<SecurityKeys> keys_;
+        bool stop_ = false;
+        std::thread thread_;
+    };
+}
\ No newline at end of file
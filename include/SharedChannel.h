@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <sys/uio.h>
+
+namespace ncnet {
+    constexpr size_t SHARED_RING_SIZE = 1 << 20; // Bytes buffered per direction
+
+    struct SharedRing;
+
+    // Pair of single-producer single-consumer byte rings in a shared memory segment, one per direction.
+    // Each side has an eventfd which the peer signals when the ring it reads was empty and got data,
+    // or when the ring it writes was full and got space. Created by the client and handed to the server
+    // over the unix domain socket, which stays open to report hang-ups.
+    class SharedChannel {
+    public:
+        static std::unique_ptr<SharedChannel> create(size_t capacity); // Client side, nullptr on failure
+        // Server side, nullptr on failure or if nothing arrived yet, in which case would_block is set
+        static std::unique_ptr<SharedChannel> receive(int socket, bool &would_block);
+        ~SharedChannel();
+
+        bool send_descriptors(int socket); // Hand the segment and eventfds to the server, blocking
+
+        // Copy as much as fits, returns bytes written. The peer wakes us once it made space.
+        // Both return -1 with errno EPROTO if the peer left the ring indices inconsistent
+        ssize_t write(const iovec *buffers, size_t count);
+        ssize_t read(void *buffer, size_t size); // Returns bytes read, 0 if empty
+        bool reset(); // Clear our eventfd, false if nobody signaled it
+        void wake(); // Signal our own eventfd
+        int get_socket() const { return own_event_; } // Readable when signaled
+
+    private:
+        SharedChannel(void *memory, size_t size, size_t capacity, bool client, int own_event, int peer_event);
+
+        void *memory_ = nullptr;
+        size_t size_ = 0;
+        size_t capacity_ = 0; // Power of two
+        SharedRing *in_ = nullptr;
+        SharedRing *out_ = nullptr;
+        char *in_data_ = nullptr;
+        char *out_data_ = nullptr;
+        int memory_fd_ = -1; // Until sent to the server
+        int own_event_ = -1;
+        int peer_event_ = -1;
+    };
+}
\ No newline at end of file
@@ -2,22 +2,43 @@
 
 #include "Packet.h"
 #include "Boilerplate.h"
+#include "Flow.h"
 
 #include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
 
 namespace ncnet {
-    // Transfer composes a struct of a connection ID and a Packet.
+    // Receivers of a broadcast owned by one network thread
+    struct BroadcastTargets {
+        std::vector<size_t> ids; // Used unless predicate is set
+        std::function<bool(size_t id)> predicate; // Called on the network thread for every connection
+    };
+
+    // Transfer composes a struct of a connection ID and a Packet. Move-only like Packet.
     class Transfer {
     public:
         Transfer() {}
-        Transfer(size_t connection_id, const Packet &packet) : connection_id_(connection_id), packet_(packet) {}
+        Transfer(size_t connection_id, Packet &&packet) : connection_id_(connection_id), packet_(std::move(packet)) {}
+        // Received packet counted against receive limits until the transfer is destroyed
+        Transfer(size_t connection_id, Packet &&packet, FlowTicket &&ticket) :
+            connection_id_(connection_id), packet_(std::move(packet)), ticket_(std::move(ticket)) {}
+        // Packet for many connections, fanned out by the network thread
+        Transfer(const std::shared_ptr<const BroadcastTargets> &targets, Packet &&packet) :
+            packet_(std::move(packet)), broadcast_(targets) {}
         BP_SET_GET(connection_id, size_t)
-        BP_SET_GET(packet, Packet &)
+        BP_GET(packet, Packet &)
+        void set_packet(Packet &&packet) { packet_ = std::move(packet); }
         BP_SET_GET(is_exit, bool)
+        BP_GET(broadcast, const std::shared_ptr<const BroadcastTargets> &)
 
     private:
         size_t connection_id_ = 0;
         Packet packet_;
+        FlowTicket ticket_;
+        std::shared_ptr<const BroadcastTargets> broadcast_;
         bool is_exit_ = false;
     };
 }
\ No newline at end of file
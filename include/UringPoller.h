@@ -0,0 +1,93 @@
+#pragma once
+
+#include "Poller.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+namespace ncnet {
+    // Completion-based io_uring backend using raw syscalls. Listening sockets use multishot accept and
+    // other sockets multishot recv into a registered ring of provided buffers. Sends are queued as SQEs
+    // and submitted together with waiting, one io_uring_enter per loop iteration covers every connection.
+    // Other descriptors, like eventfds, are watched with multishot poll.
+    class UringPoller : public Poller {
+    public:
+        explicit UringPoller();
+        ~UringPoller();
+
+        bool valid() const; // Kernel supports every operation used
+
+        bool add(int fd, size_t token, bool write) override;
+        bool set_events(int fd, size_t token, bool read, bool write) override;
+        bool remove(int fd) override; // Waits until a pending send let go of its buffers
+        bool wait(std::vector<PollResult> &results, int timeout) override;
+
+        bool is_completion_based() const override { return true; }
+        bool accept(int fd, size_t token) override;
+        bool send(int fd, size_t token, const iovec *buffers, size_t count) override;
+
+    private:
+        // Completions are dropped once the descriptor is removed, IDs are never reused unlike descriptors
+        struct Registration {
+            int fd = -1;
+            size_t token = 0;
+            uint8_t operation = 0; // Multishot recv, poll or accept
+            bool read = true; // Wanted by the user
+            bool armed = false; // Multishot operation active until its final completion
+            bool cancelling = false;
+            bool sending = false;
+            std::vector<iovec> send_buffers; // Kept until the send completes
+            msghdr message;
+        };
+
+        bool setup(unsigned flags); // Create and map the rings, false if a required feature is missing
+        void teardown();
+        bool register_buffers();
+        io_uring_sqe *get_sqe(uint8_t operation, int fd, uint64_t id); // Submits if the queue is full
+        bool arm(uint64_t id, Registration &registration); // Start the multishot operation
+        void cancel(uint64_t id, uint8_t operation);
+        bool enter(unsigned min_complete, int timeout); // Submit queued entries and wait
+        void reap(std::vector<PollResult> &results, std::vector<uint16_t> &buffers); // Collect completions
+        void recycle(std::vector<uint16_t> &buffers); // Hand provided buffers back to the kernel
+        bool add_registration(int fd, size_t token, uint8_t operation);
+
+        int ring_fd_ = -1;
+
+        // Submission and completion rings shared with the kernel, mapped at once
+        void *ring_ = nullptr;
+        size_t ring_size_ = 0;
+        io_uring_sqe *sqes_ = nullptr;
+        size_t sqes_size_ = 0;
+        unsigned *sq_head_ = nullptr;
+        unsigned *sq_tail_ = nullptr;
+        unsigned *sq_array_ = nullptr;
+        unsigned sq_mask_ = 0;
+        unsigned sq_entries_ = 0;
+        unsigned sq_local_tail_ = 0; // Prepared entries, published when entering
+        unsigned *cq_head_ = nullptr;
+        unsigned *cq_tail_ = nullptr;
+        unsigned cq_mask_ = 0;
+        io_uring_cqe *cqes_ = nullptr;
+
+        // Provided buffers, the kernel picks one for every received chunk
+        io_uring_buf_ring *buffer_ring_ = nullptr;
+        size_t buffer_ring_size_ = 0;
+        std::vector<unsigned char> buffers_;
+        uint16_t buffer_tail_ = 0;
+        std::vector<uint16_t> used_buffers_; // Referenced by results of the last wait
+
+        uint64_t next_id_ = 1;
+        size_t in_flight_ = 0; // Operations without a final completion
+        std::unordered_map<uint64_t, Registration> registrations_;
+        std::unordered_map<int, uint64_t> ids_; // Descriptor -> registration
+        std::vector<uint64_t> rearm_; // Multishot operations which stopped
+        std::vector<PollResult> deferred_; // Reaped while removing, reported by the next wait
+        std::vector<uint16_t> deferred_buffers_;
+    };
+}
\ No newline at end of file
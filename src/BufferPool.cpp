@@ -0,0 +1,193 @@
+#include "BufferPool.h"
+#include "MPMCQueue.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+
+namespace ncnet {
+    static constexpr size_t CLASS_SIZES[] = { 256, 1024, 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+    static constexpr size_t CLASS_COUNT = sizeof(CLASS_SIZES) / sizeof(CLASS_SIZES[0]);
+    static constexpr size_t LOCAL_BYTES = 256 * 1024; // Per class and thread
+    static constexpr size_t GLOBAL_BYTES = 16 * 1024 * 1024; // Per class
+
+    using BlockQueue = MPMCQueue<BufferBlock*>;
+
+    struct ThreadCache;
+
+    struct GlobalPool {
+        GlobalPool() {
+            for (size_t i = 0; i < CLASS_COUNT; i++) {
+                // Power of two amount of slots, bounded by bytes
+                size_t slots = 16;
+                while (slots < 4096 && slots * 2 * CLASS_SIZES[i] <= GLOBAL_BYTES) {
+                    slots *= 2;
+                }
+
+                queues[i].reset(new BlockQueue(slots));
+            }
+        }
+
+        unique_ptr<BlockQueue> queues[CLASS_COUNT];
+        atomic<size_t> bytes_held{0};
+
+        // Counters of running threads are merged at snapshot time
+        mutex threads_lock;
+        vector<ThreadCache*> threads;
+        size_t exited_hits = 0;
+        size_t exited_misses = 0;
+    };
+
+    // Never destroyed, packets may be released during static destruction
+    static GlobalPool &global_pool() {
+        static auto *pool = new GlobalPool();
+        return *pool;
+    }
+
+    struct ThreadCache {
+        vector<BufferBlock*> blocks[CLASS_COUNT];
+
+        // Only written by the owning thread
+        atomic<size_t> hits{0};
+        atomic<size_t> misses{0};
+        atomic<size_t> bytes_held{0};
+
+        void add(atomic<size_t> &counter, size_t amount) {
+            counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+        }
+    };
+
+    static thread_local ThreadCache *local_cache = nullptr;
+    static thread_local bool local_cache_destroyed = false;
+
+    // Registers the thread cache and hands blocks to the global pool on thread exit
+    struct ThreadCacheOwner {
+        ThreadCacheOwner() {
+            auto &pool = global_pool();
+            lock_guard<mutex> lock(pool.threads_lock);
+            pool.threads.push_back(&cache);
+            local_cache = &cache;
+        }
+
+        ~ThreadCacheOwner() {
+            local_cache = nullptr;
+            local_cache_destroyed = true;
+
+            auto &pool = global_pool();
+            for (size_t i = 0; i < CLASS_COUNT; i++) {
+                for (auto *block : cache.blocks[i]) {
+                    // Another thread may take the block as soon as it is pushed
+                    auto capacity = block->data.capacity();
+                    if (pool.queues[i]->push(move(block))) {
+                        pool.bytes_held += capacity;
+                    } else {
+                        delete block;
+                    }
+                }
+            }
+
+            lock_guard<mutex> lock(pool.threads_lock);
+            pool.threads.erase(find(pool.threads.begin(), pool.threads.end(), &cache));
+            pool.exited_hits += cache.hits.load(memory_order_relaxed);
+            pool.exited_misses += cache.misses.load(memory_order_relaxed);
+        }
+
+        ThreadCache cache;
+    };
+
+    static ThreadCache *thread_cache() {
+        if (local_cache == nullptr && !local_cache_destroyed) {
+            static thread_local ThreadCacheOwner owner;
+        }
+
+        return local_cache;
+    }
+
+    // Smallest class fitting size, CLASS_COUNT if too large
+    static size_t class_for_size(size_t size) {
+        return lower_bound(CLASS_SIZES, CLASS_SIZES + CLASS_COUNT, size) - CLASS_SIZES;
+    }
+
+    BufferBlock *BufferPool::acquire(size_t size) {
+        auto &pool = global_pool();
+        auto *cache = thread_cache();
+        auto size_class = class_for_size(size);
+
+        if (size_class < CLASS_COUNT) {
+            BufferBlock *block = nullptr;
+
+            if (cache != nullptr && !cache->blocks[size_class].empty()) {
+                block = cache->blocks[size_class].back();
+                cache->blocks[size_class].pop_back();
+                cache->add(cache->bytes_held, -block->data.capacity());
+            } else if (pool.queues[size_class]->pop(block)) {
+                pool.bytes_held -= block->data.capacity();
+            }
+
+            if (block != nullptr) {
+                if (cache != nullptr) {
+                    cache->add(cache->hits, 1);
+                }
+
+                return block;
+            }
+        }
+
+        if (cache != nullptr) {
+            cache->add(cache->misses, 1);
+        }
+
+        auto *block = new BufferBlock();
+        block->data.reserve(size_class < CLASS_COUNT ? CLASS_SIZES[size_class] : size);
+        return block;
+    }
+
+    void BufferPool::release(BufferBlock *block) {
+        auto capacity = block->data.capacity();
+
+        // Largest class the capacity satisfies, huge buffers are not worth holding
+        auto size_class = class_for_size(capacity + 1);
+        if (size_class == 0 || capacity > 2 * CLASS_SIZES[CLASS_COUNT - 1]) {
+            delete block;
+            return;
+        }
+
+        size_class--;
+        block->data.clear();
+
+        auto *cache = thread_cache();
+        if (cache != nullptr && cache->blocks[size_class].size() * CLASS_SIZES[size_class] < LOCAL_BYTES) {
+            cache->blocks[size_class].push_back(block);
+            cache->add(cache->bytes_held, capacity);
+            return;
+        }
+
+        // Spill to the shared cache
+        auto &pool = global_pool();
+        if (pool.queues[size_class]->push(move(block))) {
+            pool.bytes_held += capacity;
+        } else {
+            delete block;
+        }
+    }
+
+    PoolStats BufferPool::get_stats() {
+        auto &pool = global_pool();
+        PoolStats stats;
+        stats.bytes_held = pool.bytes_held.load(memory_order_relaxed);
+
+        lock_guard<mutex> lock(pool.threads_lock);
+        stats.hits = pool.exited_hits;
+        stats.misses = pool.exited_misses;
+
+        for (auto *cache : pool.threads) {
+            stats.hits += cache->hits.load(memory_order_relaxed);
+            stats.misses += cache->misses.load(memory_order_relaxed);
+            stats.bytes_held += cache->bytes_held.load(memory_order_relaxed);
+        }
+
+        return stats;
+    }
+}
\ No newline at end of file
@@ -6,59 +6,294 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <poll.h>
 #include <string.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 using namespace std;
 
 namespace ncnet {
-    static void networking(Client& client) {
-        client.run();
-    }
+    static constexpr int ATTEMPT_DELAY_MS = 250; // Head start of each address before trying the next (RFC 8305)
 
-    bool Client::start(const string &hostname, int port) {
-        socket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (socket_ < 0) {
-            Log(ERROR) << "Failed to create main socket";
+    struct ResolvedAddress {
+        sockaddr_storage address;
+        socklen_t length;
+        int family;
+    };
+
+    // Shared with the resolving thread, which outlives callers that timed out
+    struct Resolution {
+        mutex lock;
+        condition_variable done_cv;
+        bool done = false;
+        int error = 0;
+        vector<ResolvedAddress> addresses;
+    };
+
+    // Resolve IPv6 and IPv4 addresses, getaddrinfo runs on its own thread so a slow DNS server can't block past
+    // the timeout. Returns false on failure
+    static bool resolve(const string &hostname, int port, int timeout, vector<ResolvedAddress> &addresses) {
+        auto resolution = make_shared<Resolution>();
+
+        thread([resolution, hostname, port] {
+            addrinfo hints = {};
+            hints.ai_family = AF_UNSPEC; // IPv6 + IPv4
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_protocol = IPPROTO_TCP;
+
+            addrinfo *result = nullptr;
+            auto error = getaddrinfo(hostname.c_str(), to_string(port).c_str(), &hints, &result);
+
+            // Sorted by preference (RFC 6724)
+            vector<ResolvedAddress> found;
+            for (auto *i = error == 0 ? result : nullptr; i != nullptr; i = i->ai_next) {
+                ResolvedAddress address = {};
+                memcpy(&address.address, i->ai_addr, i->ai_addrlen);
+                address.length = i->ai_addrlen;
+                address.family = i->ai_family;
+                found.push_back(address);
+            }
+
+            if (result != nullptr) {
+                freeaddrinfo(result);
+            }
+
+            lock_guard<mutex> lock(resolution->lock);
+            resolution->error = error;
+            resolution->addresses = move(found);
+            resolution->done = true;
+            resolution->done_cv.notify_all();
+        }).detach();
+
+        unique_lock<mutex> lock(resolution->lock);
+        auto done = [&resolution] { return resolution->done; };
+
+        if (timeout < 0) {
+            resolution->done_cv.wait(lock, done);
+        } else if (!resolution->done_cv.wait_for(lock, chrono::milliseconds(timeout), done)) {
+            NCNET_LOG(ERROR) << "Timed out resolving DNS hostname " << hostname;
             return false;
         }
 
-        sockaddr_in address;
-        address.sin_family = AF_INET;
-
-        hostent *hp = gethostbyname(hostname.c_str());
-        if (!hp) {
-            Log(ERROR) << "Could not resolve DNS hostname " << hostname;
-            close(socket_);
+        if (resolution->error != 0 || resolution->addresses.empty()) {
+            NCNET_LOG(ERROR) << "Could not resolve DNS hostname " << hostname << ": " << gai_strerror(resolution->error);
             return false;
         }
 
-        memcpy(reinterpret_cast<char*>(&address.sin_addr), reinterpret_cast<char*>(hp->h_addr), hp->h_length);
-        address.sin_port = htons(port);
+        addresses = move(resolution->addresses);
+        return true;
+    }
+
+    // Alternate address families, starting with the one getaddrinfo preferred
+    static vector<ResolvedAddress> interleave(const vector<ResolvedAddress> &addresses) {
+        vector<ResolvedAddress> preferred;
+        vector<ResolvedAddress> other;
+        for (auto &address : addresses) {
+            (address.family == addresses.front().family ? preferred : other).push_back(address);
+        }
+
+        vector<ResolvedAddress> ordered;
+        for (size_t i = 0; i < max(preferred.size(), other.size()); i++) {
+            if (i < preferred.size()) {
+                ordered.push_back(preferred[i]);
+            }
 
-        if (connect(socket_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
-            Log(WARN) << "Could not connect to " << hostname << ":" << port;
-            close(socket_);
-            return false;
+            if (i < other.size()) {
+                ordered.push_back(other[i]);
+            }
+        }
+
+        return ordered;
+    }
+
+    // Returns socket connected to one of the addresses or -1, timeout in ms or -1. Happy eyeballs: the next address
+    // is tried when the previous attempt failed or did not finish within the attempt delay, the first to connect wins
+    static int connect_any(const vector<ResolvedAddress> &addresses, int timeout) {
+        using Clock = chrono::steady_clock;
+        auto deadline = Clock::now() + chrono::milliseconds(max(timeout, 0));
+        auto next_attempt = Clock::now();
+        vector<pollfd> attempts;
+        size_t next = 0;
+        int connected = -1;
+
+        while (connected < 0) {
+            auto now = Clock::now();
+            if (timeout >= 0 && now >= deadline) {
+                break;
+            }
+
+            if (next < addresses.size() && (attempts.empty() || now >= next_attempt)) {
+                auto &address = addresses[next++];
+                int fd = socket(address.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+                if (fd < 0) {
+                    continue;
+                }
+
+                if (connect(fd, reinterpret_cast<const sockaddr*>(&address.address), address.length) == 0) {
+                    connected = fd;
+                    break;
+                }
+
+                if (errno != EINPROGRESS) {
+                    // E.g. no route for this family, try the next address right away
+                    close(fd);
+                    continue;
+                }
+
+                attempts.push_back({ fd, POLLOUT, 0 });
+                next_attempt = now + chrono::milliseconds(ATTEMPT_DELAY_MS);
+            }
+
+            if (attempts.empty()) {
+                if (next < addresses.size()) {
+                    continue;
+                }
+
+                break; // Every address failed
+            }
+
+            // Wake up for the next attempt or the deadline, whichever comes first
+            auto until = Clock::time_point::max();
+            if (next < addresses.size()) {
+                until = next_attempt;
+            }
+
+            if (timeout >= 0) {
+                until = min(until, deadline);
+            }
+
+            int wait = -1;
+            if (until != Clock::time_point::max()) {
+                wait = max<int>(0, chrono::duration_cast<chrono::milliseconds>(until - now).count() + 1);
+            }
+
+            if (poll(attempts.data(), attempts.size(), wait) < 0 && errno != EINTR) {
+                break;
+            }
+
+            for (size_t i = 0; i < attempts.size();) {
+                if (attempts[i].revents == 0) {
+                    i++;
+                    continue;
+                }
+
+                int error = 0;
+                socklen_t length = sizeof error;
+                if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+                    error = errno;
+                }
+
+                if (error == 0 && connected < 0) {
+                    connected = attempts[i].fd;
+                } else {
+                    close(attempts[i].fd);
+                }
+
+                // A failed attempt hands over to the next address without waiting
+                if (error != 0) {
+                    next_attempt = Clock::now();
+                }
+
+                attempts.erase(attempts.begin() + i);
+            }
+        }
+
+        // Losers and attempts still pending at the deadline
+        for (auto &attempt : attempts) {
+            close(attempt.fd);
+        }
+
+        return connected;
+    }
+
+    // Returns socket connected to the unix domain socket or -1
+    static int connect_local(const sockaddr_un &address, socklen_t length) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            NCNET_LOG(ERROR) << "Failed to create main socket";
+            return -1;
+        }
+
+        if (connect(fd, reinterpret_cast<const sockaddr*>(&address), length) < 0) {
+            close(fd);
+            return -1;
         }
 
-        // Set non-blocking and TCP_NODELAY
-        prepare_socket(socket_);
+        return fd;
+    }
+
+    bool Client::start(const string &hostname, int port) {
+        sockaddr_un local;
+        socklen_t local_length;
+        bool shared;
+        unique_ptr<SharedChannel> channel;
+
+        if (unix_address(hostname, local, local_length, shared)) {
+            // Co-located peer, the port is not used
+            socket_ = local_length > 0 ? connect_local(local, local_length) : -1;
+            if (socket_ < 0) {
+                NCNET_LOG(WARN) << "Could not connect to " << hostname;
+                return false;
+            }
+
+            // Hand the server our rings while the socket still blocks
+            if (shared) {
+                channel = SharedChannel::create(SHARED_RING_SIZE);
+                if (!channel || !channel->send_descriptors(socket_)) {
+                    close(socket_);
+                    return false;
+                }
+            }
+
+            use_local_transport();
+            shared_memory_ = shared;
+            prepare_socket(socket_, false);
+        } else {
+            auto resolve_start = chrono::steady_clock::now();
+            vector<ResolvedAddress> addresses;
+            if (!resolve(hostname, port, connect_timeout_, addresses)) {
+                return false;
+            }
+
+            // Resolving used up part of the timeout
+            auto timeout = connect_timeout_;
+            if (timeout >= 0) {
+                auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - resolve_start).count();
+                timeout = max<int>(0, timeout - elapsed);
+            }
+
+            socket_ = connect_any(interleave(addresses), timeout);
+            if (socket_ < 0) {
+                NCNET_LOG(WARN) << "Could not connect to " << hostname << ":" << port;
+                return false;
+            }
+
+            // Set non-blocking and TCP_NODELAY
+            prepare_socket(socket_);
+        }
 
         // Mark as client-mode
         is_client_ = true;
 
-        // Add server as only connection
-        connections_.emplace_back();
-        auto &connection = connections_.back();
-        connection.set_socket(socket_);
+        // Add server as only connection, a single network thread is enough
+        create_reactors(1);
+        auto &reactor = *reactors_.front();
+        auto &connection = reactor.add_connection(socket_);
+        connection.set_channel(move(channel));
+        server_id_ = connection.get_id();
 
-        Log(DEBUG) << "Connected to " << hostname << ":" << port;
+        NCNET_LOG(DEBUG) << "Connected to " << hostname << ":" << port;
 
         // Start key exchange by sending public keys
-        start_key_exchange(connection);
+        reactor.start_key_exchange(connection);
 
         // Create networking thread and start processing
-        network_ = thread(networking, ref(*this));
+        start_reactors();
         port_ = port;
 
         return true;
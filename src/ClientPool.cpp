@@ -0,0 +1,271 @@
+#include "ClientPool.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+namespace ncnet {
+    static constexpr int RECONNECT_CHECK_MS = 100; // How often connections are checked for being lost
+    static constexpr int RECONNECT_MIN_MS = 100; // Delay after the first failed reconnect, doubled after each one
+    static constexpr int RECONNECT_MAX_MS = 10000;
+
+    ClientPool::~ClientPool() {
+        stop();
+    }
+
+    bool ClientPool::start(const vector<Endpoint> &endpoints, size_t connections_per_endpoint) {
+        for (auto &endpoint : endpoints) {
+            for (size_t i = 0; i < connections_per_endpoint; i++) {
+                unique_ptr<Member> member(new Member());
+                member->endpoint = endpoint;
+
+                // Kept to be retried in the background
+                if (!connect(*member)) {
+                    member->backoff = RECONNECT_MIN_MS;
+                    member->retry = chrono::steady_clock::now() + chrono::milliseconds(member->backoff);
+                }
+
+                members_.push_back(move(member));
+            }
+        }
+
+        if (connected() == 0) {
+            members_.clear();
+            return false;
+        }
+
+        stop_ = false;
+        reconnect_thread_ = thread(&ClientPool::reconnect_loop, this);
+        return true;
+    }
+
+    bool ClientPool::start(const string &hostname, int port, size_t connections) {
+        return start({ { hostname, port } }, connections);
+    }
+
+    void ClientPool::stop() {
+        {
+            lock_guard<mutex> lock(reconnect_lock_);
+            stop_ = true;
+        }
+
+        reconnect_cv_.notify_all();
+        if (reconnect_thread_.joinable()) {
+            reconnect_thread_.join();
+        }
+
+        // Fails outstanding requests, which decrease the counters of their members
+        for (auto &member : members_) {
+            auto client = atomic_load(&member->client);
+            if (client) {
+                client->stop();
+            }
+        }
+
+        members_.clear();
+    }
+
+    bool ClientPool::connect(Member &member) {
+        auto client = make_shared<Client>();
+        if (configure_ != nullptr) {
+            configure_(*client);
+        }
+
+        if (!client->start(member.endpoint.hostname, member.endpoint.port)) {
+            NCNET_LOG(WARN) << "Pool connection to " << member.endpoint.hostname << ":" << member.endpoint.port << " failed";
+            return false;
+        }
+
+        // Loops registered meanwhile either see the new client or are in the list
+        lock_guard<mutex> lock(loops_lock_);
+        for (auto &loop : loops_) {
+            client->register_transfer_loop(loop);
+        }
+
+        atomic_store(&member.client, client);
+        return true;
+    }
+
+    void ClientPool::reconnect_loop() {
+        auto stopped = [this] {
+            lock_guard<mutex> lock(reconnect_lock_);
+            return stop_;
+        };
+
+        while (true) {
+            {
+                unique_lock<mutex> lock(reconnect_lock_);
+                reconnect_cv_.wait_for(lock, chrono::milliseconds(RECONNECT_CHECK_MS), [this] { return stop_ || lost_; });
+                if (stop_) {
+                    return;
+                }
+
+                lost_ = false;
+            }
+
+            auto now = chrono::steady_clock::now();
+            for (auto &member : members_) {
+                auto client = atomic_load(&member->client);
+                if ((client && !client->stopping()) || now < member->retry) {
+                    continue;
+                }
+
+                if (client) {
+                    NCNET_LOG(WARN) << "Pool connection to " << member->endpoint.hostname << ":" << member->endpoint.port << " lost, reconnecting";
+                    // Senders skip the member until it is replaced, stopping fails its outstanding requests
+                    atomic_store(&member->client, shared_ptr<Client>());
+                    client->stop();
+                }
+
+                if (stopped()) {
+                    return;
+                }
+
+                if (connect(*member)) {
+                    member->backoff = 0;
+                    continue;
+                }
+
+                member->backoff = member->backoff == 0 ? RECONNECT_MIN_MS : min(member->backoff * 2, RECONNECT_MAX_MS);
+                member->retry = chrono::steady_clock::now() + chrono::milliseconds(member->backoff);
+            }
+        }
+    }
+
+    size_t ClientPool::connected() const {
+        size_t count = 0;
+        for (auto &member : members_) {
+            auto client = atomic_load(&member->client);
+            if (client && !client->stopping()) {
+                count++;
+            }
+        }
+
+        return count;
+    }
+
+    size_t ClientPool::pick() {
+        auto connected = [this] (size_t index) {
+            return atomic_load(&members_[index]->client) != nullptr;
+        };
+
+        if (balance_ == Balance::ROUND_ROBIN) {
+            // Skip connections being replaced by taking the next turn, so their share is spread evenly
+            for (size_t i = 0; i < members_.size(); i++) {
+                auto index = next_++ % members_.size();
+                if (connected(index)) {
+                    return index;
+                }
+            }
+
+            return 0;
+        }
+
+        // Scan from the rotating start so ties are spread
+        auto start = next_++ % members_.size();
+        auto best = start;
+        for (size_t i = 1; i < members_.size(); i++) {
+            auto index = (start + i) % members_.size();
+            if (!connected(index)) {
+                continue;
+            }
+
+            if (!connected(best) || members_[index]->outstanding.load() < members_[best]->outstanding.load()) {
+                best = index;
+            }
+        }
+
+        return best;
+    }
+
+    SendResult ClientPool::dispatch(const function<SendResult(Client &client, Member &member)> &send) {
+        if (members_.empty()) {
+            return SendResult::FAILED;
+        }
+
+        auto first = pick();
+        auto result = SendResult::FAILED;
+
+        for (size_t i = 0; i < members_.size(); i++) {
+            auto &member = *members_[(first + i) % members_.size()];
+            auto client = atomic_load(&member.client);
+            if (!client) {
+                continue; // Reconnecting
+            }
+
+            result = send(*client, member);
+            if (result == SendResult::QUEUED) {
+                break;
+            }
+
+            if (result == SendResult::FAILED && client->stopping()) {
+                // Replace it without waiting for the next check
+                lock_guard<mutex> lock(reconnect_lock_);
+                lost_ = true;
+                reconnect_cv_.notify_one();
+            }
+        }
+
+        return result;
+    }
+
+    SendResult ClientPool::send_packet(Packet &&packet) {
+        // Only moved from once queued
+        return dispatch([&packet] (Client &client, Member &) {
+            return client.send_packet(move(packet));
+        });
+    }
+
+    SendResult ClientPool::request(Packet &&packet, const ResponseFunction &func, int timeout) {
+        return dispatch([&packet, &func, timeout] (Client &client, Member &member) {
+            // Counted before sending since the response can arrive before request returns
+            member.outstanding++;
+            auto *outstanding = &member.outstanding;
+            auto result = client.request(move(packet), [outstanding, func] (Packet *response) {
+                (*outstanding)--;
+                func(response);
+            }, 0, timeout);
+
+            if (result != SendResult::QUEUED) {
+                member.outstanding--;
+            }
+
+            return result;
+        });
+    }
+
+    future<Packet> ClientPool::request(Packet &&packet, int timeout) {
+        auto promise = make_shared<std::promise<Packet>>();
+        auto result = promise->get_future();
+
+        auto sent = request(move(packet), [promise] (Packet *response) {
+            if (response == nullptr) {
+                promise->set_exception(make_exception_ptr(runtime_error("Request timed out or connection lost")));
+            } else {
+                promise->set_value(move(*response));
+            }
+        }, timeout);
+
+        if (sent == SendResult::WOULD_BLOCK) {
+            promise->set_exception(make_exception_ptr(runtime_error("Request would block")));
+        } else if (sent == SendResult::FAILED) {
+            promise->set_exception(make_exception_ptr(runtime_error("Request could not be sent")));
+        }
+
+        return result;
+    }
+
+    void ClientPool::register_transfer_loop(const TransferFunction &func) {
+        lock_guard<mutex> lock(loops_lock_);
+        loops_.push_back(func);
+
+        for (auto &member : members_) {
+            auto client = atomic_load(&member->client);
+            if (client) {
+                client->register_transfer_loop(func);
+            }
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,229 @@
+#include "Compression.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+namespace ncnet {
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t LAST_LITERALS = 5; // Format requires the last bytes to be literals
+    static constexpr size_t MATCH_LIMIT = 12; // No match may start this close to the end
+    static constexpr size_t MAX_OFFSET = 65535;
+    static constexpr int HASH_BITS = 12;
+    static constexpr size_t RUN_MASK = 15; // Token nibble, longer lengths continue in extra bytes
+
+    static uint32_t read32(const unsigned char *data) {
+        uint32_t value;
+        memcpy(&value, data, sizeof value);
+        return value;
+    }
+
+    static size_t hash(uint32_t sequence) {
+        return (sequence * 2654435761U) >> (32 - HASH_BITS);
+    }
+
+    static uint64_t read64(const unsigned char *data) {
+        uint64_t value;
+        memcpy(&value, data, sizeof value);
+        return value;
+    }
+
+    static unsigned char *write_length(unsigned char *output, size_t length) {
+        for (length -= RUN_MASK; length >= 255; length -= 255) {
+            *output++ = 255;
+        }
+
+        *output++ = static_cast<unsigned char>(length);
+        return output;
+    }
+
+    // Returns end of written sequence
+    static unsigned char *write_sequence(unsigned char *output, const unsigned char *literals, size_t literal_length, size_t offset, size_t match_length) {
+        auto match_code = match_length > 0 ? match_length - MIN_MATCH : 0;
+        *output++ = static_cast<unsigned char>(min(literal_length, RUN_MASK) << 4 | min(match_code, RUN_MASK));
+
+        if (literal_length >= RUN_MASK) {
+            output = write_length(output, literal_length);
+        }
+
+        memcpy(output, literals, literal_length);
+        output += literal_length;
+
+        // The last sequence only has literals
+        if (match_length == 0) {
+            return output;
+        }
+
+        *output++ = static_cast<unsigned char>(offset);
+        *output++ = static_cast<unsigned char>(offset >> 8);
+
+        if (match_code >= RUN_MASK) {
+            output = write_length(output, match_code);
+        }
+
+        return output;
+    }
+
+    // Length of common prefix, compares 8 bytes at a time
+    static size_t match_length(const unsigned char *first, const unsigned char *second, const unsigned char *end) {
+        auto *start = second;
+
+        while (second + sizeof(uint64_t) <= end) {
+            auto difference = read64(first) ^ read64(second);
+            if (difference != 0) {
+                return second - start + (__builtin_ctzll(difference) >> 3);
+            }
+
+            first += sizeof(uint64_t);
+            second += sizeof(uint64_t);
+        }
+
+        while (second < end && *first == *second) {
+            first++;
+            second++;
+        }
+
+        return second - start;
+    }
+
+    size_t Compression::bound(size_t size) {
+        return size + size / 255 + 16;
+    }
+
+    size_t Compression::compress(const unsigned char *input, size_t size, vector<unsigned char> &output) {
+        // Write into the worst case size and shrink afterwards
+        auto start = output.size();
+        output.resize(start + bound(size));
+        auto *out = output.data() + start;
+        size_t anchor = 0; // Start of literals not yet written
+
+        if (size > MATCH_LIMIT) {
+            // Last position each 4 byte sequence was seen at
+            uint32_t table[1 << HASH_BITS] = {};
+            auto limit = size - MATCH_LIMIT;
+            size_t position = 0;
+            size_t misses = 0;
+
+            while (position < limit) {
+                auto sequence = read32(input + position);
+                auto &slot = table[hash(sequence)];
+                size_t candidate = slot;
+                slot = static_cast<uint32_t>(position);
+
+                if (candidate >= position || position - candidate > MAX_OFFSET || read32(input + candidate) != sequence) {
+                    // Skip faster through data which doesn't compress
+                    position += 1 + (misses++ >> 6);
+                    continue;
+                }
+
+                // Extend backwards into pending literals
+                while (position > anchor && candidate > 0 && input[position - 1] == input[candidate - 1]) {
+                    position--;
+                    candidate--;
+                }
+
+                auto length = MIN_MATCH + match_length(input + candidate + MIN_MATCH, input + position + MIN_MATCH,
+                                                       input + size - LAST_LITERALS);
+
+                out = write_sequence(out, input + anchor, position - anchor, position - candidate, length);
+                position += length;
+                anchor = position;
+                misses = 0;
+
+                // Remember the end of the match, repeats often continue from there
+                if (position < limit) {
+                    table[hash(read32(input + position - 2))] = static_cast<uint32_t>(position - 2);
+                }
+            }
+        }
+
+        out = write_sequence(out, input + anchor, size - anchor, 0, 0);
+        output.resize(out - output.data());
+        return output.size() - start;
+    }
+
+    bool Compression::decompress(const unsigned char *input, size_t size, vector<unsigned char> &output, size_t max) {
+        // Write into the largest allowed size and shrink afterwards
+        auto start = output.size();
+        output.resize(start + max);
+        auto *begin = output.data() + start;
+        auto *out = begin;
+        auto *end = begin + max;
+        size_t position = 0;
+
+        auto read_length = [&] (size_t &length) {
+            unsigned char byte;
+            do {
+                if (position >= size) {
+                    return false;
+                }
+
+                byte = input[position++];
+                length += byte;
+            } while (byte == 255);
+
+            return true;
+        };
+
+        auto fail = [&] {
+            output.resize(start);
+            return false;
+        };
+
+        while (position < size) {
+            auto token = input[position++];
+
+            size_t literals = token >> 4;
+            if (literals == RUN_MASK && !read_length(literals)) {
+                return fail();
+            }
+
+            if (literals > size - position || literals > static_cast<size_t>(end - out)) {
+                return fail();
+            }
+
+            memcpy(out, input + position, literals);
+            out += literals;
+            position += literals;
+
+            if (position == size) {
+                // Last sequence
+                output.resize(out - output.data());
+                return true;
+            }
+
+            if (size - position < 2) {
+                return fail();
+            }
+
+            size_t offset = input[position] | input[position + 1] << 8;
+            position += 2;
+
+            size_t length = token & RUN_MASK;
+            if (length == RUN_MASK && !read_length(length)) {
+                return fail();
+            }
+
+            length += MIN_MATCH;
+            if (offset == 0 || offset > static_cast<size_t>(out - begin) || length > static_cast<size_t>(end - out)) {
+                return fail();
+            }
+
+            auto *from = out - offset;
+            if (offset >= length) {
+                memcpy(out, from, length);
+            } else {
+                // Overlapping match repeats the last offset bytes
+                for (size_t i = 0; i < length; i++) {
+                    out[i] = from[i];
+                }
+            }
+
+            out += length;
+        }
+
+        return fail();
+    }
+}
\ No newline at end of file
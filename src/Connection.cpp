@@ -3,43 +3,38 @@
 
 #include <unistd.h>
 #include <cassert>
+#include <algorithm>
 
 using namespace std;
 
 namespace ncnet {
-    Connection::Connection() {
-        static size_t id;
-        id_ = ++id;
-    }
+    // Key pairs are set by the reactor, resumed sessions don't need them
+    Connection::Connection(size_t id) : id_(id), security_(false) {}
 
     void Connection::disconnect() {
         connected_ = false;
         close(socket_);
+        channel_.reset();
     }
 
-    Packet& Connection::get_packet_skeleton() {
-        if (incoming_.empty() || incoming_.back().has_received_full_packet()) {
-            incoming_.emplace_back();
-        }
-
-        return incoming_.back();
+    bool Connection::has_outgoing_packets() const {
+        return !outgoing_.empty();
     }
 
-    bool Connection::has_incoming_packets() const {
-        return incoming_.empty() ? false : incoming_.front().has_received_full_packet();
+    size_t Connection::get_queued_packets() const {
+        return outgoing_.size();
     }
 
-    Packet Connection::get_incoming_packet() {
-        assert(has_incoming_packets());
-
-        auto packet = incoming_.front();
-        incoming_.pop_front();
-
-        return packet;
-    }
-
-    bool Connection::has_outgoing_packets() const {
-        return !outgoing_.empty();
+    ConnectionMetrics Connection::get_metrics() const {
+        ConnectionMetrics metrics;
+        metrics.id = id_;
+        metrics.bytes_received = bytes_received_;
+        metrics.bytes_sent = bytes_sent_;
+        metrics.packets_received = packets_received_;
+        metrics.packets_sent = packets_sent_;
+        metrics.queued_bytes = queued_bytes_;
+        metrics.queued_packets = outgoing_.size();
+        return metrics;
     }
 
     Packet& Connection::get_outgoing_packet() {
@@ -48,10 +43,71 @@ namespace ncnet {
     }
 
     void Connection::pop_outgoing() {
+        queued_bytes_ -= outgoing_.front().size();
         outgoing_.pop_front();
     }
 
-    void Connection::add_outgoing_packet(const Packet& packet) {
-        outgoing_.push_back(packet);
+    void Connection::add_outgoing_packet(Packet &&packet) {
+        queued_bytes_ += packet.size();
+        outgoing_.push_back(move(packet));
+    }
+
+    size_t Connection::get_send_buffers(iovec *buffers, size_t max, bool &zerocopy) {
+        auto is_large = [this] (Packet &packet) {
+            return zerocopy_threshold_ > 0 && packet.size() >= zerocopy_threshold_;
+        };
+
+        zerocopy = !outgoing_.empty() && is_large(outgoing_.front());
+        if (zerocopy) {
+            max = 1;
+        }
+
+        size_t count = 0;
+        for (auto &packet : outgoing_) {
+            // Batch small packets until a zero-copy packet is reached
+            if (count == max || (count > 0 && is_large(packet))) {
+                break;
+            }
+
+            buffers[count].iov_base = packet.get_send_buffer();
+            buffers[count].iov_len = packet.left_to_send();
+            count++;
+        }
+
+        return count;
+    }
+
+    void Connection::sent_data(size_t sent, bool zerocopy) {
+        if (zerocopy) {
+            // Every successful zero-copy send gets a notification ID
+            auto call = zerocopy_calls_++;
+            auto &packet = outgoing_.front();
+
+            if (packet.sent_data(sent)) {
+                queued_bytes_ -= packet.size();
+                zerocopy_pending_.push_back({ move(packet), call });
+                outgoing_.pop_front();
+            }
+
+            return;
+        }
+
+        // Spread sent bytes over the batched packets
+        while (sent > 0) {
+            auto &packet = outgoing_.front();
+            auto amount = min(sent, packet.left_to_send());
+            sent -= amount;
+
+            if (packet.sent_data(amount)) {
+                pop_outgoing();
+            }
+        }
+    }
+
+    void Connection::zerocopy_completed(uint32_t high) {
+        // TCP completes zero-copy sends in order
+        while (!zerocopy_pending_.empty() && static_cast<int32_t>(high - zerocopy_pending_.front().call) >= 0) {
+            zerocopy_pending_.pop_front();
+        }
     }
 }
\ No newline at end of file
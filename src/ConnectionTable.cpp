@@ -0,0 +1,116 @@
+#include "ConnectionTable.h"
+#include "Reactor.h"
+
+using namespace std;
+
+namespace ncnet {
+    static constexpr auto SLOT_BITS = 32;
+    static constexpr uint32_t GENERATION_MASK = (1 << (64 - SLOT_BITS - REACTOR_SHARD_BITS)) - 1;
+    static constexpr size_t LIVE_CHUNK_SLOTS = 1024;
+
+    ConnectionTable::ConnectionTable(size_t shard) : shard_(shard) {}
+
+    Connection &ConnectionTable::emplace() {
+        uint32_t index;
+        if (free_.empty()) {
+            index = slots_.size();
+            slots_.emplace_back();
+        } else {
+            index = free_.back();
+            free_.pop_back();
+        }
+
+        auto &slot = slots_[index];
+        auto key = (static_cast<size_t>(slot.generation) << SLOT_BITS) | index;
+        slot.connection.reset(new Connection((key << REACTOR_SHARD_BITS) | shard_));
+        set_live(index, slot.generation);
+        size_++;
+
+        return *slot.connection;
+    }
+
+    ConnectionTable::Slot *ConnectionTable::lookup(size_t id) {
+        if (Reactor::shard_of(id) != shard_) {
+            return nullptr;
+        }
+
+        auto key = id >> REACTOR_SHARD_BITS;
+        auto index = key & UINT32_MAX;
+        if (index >= slots_.size()) {
+            return nullptr;
+        }
+
+        auto &slot = slots_[index];
+        if (!slot.connection || slot.generation != (key >> SLOT_BITS)) {
+            return nullptr;
+        }
+
+        return &slot;
+    }
+
+    Connection *ConnectionTable::find(size_t id) {
+        auto *slot = lookup(id);
+        return slot == nullptr ? nullptr : slot->connection.get();
+    }
+
+    bool ConnectionTable::erase(size_t id) {
+        auto *slot = lookup(id);
+        if (slot == nullptr) {
+            return false;
+        }
+
+        slot->connection.reset();
+        // Invalidate old IDs pointing to this slot, skipping 0 on wrap-around
+        slot->generation = slot->generation == GENERATION_MASK ? 1 : slot->generation + 1;
+
+        auto index = static_cast<uint32_t>(slot - slots_.data());
+        set_live(index, 0);
+        free_.push_back(index);
+        size_--;
+        return true;
+    }
+
+    void ConnectionTable::set_live(uint32_t index, uint32_t generation) {
+        auto chunk = index / LIVE_CHUNK_SLOTS;
+        if (chunk >= live_chunks_.size()) {
+            // Slots are added one at a time, so at most one chunk is missing
+            live_chunks_.emplace_back(new atomic<uint32_t>[LIVE_CHUNK_SLOTS]());
+
+            unique_ptr<Directory> directory(new Directory());
+            for (auto &live_chunk : live_chunks_) {
+                directory->chunks.push_back(live_chunk.get());
+            }
+
+            directory_.store(directory.get(), memory_order_release);
+            directories_.push_back(move(directory));
+        }
+
+        live_chunks_[chunk][index % LIVE_CHUNK_SLOTS].store(generation, memory_order_release);
+    }
+
+    bool ConnectionTable::is_live(size_t id) const {
+        auto *directory = directory_.load(memory_order_acquire);
+        if (directory == nullptr || Reactor::shard_of(id) != shard_) {
+            return false;
+        }
+
+        auto key = id >> REACTOR_SHARD_BITS;
+        auto index = key & UINT32_MAX;
+        auto chunk = index / LIVE_CHUNK_SLOTS;
+        if (chunk >= directory->chunks.size()) {
+            return false;
+        }
+
+        // Generations start at 1, empty slots hold 0
+        auto generation = key >> SLOT_BITS;
+        return generation != 0 && directory->chunks[chunk][index % LIVE_CHUNK_SLOTS].load(memory_order_acquire) == generation;
+    }
+
+    size_t ConnectionTable::size() const {
+        return size_;
+    }
+
+    bool ConnectionTable::empty() const {
+        return size_ == 0;
+    }
+}
\ No newline at end of file
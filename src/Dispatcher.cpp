@@ -0,0 +1,226 @@
+#include "Dispatcher.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <iterator>
+
+using namespace std;
+
+namespace ncnet {
+    size_t Dispatcher::add_worker() {
+        lock_guard<mutex> lock(add_lock_);
+        auto index = worker_count_.load(memory_order_relaxed);
+        if (index >= MAX_WORKERS) {
+            NCNET_LOG(ERROR) << "Too many transfer loops, max is " << MAX_WORKERS;
+            return MAX_WORKERS;
+        }
+
+        if (affinity_ && affinity_count_.load(memory_order_acquire) > 0) {
+            NCNET_LOG(WARN) << "Transfer loop added after packets arrived, connection affinity keeps it idle";
+        }
+
+        workers_[index].reset(new Worker());
+        // Publish after construction
+        worker_count_.store(index + 1, memory_order_release);
+        return index;
+    }
+
+    bool Dispatcher::has_workers() const {
+        return worker_count_.load(memory_order_acquire) > 0;
+    }
+
+    void Dispatcher::run_worker(size_t index, const TransferFunction &func) {
+        // One at a time, leaving the rest to be stolen by idle workers
+        vector<Transfer> transfers;
+        while (next(index, transfers, 1)) {
+            // Call supplied function
+            func(transfers.front());
+            transfers.clear();
+        }
+    }
+
+    void Dispatcher::run_batch_worker(size_t index, const BatchTransferFunction &func, size_t max) {
+        vector<Transfer> transfers;
+        transfers.reserve(max);
+
+        while (next(index, transfers, max)) {
+            func(transfers);
+            transfers.clear();
+        }
+    }
+
+    size_t Dispatcher::worker_for(size_t connection_id, size_t count) const {
+        // Mix the ID, the low bits only hold the reactor shard
+        return (static_cast<unsigned long long>(connection_id) * 0x9E3779B97F4A7C15ULL >> 32) % count;
+    }
+
+    size_t Dispatcher::affinity_workers() {
+        // Remapping would let a connection's queued packets run concurrently with newer ones on another worker
+        auto count = affinity_count_.load(memory_order_acquire);
+        if (count == 0) {
+            auto workers = worker_count_.load(memory_order_acquire);
+            count = affinity_count_.compare_exchange_strong(count, workers, memory_order_acq_rel) ? workers : count;
+        }
+
+        return count;
+    }
+
+    size_t Dispatcher::push(list<Transfer> &transfers) {
+        if (!affinity_) {
+            // The whole batch goes to one worker, others steal if it's busy
+            auto count = worker_count_.load(memory_order_acquire);
+            auto index = next_worker_.fetch_add(1, memory_order_relaxed) % count;
+            return deliver(index, transfers, transfers.begin(), transfers.end());
+        }
+
+        auto count = affinity_workers();
+        size_t deepest = 0;
+
+        while (!transfers.empty()) {
+            // Move packets for the same worker together
+            auto index = worker_for(transfers.front().get_connection_id(), count);
+            auto last = std::next(transfers.begin());
+            while (last != transfers.end() && worker_for(last->get_connection_id(), count) == index) {
+                ++last;
+            }
+
+            deepest = max(deepest, deliver(index, transfers, transfers.begin(), last));
+        }
+
+        return deepest;
+    }
+
+    size_t Dispatcher::deliver(size_t index, list<Transfer> &transfers, list<Transfer>::iterator first, list<Transfer>::iterator last) {
+        auto &worker = *workers_[index];
+        bool was_idle;
+        size_t queued;
+        size_t idle;
+
+        {
+            lock_guard<mutex> lock(worker.lock);
+            worker.queue.splice(worker.queue.end(), transfers, first, last);
+            was_idle = worker.idle;
+            queued = worker.queue.size();
+            // Workers going idle count themselves before taking this lock to look for work, so they are either
+            // counted here or find these packets
+            idle = idle_count_.load(memory_order_relaxed);
+        }
+
+        if (was_idle) {
+            worker.cv.notify_one();
+        }
+
+        // More work than the worker can start on right now
+        if (!affinity_ && (!was_idle || queued > 1) && idle > 0) {
+            wake_idle(index);
+        }
+
+        return queued;
+    }
+
+    void Dispatcher::wake_idle(size_t except) {
+        auto count = worker_count_.load(memory_order_acquire);
+
+        for (size_t i = 0; i < count; i++) {
+            if (i == except) {
+                continue;
+            }
+
+            auto &worker = *workers_[i];
+            unique_lock<mutex> lock(worker.lock);
+            if (worker.idle && !worker.woken) {
+                worker.woken = true;
+                lock.unlock();
+                worker.cv.notify_one();
+                return;
+            }
+        }
+    }
+
+    bool Dispatcher::steal(size_t index) {
+        auto count = worker_count_.load(memory_order_acquire);
+        list<Transfer> stolen;
+
+        for (size_t i = 1; i < count && stolen.empty(); i++) {
+            auto &victim = *workers_[(index + i) % count];
+            lock_guard<mutex> lock(victim.lock);
+
+            if (victim.queue.empty()) {
+                continue;
+            }
+
+            // Take the newest half, the owner keeps working from the front
+            auto first = victim.queue.end();
+            advance(first, -static_cast<long>((victim.queue.size() + 1) / 2));
+            stolen.splice(stolen.end(), victim.queue, first, victim.queue.end());
+        }
+
+        if (stolen.empty()) {
+            return false;
+        }
+
+        auto &worker = *workers_[index];
+        lock_guard<mutex> lock(worker.lock);
+        worker.queue.splice(worker.queue.end(), stolen);
+        return true;
+    }
+
+    bool Dispatcher::next(size_t index, vector<Transfer> &transfers, size_t max) {
+        auto &worker = *workers_[index];
+
+        while (true) {
+            {
+                lock_guard<mutex> lock(worker.lock);
+                if (stop_.load(memory_order_acquire)) {
+                    return false;
+                }
+
+                if (!worker.queue.empty()) {
+                    while (!worker.queue.empty() && transfers.size() < max) {
+                        transfers.push_back(move(worker.queue.front()));
+                        worker.queue.pop_front();
+                    }
+
+                    return true;
+                }
+            }
+
+            // Count as idle before looking at other queues, deliveries after the look then wake us
+            unique_lock<mutex> lock(worker.lock);
+            worker.idle = true;
+            idle_count_.fetch_add(1, memory_order_acq_rel);
+
+            if (!affinity_) {
+                lock.unlock();
+                auto stolen = steal(index);
+                lock.lock();
+
+                if (stolen) {
+                    worker.idle = false;
+                    worker.woken = false;
+                    idle_count_.fetch_sub(1, memory_order_acq_rel);
+                    continue;
+                }
+            }
+
+            // Nothing to do, sleep until packets are delivered or another worker needs help
+            worker.cv.wait(lock, [this, &worker] {
+                return stop_.load(memory_order_acquire) || !worker.queue.empty() || worker.woken;
+            });
+
+            worker.idle = false;
+            worker.woken = false;
+            idle_count_.fetch_sub(1, memory_order_acq_rel);
+        }
+    }
+
+    void Dispatcher::stop() {
+        stop_.store(true, memory_order_release);
+
+        auto count = worker_count_.load(memory_order_acquire);
+        for (size_t i = 0; i < count; i++) {
+            lock_guard<mutex> lock(workers_[i]->lock);
+            workers_[i]->cv.notify_all();
+        }
+    }
+}
\ No newline at end of file
@@ -1,51 +1,43 @@
 #include "EventPipe.h"
 #include "Log.h"
 
+#include <sys/eventfd.h>
 #include <unistd.h>
-#include <fcntl.h>
+#include <cstdint>
 
 using namespace std;
 
 namespace ncnet {
     EventPipe::EventPipe() {
-        event_mutex_ = make_shared<mutex>();
+        fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
-        if (pipe(pipes_) < 0) {
-            Log(ERROR) << "Failed to create pipe, won't be able to wake threads, errno = " << errno;
-        }
-
-        if (fcntl(pipes_[0], F_SETFL, O_NONBLOCK) < 0) {
-            Log(WARN) << "Failed to set pipe non-blocking mode";
+        if (fd_ < 0) {
+            NCNET_LOG(ERROR) << "Failed to create eventfd, won't be able to wake threads, errno = " << errno;
         }
     }
 
     EventPipe::~EventPipe() {
-        lock_guard<mutex> lock(*event_mutex_);
-
-        if (pipes_[0] >= 0)
-            close(pipes_[0]);
-
-        if (pipes_[1] >= 0)
-            close(pipes_[1]);
+        if (fd_ >= 0)
+            close(fd_);
     }
 
     void EventPipe::activate() {
-        lock_guard<mutex> lock(*event_mutex_);
-
-        if (write(pipes_[1], "0", 1) < 0) {
-            Log(ERROR) << "Pipe could not be activated";
+        // The kernel adds to the counter atomically, no locking needed
+        uint64_t value = 1;
+        if (write(fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+            NCNET_LOG(ERROR) << "Pipe could not be activated";
         }
     }
 
     void EventPipe::reset() {
-        lock_guard<mutex> lock(*event_mutex_);
-
-        unsigned char buffer;
-        while(read(pipes_[0], &buffer, 1) == 1) {}
+        // Reading clears the counter
+        uint64_t value;
+        if (read(fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+            NCNET_LOG(ERROR) << "Pipe could not be reset";
+        }
     }
 
     int EventPipe::get_socket() {
-        lock_guard<mutex> lock(*event_mutex_);
-        return pipes_[0];
+        return fd_;
     }
 }
\ No newline at end of file
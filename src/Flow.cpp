@@ -0,0 +1,76 @@
+#include "Flow.h"
+
+#include <utility>
+
+using namespace std;
+
+namespace ncnet {
+    bool above_high(const QueueLimits &limits, size_t bytes, size_t packets) {
+        return (limits.bytes > 0 && bytes >= limits.bytes) || (limits.packets > 0 && packets >= limits.packets);
+    }
+
+    bool below_low(const QueueLimits &limits, size_t bytes, size_t packets) {
+        return (limits.bytes == 0 || bytes <= limits.bytes / 2) && (limits.packets == 0 || packets <= limits.packets / 2);
+    }
+
+    void FlowCounter::add(size_t bytes, size_t packets) {
+        bytes_.fetch_add(bytes, memory_order_relaxed);
+        packets_.fetch_add(packets, memory_order_relaxed);
+    }
+
+    void FlowCounter::remove(size_t bytes, size_t packets) {
+        bytes_.fetch_sub(bytes, memory_order_acq_rel);
+        packets_.fetch_sub(packets, memory_order_acq_rel);
+    }
+
+    bool FlowCounter::above_high() const {
+        return ncnet::above_high(limits_, bytes_.load(memory_order_acquire), packets_.load(memory_order_acquire));
+    }
+
+    bool FlowCounter::below_low() const {
+        return ncnet::below_low(limits_, bytes_.load(memory_order_acquire), packets_.load(memory_order_acquire));
+    }
+
+    void ReceiveFlow::release(size_t bytes) {
+        counter.remove(bytes);
+
+        if (parent) {
+            parent->release(bytes);
+        }
+
+        // Only one thread gets to resume
+        if (counter.below_low() && (!parent || parent->counter.below_low()) && paused.exchange(false)) {
+            lock_guard<mutex> lock(resume_lock);
+            if (resume) {
+                resume();
+            }
+        }
+    }
+
+    void ReceiveFlow::detach() {
+        lock_guard<mutex> lock(resume_lock);
+        resume = nullptr;
+    }
+
+    FlowTicket::FlowTicket(const shared_ptr<ReceiveFlow> &flow, size_t bytes) : flow_(flow), bytes_(bytes) {
+        flow_->counter.add(bytes);
+
+        for (auto *parent = flow_->parent.get(); parent; parent = parent->parent.get()) {
+            parent->counter.add(bytes);
+        }
+    }
+
+    FlowTicket::FlowTicket(FlowTicket &&ticket) noexcept : flow_(move(ticket.flow_)), bytes_(ticket.bytes_) {}
+
+    FlowTicket &FlowTicket::operator=(FlowTicket &&ticket) noexcept {
+        swap(flow_, ticket.flow_);
+        swap(bytes_, ticket.bytes_);
+        return *this;
+    }
+
+    FlowTicket::~FlowTicket() {
+        if (flow_) {
+            flow_->release(bytes_);
+        }
+    }
+}
\ No newline at end of file
@@ -1,15 +1,133 @@
 #include "Log.h"
+#include "MPMCQueue.h"
+
+#include <condition_variable>
+#include <string>
+#include <thread>
 
 namespace ncnet {
     std::mutex Log::lock_;
-    bool Log::enabled_ = false;
-    LogLevel Log::log_level_ = LogLevel::NONE; // Allow everything
+    std::atomic<bool> Log::enabled_{false};
+    std::atomic<LogLevel> Log::log_level_{LogLevel::NONE}; // Allow everything
+    std::atomic<bool> Log::async_{false};
+
+    static constexpr size_t ASYNC_LINES = 8192; // Ring capacity
+    static constexpr size_t ASYNC_BATCH = 256; // Lines per write
+
+    // Background writer draining the ring, producers never block
+    class AsyncSink {
+    public:
+        AsyncSink() : lines_(ASYNC_LINES) {}
+
+        ~AsyncSink() {
+            stop();
+        }
+
+        bool push(std::string &&line) {
+            auto pushed = lines_.push(std::move(line));
+            if (!pushed) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // Pairs with the fence in run, either we see the writer sleeping or it sees our line.
+            // Only the first producer after it fell asleep takes the lock
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleeping_.load(std::memory_order_relaxed) && sleeping_.exchange(false)) {
+                std::lock_guard<std::mutex> lock(wake_lock_);
+                wake_.notify_one();
+            }
+
+            return pushed;
+        }
+
+        void start() {
+            std::lock_guard<std::mutex> lock(state_lock_);
+            if (!writer_.joinable()) {
+                running_ = true;
+                writer_ = std::thread(&AsyncSink::run, this);
+            }
+        }
+
+        void stop() {
+            std::lock_guard<std::mutex> lock(state_lock_);
+            if (writer_.joinable()) {
+                running_ = false;
+                {
+                    std::lock_guard<std::mutex> wake_lock(wake_lock_);
+                    wake_.notify_one();
+                }
+
+                writer_.join();
+            }
+        }
+
+    private:
+        void run() {
+            std::string batch;
+            std::string line;
+
+            while (true) {
+                // Read running before draining, lines pushed before stop are still written
+                auto running = running_.load();
+                size_t count = 0;
+
+                while (count < ASYNC_BATCH && lines_.pop(line)) {
+                    batch += line;
+                    count++;
+                }
+
+                auto dropped = dropped_.exchange(0, std::memory_order_relaxed);
+                if (dropped > 0) {
+                    batch += "[WARNING] Dropped " + std::to_string(dropped) + " log lines\n";
+                }
+
+                if (!batch.empty()) {
+                    std::cout << batch << std::flush;
+                    batch.clear();
+                }
+
+                if (count == ASYNC_BATCH) {
+                    continue;
+                }
+
+                if (!running) {
+                    return;
+                }
+
+                // Announce sleeping before looking at the ring once more, lines pushed after the look wake us
+                sleeping_.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (lines_.pop(line)) {
+                    sleeping_.store(false, std::memory_order_relaxed);
+                    batch += line;
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(wake_lock_);
+                wake_.wait(lock, [this] { return !sleeping_.load() || !running_.load(); });
+                sleeping_.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        MPMCQueue<std::string> lines_;
+        std::atomic<size_t> dropped_{0};
+        std::atomic<bool> running_{false};
+        std::atomic<bool> sleeping_{false}; // Writer waits on wake_, cleared by the producer waking it
+        std::mutex wake_lock_;
+        std::condition_variable wake_;
+        std::mutex state_lock_;
+        std::thread writer_;
+    };
+
+    static AsyncSink &async_sink() {
+        static AsyncSink sink;
+        return sink;
+    }
 
     Log::Log() {}
     Log::Log(LogLevel level) : prefix_(level) {}
     Log::~Log() {
-        std::lock_guard<std::mutex> lock(lock_);
-        if (!enabled_ || prefix_ < log_level_) {
+        if (!is_enabled(prefix_)) {
             return;
         }
 
@@ -33,17 +151,32 @@ namespace ncnet {
             prefix = "[" + prefix + "] ";
         }
 
+        if (async_.load(std::memory_order_acquire)) {
+            async_sink().push(prefix + str() + "\n");
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(lock_);
         std::cout << prefix << str() << "\n" << std::flush;
     }
 
     void Log::set_log_level(LogLevel level) {
-        std::lock_guard<std::mutex> lock(lock_);
         // TODO: Validate
         log_level_ = level;
     }
 
     void Log::enable(bool enabled) {
-        std::lock_guard<std::mutex> lock(lock_);
         enabled_ = enabled;
     }
-}
+
+    void Log::set_async(bool async) {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (async) {
+            async_sink().start();
+            async_ = true;
+        } else {
+            async_ = false;
+            async_sink().stop();
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "Metrics.h"
+
+#include <sstream>
+
+using namespace std;
+
+namespace ncnet {
+    static constexpr size_t HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+
+    size_t HistogramSnapshot::bucket_of(uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) {
+            return value;
+        }
+
+        // Highest bit picks the power of two, the following bits the sub-bucket
+        auto exponent = 63 - __builtin_clzll(value);
+        auto sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+        return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+    }
+
+    uint64_t HistogramSnapshot::bucket_value(size_t bucket) {
+        if (bucket < HISTOGRAM_SUB_BUCKETS) {
+            return bucket;
+        }
+
+        auto exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+        auto sub = bucket % HISTOGRAM_SUB_BUCKETS;
+        return static_cast<uint64_t>(HISTOGRAM_SUB_BUCKETS + sub) << (exponent - HISTOGRAM_SUB_BITS);
+    }
+
+    uint64_t HistogramSnapshot::percentile(double fraction) const {
+        if (count == 0) {
+            return 0;
+        }
+
+        auto rank = static_cast<uint64_t>(fraction * count);
+        uint64_t seen = 0;
+
+        for (size_t i = 0; i < buckets.size(); i++) {
+            seen += buckets[i];
+            if (seen > rank) {
+                return min(bucket_value(i), max);
+            }
+        }
+
+        return max;
+    }
+
+    double HistogramSnapshot::mean() const {
+        return count > 0 ? static_cast<double>(sum) / count : 0;
+    }
+
+    void MetricsShard::merge(MetricsSnapshot &snapshot) const {
+        for (size_t i = 0; i < COUNTER_COUNT; i++) {
+            snapshot.counters[i] += counters_[i].load(memory_order_relaxed);
+        }
+
+        for (size_t i = 0; i < HISTOGRAM_COUNT; i++) {
+            auto &data = histograms_[i];
+            auto &histogram = snapshot.histograms[i];
+
+            for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+                histogram.buckets[bucket] += data.buckets[bucket].load(memory_order_relaxed);
+            }
+
+            histogram.count += data.count.load(memory_order_relaxed);
+            histogram.sum += data.sum.load(memory_order_relaxed);
+            histogram.max = std::max(histogram.max, data.max.load(memory_order_relaxed));
+        }
+    }
+
+    MetricsShard *Metrics::add_shard() {
+        lock_guard<mutex> lock(shards_lock_);
+        shards_.emplace_back(new MetricsShard());
+        return shards_.back().get();
+    }
+
+    MetricsSnapshot Metrics::snapshot() {
+        MetricsSnapshot snapshot;
+        lock_guard<mutex> lock(shards_lock_);
+
+        for (auto &shard : shards_) {
+            shard->merge(snapshot);
+        }
+
+        return snapshot;
+    }
+
+    string MetricsSnapshot::to_prometheus() const {
+        ostringstream out;
+
+        auto counter = [this, &out] (const char *name, const char *help, Counter counter) {
+            out << "# HELP " << name << " " << help << "\n";
+            out << "# TYPE " << name << " counter\n";
+            out << name << " " << get(counter) << "\n";
+        };
+
+        counter("ncnet_bytes_received_total", "Bytes read from sockets", Counter::BYTES_RECEIVED);
+        counter("ncnet_bytes_sent_total", "Bytes written to sockets", Counter::BYTES_SENT);
+        counter("ncnet_packets_received_total", "Packets received", Counter::PACKETS_RECEIVED);
+        counter("ncnet_packets_sent_total", "Packets fully written", Counter::PACKETS_SENT);
+        counter("ncnet_connections_opened_total", "Connections accepted or connected", Counter::CONNECTIONS_OPENED);
+
+        out << "# HELP ncnet_disconnects_total Closed connections by reason\n";
+        out << "# TYPE ncnet_disconnects_total counter\n";
+        out << "ncnet_disconnects_total{reason=\"peer\"} " << get(Counter::DISCONNECTS_PEER) << "\n";
+        out << "ncnet_disconnects_total{reason=\"error\"} " << get(Counter::DISCONNECTS_ERROR) << "\n";
+        out << "ncnet_disconnects_total{reason=\"protocol\"} " << get(Counter::DISCONNECTS_PROTOCOL) << "\n";
+        out << "ncnet_disconnects_total{reason=\"local\"} " << get(Counter::DISCONNECTS_LOCAL) << "\n";
+
+        out << "# HELP ncnet_handshakes_total Completed key exchanges by type\n";
+        out << "# TYPE ncnet_handshakes_total counter\n";
+        out << "ncnet_handshakes_total{type=\"full\"} " << get(Counter::HANDSHAKES_FULL) << "\n";
+        out << "ncnet_handshakes_total{type=\"resumed\"} " << get(Counter::HANDSHAKES_RESUMED) << "\n";
+        out << "ncnet_handshakes_total{type=\"plaintext\"} " << get(Counter::HANDSHAKES_PLAINTEXT) << "\n";
+
+        // Histograms are exported as summaries, scale converts nanoseconds to seconds
+        auto summary = [this, &out] (const char *name, const char *help, Histogram histogram, double scale) {
+            auto &data = get(histogram);
+            out << "# HELP " << name << " " << help << "\n";
+            out << "# TYPE " << name << " summary\n";
+
+            for (auto quantile : { 0.5, 0.9, 0.99, 0.999 }) {
+                out << name << "{quantile=\"" << quantile << "\"} " << data.percentile(quantile) * scale << "\n";
+            }
+
+            out << name << "_sum " << data.sum * scale << "\n";
+            out << name << "_count " << data.count << "\n";
+        };
+
+        summary("ncnet_encrypt_seconds", "Time to encrypt a packet", Histogram::ENCRYPT_NS, 1e-9);
+        summary("ncnet_decrypt_seconds", "Time to decrypt a packet", Histogram::DECRYPT_NS, 1e-9);
+        summary("ncnet_loop_seconds", "Event loop iteration time excluding waiting", Histogram::LOOP_NS, 1e-9);
+        summary("ncnet_incoming_queue_packets", "Received packets waiting for a transfer loop", Histogram::INCOMING_QUEUE, 1);
+        summary("ncnet_outgoing_queue_packets", "Packets drained from the outgoing queue per iteration", Histogram::OUTGOING_QUEUE, 1);
+        summary("ncnet_connection_queue_packets", "Packets in a connection's send queue", Histogram::CONNECTION_QUEUE, 1);
+
+        return out.str();
+    }
+}
\ No newline at end of file
@@ -12,41 +12,31 @@
 #include <cassert>
 #include <unistd.h>
 #include <cmath>
+#include <cstddef>
+#include <cstring>
 
 using namespace std;
 
 namespace ncnet {
-    static void run_internal_transfer_loop(Network &network, TransferFunction func) {
-        // Loop until stopped
-        while (true) {
-            auto transfer = network.get_packet();
-            if (transfer.get_is_exit()) {
-                break;
-            }
-            // Call supplied function
-            func(transfer);
-        }
-    }
-
     vector<string> Network::get_interface_ips() const {
         struct ifaddrs* interfaces;
         if (getifaddrs(&interfaces) == -1) {
             // Could not get interfaces
-            Log(DEBUG) << "Could not retrieve IP interfaces";
+            NCNET_LOG(DEBUG) << "Could not retrieve IP interfaces";
             return vector<string>();
         }
 
         vector<string> ips;
         for (auto *iterator = interfaces; iterator; iterator = iterator->ifa_next) {
             if (!iterator->ifa_addr) {
-                Log(DEBUG) << "Invalid IP address, ignoring";
+                NCNET_LOG(DEBUG) << "Invalid IP address, ignoring";
                 continue;
             }
 
             // Check for AF_INET family interfaces
             if (iterator->ifa_addr->sa_family == AF_INET) {
                 auto ip = inet_ntoa(((struct sockaddr_in*)iterator->ifa_addr)->sin_addr);
-                Log(DEBUG) << "Found IP " << ip;
+                NCNET_LOG(DEBUG) << "Found IP " << ip;
                 ips.push_back(ip);
             }
         }
@@ -55,461 +45,595 @@ namespace ncnet {
         return ips;
     }
 
-    void Network::start_key_exchange(Connection &connection) {
-        // Send opening packet containing generated public keys
-        Packet packet;
-        packet << connection.get_security().get_pub_dh_key();
-        packet << connection.get_security().get_pub_sign_key();
-        // Bypass send_packet to avoid encryption
-        packet.finalize();
-        connections_.front().add_outgoing_packet(packet);
-    }
-
-    bool Network::respond_key_exchange(Connection &connection, Transfer &transfer) {
-        // Read supplied keys
-        auto &packet = transfer.get_packet();
-        string dh_pub;
-        string sign_pub;
-        packet >> dh_pub;
-        packet >> sign_pub;
-
-        // Encrypted CEK sent from server
-        string encrypted_cek;
-
-        if (!is_client_) {
-            // Client -> server means respond with CEK
-            try {
-                encrypted_cek = connection.get_security().compute_shared_key(dh_pub, sign_pub);
-            } catch (std::runtime_error &e) {
-                // Disconnect client
-                return false;
-            }
-
-            // Return our public DH key and public sign key along with CEK
-            Packet key_response;
-            key_response << connection.get_security().get_pub_dh_key() << connection.get_security().get_pub_sign_key() << encrypted_cek;
-            // Bypass send_packet
-            key_response.finalize();
-            connection.add_outgoing_packet(key_response);
-        } else {
-            // Read encrypted CEK
-            packet >> encrypted_cek;
-            // Compute shared key and set new CEK
-            connection.get_security().compute_shared_key(dh_pub, sign_pub);
-            connection.get_security().set_encrypted_cek(encrypted_cek);
-        }
-
-        // All good
-        return true;
-    }
-
-    bool Network::prepare_socket(int fd) {
+    bool Network::prepare_socket(int fd, bool tcp) {
         // Just set non-blocking for now
         int flags = fcntl(fd, F_GETFL, 0);
         if (flags == -1) {
-            Log(ERROR) << "Failed to get flags from socket";
+            NCNET_LOG(ERROR) << "Failed to get flags from socket";
             return false;
         }
 
         flags |= O_NONBLOCK;
 
         if (fcntl(fd, F_SETFL, flags) == -1) {
-            Log(WARN) << "Failed to set non-blocking socket";
+            NCNET_LOG(WARN) << "Failed to set non-blocking socket";
         }
 
         int on = 1;
-        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char*>(&on), sizeof(on)) < 0) {
-            Log(WARN) << "Failed to set TCP_NODELAY";
+        if (tcp && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char*>(&on), sizeof(on)) < 0) {
+            NCNET_LOG(WARN) << "Failed to set TCP_NODELAY";
         }
 
         return true;
     }
 
-    bool Network::read_data(Connection& connection) {
-        auto &packet = connection.get_packet_skeleton();
-        auto left = packet.left_in_packet();
-        unsigned char *buffer;
-        try {
-            buffer = packet.get_writable_buffer(left);
-        } catch (...) {
-            // Bad packet size
-            Log(WARN) << "Bad packet size detected, disconnecting client";
+    bool Network::unix_address(const string &endpoint, sockaddr_un &address, socklen_t &length, bool &shared) {
+        static const string unix_prefix = "unix:";
+        static const string shared_prefix = "shm:";
+        shared = endpoint.compare(0, shared_prefix.size(), shared_prefix) == 0;
+        if (!shared && endpoint.compare(0, unix_prefix.size(), unix_prefix) != 0) {
             return false;
         }
 
-        auto received = recv(connection.get_socket(), buffer, left, 0);
-        if (received <= 0) {
-            if (received == -1 && errno == -EAGAIN) {
-                return true; // Wait until next call
-            }
-            return false; // Error or disconnect
+        auto path = endpoint.substr(shared ? shared_prefix.size() : unix_prefix.size());
+        memset(&address, 0, sizeof address);
+        address.sun_family = AF_UNIX;
+
+        if (path.empty() || path.size() >= sizeof address.sun_path) {
+            NCNET_LOG(ERROR) << "Invalid unix socket path " << path;
+            length = 0;
+            return true;
         }
 
-        // Notify data was added
-        packet.added_data(received);
+        // Abstract sockets start with a null byte and have no file
+        if (path[0] == '@') {
+            path[0] = '\0';
+        }
+
+        memcpy(address.sun_path, path.data(), path.size());
+        length = offsetof(sockaddr_un, sun_path) + path.size() + (path[0] == '\0' ? 0 : 1);
+        return true;
+    }
 
-        list<Transfer> incoming;
-        // See if any packets are complete
-        while (connection.has_incoming_packets()) {
-            incoming.emplace_back(connection.get_id(), connection.get_incoming_packet());
+    void Network::use_local_transport() {
+        local_ = true;
+        if (!encryption_set_) {
+            encryption_ = false;
         }
+    }
 
-        if (connection.get_key_exchange()) {
-            if (incoming.empty()) {
-                // No full packet
-                return true;
-            }
+    void Network::set_encryption(bool encryption) {
+        encryption_ = encryption;
+        encryption_set_ = true;
+    }
 
-            // When in secure transfer, the client should only send an auth packet and wait for server secret response
-            if (incoming.size() > 1 || !respond_key_exchange(connection, incoming.front())) {
-                // Disconnect
-                Log(WARN) << "Disconnecting client due to invalid security protocol";
-                return false;
-            }
+    Packet Network::create_packet() const {
+        return Packet(encoding_);
+    }
+
+    MetricsSnapshot Network::get_metrics() {
+        return metrics_.snapshot();
+    }
 
-            // Everything OK, exit key exchange
-            connection.set_key_exchange(false);
-            incoming.pop_front();
+    string Network::export_metrics() {
+        return get_metrics().to_prometheus();
+    }
+
+    vector<ConnectionMetrics> Network::get_connection_metrics() {
+        vector<ConnectionMetrics> metrics;
+        for (auto &reactor : reactors_) {
+            reactor->get_connection_metrics(metrics);
         }
 
-        // Decrypt incoming packets
-        for (auto &transfer : incoming) {
-            try {
-                transfer.get_packet().decrypt(connection.get_security());
-            } catch (runtime_error &e) {
-                // Disconnect client
-                Log(WARN) << "Decrypting failed, disconnecting client";
-                return false;
-            }
+        return metrics;
+    }
+
+    void Network::set_session(const Session &session) {
+        lock_guard<mutex> lock(session_lock_);
+        session_ = session;
+    }
+
+    Session Network::get_session() {
+        lock_guard<mutex> lock(session_lock_);
+        return session_;
+    }
+
+    void Network::create_reactors(size_t count) {
+        reactors_.clear();
+        for (size_t i = 0; i < count; i++) {
+            reactors_.emplace_back(new Reactor(*this, i));
         }
 
-        if (!incoming.empty()) {
-            // Add to process queue
-            lock_guard<mutex> lock(incoming_lock_);
-            incoming_.insert(incoming_.end(), incoming.begin(), incoming.end());
+        if (key_pool_size_ > 0 && !key_pool_) {
+            key_pool_.reset(new KeyPool(key_pool_size_));
+        }
 
-            if (incoming_.size() > 1) {
-                incoming_cv_.notify_all();
-            } else {
-                incoming_cv_.notify_one();
-            }
+        if (!is_client_ && session_lifetime_ > 0) {
+            session_tickets_.reset(new SessionTickets(session_lifetime_));
         }
 
-        return true;
+        // Shared by all connections, dropping below it resumes everyone paused by it
+        receive_total_.reset();
+        if (total_receive_limits_.bytes > 0 || total_receive_limits_.packets > 0) {
+            receive_total_ = make_shared<ReceiveFlow>();
+            receive_total_->counter.set_limits(total_receive_limits_);
+            receive_total_->resume = [this] {
+                for (auto &reactor : reactors_) {
+                    reactor->resume_reading(RESUME_ALL);
+                }
+            };
+        }
     }
 
-    bool Network::write_data(Connection& connection) {
-        auto& packet = connection.get_outgoing_packet();
+    void Network::start_reactors() {
+        for (auto &reactor : reactors_) {
+            reactor->start();
+        }
+    }
 
-        Log(DEBUG) << "Writing data to " << connection.get_id();
-        auto sent = send(connection.get_socket(), packet.get_send_buffer(), packet.left_to_send(), 0);
-        if (sent <= 0) {
-            if (sent == -1 && errno == -EAGAIN) {
-                return true; // Wait for next call
-            }
-            return false; // Error or disconnected
+    Reactor *Network::find_reactor(size_t id) {
+        auto shard = Reactor::shard_of(id);
+        return shard < reactors_.size() ? reactors_[shard].get() : nullptr;
+    }
+
+    size_t Network::add_incoming(list<Transfer> &incoming) {
+        if (dispatcher_.has_workers()) {
+            return dispatcher_.push(incoming);
         }
 
-        auto fully = packet.sent_data(sent);
-        if (fully) {
-            // Remove packet, it's fully sent
-            connection.pop_outgoing();
+        lock_guard<mutex> lock(incoming_lock_);
+        // Transfer loop registered while waiting for the lock
+        if (dispatcher_.has_workers()) {
+            return dispatcher_.push(incoming);
         }
 
-        // Success
-        return true;
+        incoming_.splice(incoming_.end(), incoming);
+        auto queued = incoming_.size();
+
+        if (queued > 1) {
+            incoming_cv_.notify_all();
+        } else {
+            incoming_cv_.notify_one();
+        }
+
+        return queued;
     }
 
-    void Network::select_connections(fd_set& read_set, fd_set& write_set, fd_set& error_set) {
-        FD_ZERO(&read_set);
-        FD_ZERO(&write_set);
-        FD_ZERO(&error_set);
+    bool Network::stopping() {
+        return stop_.load(memory_order_acquire);
+    }
 
-        // Ignore main socket in client mode since server is the only connection
-        if (!is_client_) {
-            FD_SET(get_socket(), &read_set);
-            FD_SET(get_socket(), &error_set);
+    Transfer Network::get_packet() {
+        bool should_stop = false;
+        unique_lock<mutex> lock(incoming_lock_);
+        incoming_cv_.wait(lock, [this, &should_stop] {
+            should_stop = stopping();
+            return should_stop || !incoming_.empty();
+        });
+
+        if (should_stop) {
+            // Exiting
+            Transfer transfer;
+            transfer.set_is_exit(true); // Signal exit packet
+            return transfer;
         }
 
-        FD_SET(pipe_.get_socket(), &read_set);
-        FD_SET(pipe_.get_socket(), &error_set);
+        auto transfer = move(incoming_.front());
+        incoming_.pop_front();
 
-        for (auto& connection : connections_) {
-            FD_SET(connection.get_socket(), &read_set);
-            FD_SET(connection.get_socket(), &error_set);
+        NCNET_LOG(DEBUG) << "Returning packet to peer " << transfer.get_connection_id();
+        return transfer;
+    }
 
-            if (connection.has_outgoing_packets()) {
-                FD_SET(connection.get_socket(), &write_set);
-            }
+    size_t Network::get_packets(vector<Transfer> &transfers, size_t max, int timeout) {
+        auto ready = [this] {
+            return stopping() || !incoming_.empty();
+        };
+
+        unique_lock<mutex> lock(incoming_lock_);
+        if (timeout < 0) {
+            incoming_cv_.wait(lock, ready);
+        } else if (!incoming_cv_.wait_for(lock, chrono::milliseconds(timeout), ready)) {
+            return 0;
         }
+
+        if (stopping()) {
+            return 0;
+        }
+
+        // Drain in bulk under the same lock
+        size_t count = 0;
+        while (!incoming_.empty() && count < max) {
+            transfers.push_back(move(incoming_.front()));
+            incoming_.pop_front();
+            count++;
+        }
+
+        return count;
     }
 
-    void Network::sort_outgoing_packets() {
-        lock_guard<mutex> lock(outgoing_lock_);
+    void Network::stop(bool wait) {
+        stop_.store(true, memory_order_release);
 
-        // When we're in client-mode, all packets should go to the server
-        if (is_client_) {
-            if (connections_.empty()) {
-                // This case already handled by the main loop
-            } else {
-                // If we're in key exchange, all packets should be held-off until key exchange is done
-                if (connections_.front().get_key_exchange()) {
-                    return;
-                }
+        // Transfers released after stop must not reach the reactors, which may be destroyed by then
+        if (receive_total_) {
+            receive_total_->detach();
+        }
+
+        // Wake network threads
+        for (auto &reactor : reactors_) {
+            reactor->wake();
+        }
+
+        {
+            // Wake threads waiting for packets
+            lock_guard<mutex> lock(incoming_lock_);
+            incoming_cv_.notify_all();
+        }
+
+        dispatcher_.stop();
 
-                for (auto &transfer : outgoing_) {
-                    transfer.get_packet().encrypt(connections_.front().get_security());
-                    connections_.front().add_outgoing_packet(transfer.get_packet());
+        // Avoid resource locking if we're simulating exit
+        if (!wait) {
+            return;
+        }
+
+        // Wait for exit
+        for (auto &reactor : reactors_) {
+            reactor->join();
+        }
+
+        {
+            // Wait for transfer loops
+            lock_guard<mutex> lock(transfer_loop_lock_);
+            for (auto &transfer_thread : transfer_loops_) {
+                if (transfer_thread.joinable()) {
+                    transfer_thread.join();
                 }
             }
-        } else {
-            // FIXME: This is probably time-consuming
-            for (auto& transfer : outgoing_) {
-                // Find right connection
-                auto iterator = find_if(connections_.begin(), connections_.end(), [&transfer] (auto& connection) {
-                    return connection.get_id() == transfer.get_connection_id();
-                });
-
-                if (iterator == connections_.end()) {
-                    Log(DEBUG) << "Did not find connection with ID " << transfer.get_connection_id();
-                    // Not found, ignore
-                    continue;
-                }
+        }
 
-                // Encrypt by default
-                transfer.get_packet().encrypt(iterator->get_security());
-                iterator->add_outgoing_packet(transfer.get_packet());
-            }
+        // Listening socket is closed, remove its file
+        if (!local_path_.empty()) {
+            unlink(local_path_.c_str());
+            local_path_.clear();
+        }
+    }
+
+    SendResult Network::send_packet(Packet &packet, size_t peer_id) {
+        if (too_large(packet)) {
+            return SendResult::FAILED;
         }
 
-        // Clean outgoing packets since they are put in queue or removed
-        outgoing_.clear();
+        // Keep the caller's packet intact
+        packet.finalize();
+        return send_packet(packet.clone(), peer_id);
     }
 
-    void Network::run() {
-        fd_set read_set;
-        fd_set write_set;
-        fd_set error_set;
+    SendResult Network::send_packet(Packet &&packet, size_t peer_id) {
+        // Forwarding a received request should not look like a request
+        packet.set_correlation(0, 0);
+        return send_correlated(move(packet), peer_id);
+    }
 
-        while (true) {
-            sort_outgoing_packets();
-            select_connections(read_set, write_set, error_set);
+    size_t Network::resolve_peer(size_t peer_id) const {
+        return is_client_ ? server_id_ : peer_id;
+    }
 
-            if (!select(FD_SETSIZE, &read_set, &write_set, &error_set, NULL)) {
-                Log(ERROR) << "Failed to select sockets";
-                return;
-            }
+    bool Network::too_large(const Packet &packet) {
+        if (packet.size() <= PACKET_SEND_MAX_SIZE) {
+            return false;
+        }
 
-            auto should_stop = false;
-            {
-                lock_guard<mutex> lock(stop_lock_);
-                should_stop = stop_;
-            }
+        NCNET_LOG(WARN) << "Refusing packet of " << packet.size() << " bytes, limit is " << PACKET_SEND_MAX_SIZE;
+        return true;
+    }
 
-            if (should_stop) {
-                // Wake threads waiting for packets
-                {
-                    lock_guard<mutex> incoming_lock(incoming_lock_);
-                    incoming_cv_.notify_all();
-                }
+    SendResult Network::can_send(Reactor *reactor, size_t peer_id) {
+        // Packets for closed connections would be dropped by the network thread, fail so callers can retry elsewhere
+        if (reactor == nullptr || !reactor->is_live(peer_id) || stopping()) {
+            NCNET_LOG(DEBUG) << "Did not find connection with ID " << peer_id;
+            return SendResult::FAILED;
+        }
 
-                // Close all socket connections
-                for (auto &connection : connections_) {
-                    connection.disconnect();
-                }
+        if (send_total_.above_high() || reactor->is_send_blocked(peer_id)) {
+            return SendResult::WOULD_BLOCK;
+        }
 
-                // Close server socket
-                if (!is_client_) {
-                    close(get_socket());
-                }
+        return SendResult::QUEUED;
+    }
 
-                // Gracefully exit
-                Log(DEBUG) << "Exiting";
-                return;
-            }
+    void Network::push_packet(Reactor *reactor, Packet &&packet, size_t peer_id) {
+        packet.finalize(); // Calculate headers if not done
 
-            // Only check accepting socket in server-mode
-            if (!is_client_) {
-                if (FD_ISSET(get_socket(), &error_set)) {
-                    // Error
-                    Log(ERROR) << "Error in accepting socket";
-                    return;
-                }
+        if (send_total_.enabled()) {
+            send_total_.add(packet.size());
+        }
 
-                if (FD_ISSET(get_socket(), &read_set)) {
-                    // Got connection
-                    struct sockaddr in_addr;
-                    socklen_t in_len = sizeof in_addr;
-                    int new_fd = accept(get_socket(), &in_addr, &in_len);
-                    if (new_fd == -1) {
-                        Log(WARN) << "Failed to accept new connection";
-                        continue;
-                    }
-
-                    auto ip = inet_ntoa(((sockaddr_in*)&in_addr)->sin_addr);
-                    Log(DEBUG) << "Client connected (IP:" << ip << ")";
-
-                    prepare_socket(new_fd);
-                    Connection connection;
-                    connection.set_socket(new_fd);
-                    connections_.push_back(connection);
-                }
-            }
+        reactor->send_packet(Transfer(peer_id, move(packet)));
+        NCNET_LOG(DEBUG) << "Pushing packet to peer " << peer_id;
+    }
+
+    SendResult Network::send_correlated(Packet &&packet, size_t peer_id) {
+        if (too_large(packet)) {
+            return SendResult::FAILED;
+        }
+
+        peer_id = resolve_peer(peer_id);
+        auto *reactor = find_reactor(peer_id);
+
+        auto result = can_send(reactor, peer_id);
+        if (result == SendResult::QUEUED) {
+            push_packet(reactor, move(packet), peer_id);
+        }
 
-            // Check pipe
-            if (FD_ISSET(pipe_.get_socket(), &read_set)) {
-                Log(DEBUG) << "Activating pipe";
-                pipe_.reset();
+        return result;
+    }
+
+    size_t Network::send_packets(vector<Transfer> &transfers) {
+        // Group by owning reactor so each is woken once
+        vector<vector<Transfer>> batches(reactors_.size());
+        auto blocked = transfers.begin();
+        size_t queued = 0;
+
+        for (auto &transfer : transfers) {
+            auto peer_id = resolve_peer(transfer.get_connection_id());
+            auto *reactor = find_reactor(peer_id);
+            auto result = can_send(reactor, peer_id);
+
+            if (result == SendResult::WOULD_BLOCK) {
+                // Keep for the caller to retry
+                *blocked++ = move(transfer);
+                continue;
             }
 
-            if (FD_ISSET(pipe_.get_socket(), &error_set)) {
-                Log(ERROR) << "Got pipe error";
-                return;
+            auto &packet = transfer.get_packet();
+            if (result == SendResult::FAILED || too_large(packet)) {
+                continue;
             }
 
-            // Check for disconnecting connections
-            {
-                lock_guard<mutex> lock(disconnect_lock_);
-                for (auto &id : disconnect_connections_) {
-                    auto iterator = find_if(connections_.begin(), connections_.end(), [&id] (auto &connection) {
-                        return connection.get_id() == id;
-                    });
-
-                    if (iterator == connections_.end()) {
-                        Log(WARN) << "Failed to find disconnecting client " << id;
-                        continue;
-                    }
-
-                    // Disconnect
-                    iterator->disconnect();
-                }
+            packet.finalize(); // Calculate headers if not done
 
-                // Removed everything
-                disconnect_connections_.clear();
+            if (send_total_.enabled()) {
+                send_total_.add(packet.size());
             }
 
-            // Iterate through connections
-            for (auto &connection : connections_) {
-                if (!connection.get_connected()) {
-                    // Already gone
-                    continue;
-                }
+            transfer.set_connection_id(peer_id);
+            batches[reactor->get_index()].push_back(move(transfer));
+            queued++;
+        }
 
-                if (FD_ISSET(connection.get_socket(), &error_set)) {
-                    Log(WARN) << "Error on socket " << connection.get_socket();
-                    connection.disconnect();
-                }
+        transfers.erase(blocked, transfers.end());
 
-                if (FD_ISSET(connection.get_socket(), &read_set)) {
-                    // Read data from connection
-                    if (!read_data(connection)) {
-                        connection.disconnect();
-                    }
-                }
+        for (size_t i = 0; i < batches.size(); i++) {
+            reactors_[i]->send_packets(batches[i]);
+        }
 
-                if (FD_ISSET(connection.get_socket(), &write_set)) {
-                    // Write data to connection
-                    if (!write_data(connection)) {
-                        connection.disconnect();
-                    }
-                }
+        return queued;
+    }
+
+    future<Packet> Network::request(Packet &&packet, size_t peer_id, int timeout) {
+        auto promise = make_shared<std::promise<Packet>>();
+        auto result = promise->get_future();
+
+        auto sent = request(move(packet), [promise] (Packet *response) {
+            if (response == nullptr) {
+                promise->set_exception(make_exception_ptr(runtime_error("Request timed out or connection lost")));
+            } else {
+                promise->set_value(move(*response));
             }
+        }, peer_id, timeout);
 
-            // Remove disconnected sockets
-            connections_.erase(remove_if(connections_.begin(), connections_.end(), [this] (auto& connection) {
-                if (!connection.get_connected()) {
-                    Log(DEBUG) << "Removing connection " << connection.get_id();
-                    // Call disconnect callback if registered
-                    if (disconnect_callback_ != nullptr) {
-                        disconnect_callback_(connection.get_id());
-                    }
-                }
-                return !connection.get_connected();
-            }), connections_.end());
-
-            // If we're in client mode, losing the connection is fatal
-            if (is_client_ && connections_.empty()) {
-                Log(ERROR) << "Lost connection to server!";
-                // Simulate exit
-                stop(false);
+        if (sent == SendResult::WOULD_BLOCK) {
+            promise->set_exception(make_exception_ptr(runtime_error("Request would block")));
+        } else if (sent == SendResult::FAILED) {
+            promise->set_exception(make_exception_ptr(runtime_error("Request could not be sent")));
+        }
+
+        return result;
+    }
+
+    SendResult Network::request(Packet &&packet, const ResponseFunction &func, size_t peer_id, int timeout) {
+        peer_id = resolve_peer(peer_id);
+        auto *reactor = find_reactor(peer_id);
+
+        if (too_large(packet)) {
+            return SendResult::FAILED;
+        }
+
+        auto result = can_send(reactor, peer_id);
+        if (result != SendResult::QUEUED) {
+            return result;
+        }
+
+        // Zero is never used to make mistakes visible
+        uint32_t id;
+        while ((id = ++next_correlation_id_) == 0) {}
+
+        // Register before sending so the response can't arrive first. The connection may have closed or the
+        // network thread exited since can_send
+        if (!reactor->add_request(id, peer_id, func, timeout)) {
+            return SendResult::FAILED;
+        }
+
+        packet.set_correlation(PACKET_FLAG_REQUEST, id);
+        push_packet(reactor, move(packet), peer_id);
+        return SendResult::QUEUED;
+    }
+
+    SendResult Network::send_reply(Transfer &request, Packet &&reply) {
+        if (!request.get_packet().is_request()) {
+            NCNET_LOG(WARN) << "Replying to packet which is not a request";
+        }
+
+        reply.set_correlation(PACKET_FLAG_RESPONSE, request.get_packet().get_correlation_id());
+        return send_correlated(move(reply), request.get_connection_id());
+    }
+
+    SendResult Network::push_broadcast(Packet &&packet, vector<shared_ptr<BroadcastTargets>> &targets) {
+        if (too_large(packet)) {
+            return SendResult::FAILED;
+        }
+
+        if (send_total_.above_high()) {
+            return SendResult::WOULD_BLOCK;
+        }
+
+        // Finalized here, network threads only read the shared buffer
+        packet.set_correlation(0, 0);
+        packet.finalize();
+        auto result = SendResult::FAILED;
+
+        for (size_t i = 0; i < targets.size(); i++) {
+            if (targets[i]) {
+                reactors_[i]->send_packet(Transfer(targets[i], packet.share()));
+                result = SendResult::QUEUED;
             }
         }
+
+        return result;
     }
 
-    Transfer Network::get_packet() {
-        bool should_stop = false;
-        unique_lock<mutex> lock(incoming_lock_);
-        incoming_cv_.wait(lock, [this, &should_stop] {
-            lock_guard<mutex> stop_lock(stop_lock_);
-            should_stop = stop_;
-            return stop_ ? true : !incoming_.empty();
-        });
+    SendResult Network::broadcast(Packet &&packet, const vector<size_t> &ids) {
+        // Split by owning reactor
+        vector<shared_ptr<BroadcastTargets>> targets(reactors_.size());
+        for (auto id : ids) {
+            auto *reactor = find_reactor(id);
+            if (reactor == nullptr) {
+                continue;
+            }
 
-        if (should_stop) {
-            // Exiting
-            Transfer transfer;
-            transfer.set_is_exit(true); // Signal exit packet
-            return transfer;
+            auto &target = targets[reactor->get_index()];
+            if (!target) {
+                target = make_shared<BroadcastTargets>();
+            }
+
+            target->ids.push_back(id);
         }
 
-        auto transfer = incoming_.front();
-        incoming_.pop_front();
+        return push_broadcast(move(packet), targets);
+    }
 
-        Log(DEBUG) << "Returning packet to peer " << transfer.get_connection_id();
-        return transfer;
+    SendResult Network::broadcast(Packet &&packet, const string &group) {
+        return broadcast(move(packet), get_group(group));
     }
 
-    void Network::stop(bool wait) {
-        {
-            lock_guard<mutex> lock(stop_lock_);
-            stop_ = true;
+    SendResult Network::broadcast(Packet &&packet, const function<bool(size_t id)> &predicate) {
+        auto target = make_shared<BroadcastTargets>();
+        target->predicate = predicate;
+
+        vector<shared_ptr<BroadcastTargets>> targets(reactors_.size(), target);
+        return push_broadcast(move(packet), targets);
+    }
 
-            // Wake pipe
-            pipe_.activate();
+    void Network::join_group(const string &group, size_t id) {
+        lock_guard<mutex> lock(groups_lock_);
+        groups_[group].insert(id);
+    }
+
+    void Network::leave_group(const string &group, size_t id) {
+        lock_guard<mutex> lock(groups_lock_);
+        auto iterator = groups_.find(group);
+        if (iterator == groups_.end()) {
+            return;
         }
 
-        // Avoid resource locking if we're simulating exit
-        if (wait) {
-            // Wait for exit
-            network_.join();
+        iterator->second.erase(id);
+        if (iterator->second.empty()) {
+            groups_.erase(iterator);
         }
+    }
 
-        {
-            // Wait for transfer loops
-            lock_guard<mutex> lock(transfer_loop_lock_);
-            for (auto &transfer_thread : transfer_loops_) {
-                transfer_thread.join();
+    vector<size_t> Network::get_group(const string &group) {
+        lock_guard<mutex> lock(groups_lock_);
+        auto iterator = groups_.find(group);
+        if (iterator == groups_.end()) {
+            return vector<size_t>();
+        }
+
+        return vector<size_t>(iterator->second.begin(), iterator->second.end());
+    }
+
+    void Network::leave_groups(size_t id) {
+        lock_guard<mutex> lock(groups_lock_);
+        for (auto iterator = groups_.begin(); iterator != groups_.end();) {
+            iterator->second.erase(id);
+            if (iterator->second.empty()) {
+                iterator = groups_.erase(iterator);
+            } else {
+                ++iterator;
             }
         }
     }
 
-    void Network::send_packet(Packet &packet, size_t peer_id) {
-        lock_guard<mutex> lock(outgoing_lock_);
-        packet.finalize(); // Calculate headers if not done
-        outgoing_.push_back(Transfer(peer_id, packet));
+    void Network::set_total_send_limits(const QueueLimits &limits) {
+        send_total_.set_limits(limits);
+    }
 
-        Log(DEBUG) << "Pushing packet to peer " << peer_id;
+    void Network::notify_watermark(size_t id, Watermark watermark) {
+        NCNET_LOG(DEBUG) << "Connection " << id << " crossed watermark " << static_cast<int>(watermark);
 
-        // Also wake up the pipe
-        pipe_.activate();
+        if (watermark_callback_ != nullptr) {
+            watermark_callback_(id, watermark);
+        }
     }
 
     void Network::disconnect(size_t id) {
-        lock_guard<mutex> lock(disconnect_lock_);
-        disconnect_connections_.push_back(id);
+        if (is_client_) {
+            id = server_id_;
+        }
+
+        auto *reactor = find_reactor(id);
+        if (reactor != nullptr) {
+            reactor->disconnect(id);
+        }
+    }
 
-        // Wake pipe to process
-        pipe_.activate();
+    size_t Network::add_transfer_worker() {
+        lock_guard<mutex> lock(incoming_lock_);
+        auto index = dispatcher_.add_worker();
+
+        // Hand over packets received before any loop was registered
+        if (index != MAX_WORKERS && !incoming_.empty()) {
+            dispatcher_.push(incoming_);
+        }
+
+        return index;
     }
 
     void Network::register_transfer_loop(const TransferFunction &func) {
+        // Register before starting so no packets are missed
+        auto index = add_transfer_worker();
+        if (index == MAX_WORKERS) {
+            return;
+        }
+
         lock_guard<mutex> lock(transfer_loop_lock_);
         // Start transfer thread and add to list to keep track
-        transfer_loops_.emplace_back(thread(run_internal_transfer_loop, ref(*this), func));
+        transfer_loops_.emplace_back(&Dispatcher::run_worker, &dispatcher_, index, func);
+    }
+
+    void Network::register_batch_transfer_loop(const BatchTransferFunction &func, size_t max) {
+        auto index = add_transfer_worker();
+        if (index == MAX_WORKERS) {
+            return;
+        }
+
+        lock_guard<mutex> lock(transfer_loop_lock_);
+        transfer_loops_.emplace_back(&Dispatcher::run_batch_worker, &dispatcher_, index, func, max);
     }
 
     void Network::run_transfer_loop(const TransferFunction &func) {
+        auto index = add_transfer_worker();
+        if (index == MAX_WORKERS) {
+            return;
+        }
+
         // Blocking transfer loop
-        run_internal_transfer_loop(ref(*this), func);
+        dispatcher_.run_worker(index, func);
+    }
+
+    void Network::set_connection_affinity(bool affinity) {
+        dispatcher_.set_affinity(affinity);
     }
 }
\ No newline at end of file
@@ -1,18 +1,64 @@
 #include "Packet.h"
+#include "Compression.h"
 #include "Log.h"
 
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
 
 using namespace std;
 
 namespace ncnet {
-    Packet::Packet() {
-        // Create data
-        data_ = make_shared<vector<unsigned char>>();
+    Packet::Packet(Encoding encoding) : Packet(encoding, PACKET_HEADER_SIZE) {}
+
+    Packet::Packet(Encoding encoding, size_t capacity) : data_(capacity), encoding_(encoding) {
         data_->resize(PACKET_HEADER_SIZE); // Allocate header
     }
 
+    Packet::Packet(const DataType &data, Encoding encoding) : data_(data), encoding_(encoding) {}
+
+    Packet Packet::share() const {
+        Packet packet(data_, encoding_);
+        packet.correlation_flag_ = correlation_flag_;
+        packet.correlation_id_ = correlation_id_;
+        packet.compressed_ = compressed_;
+        packet.fixed_ = fixed_;
+        packet.read_position_ = read_position_;
+        return packet;
+    }
+
+    Packet Packet::clone() const {
+        Packet packet(encoding_, data_->size());
+        packet.data_->assign(data_->begin(), data_->end());
+        packet.correlation_flag_ = correlation_flag_;
+        packet.correlation_id_ = correlation_id_;
+        packet.compressed_ = compressed_;
+        packet.sent_ = sent_;
+        packet.fixed_ = fixed_;
+        packet.read_position_ = read_position_;
+        return packet;
+    }
+
+    Encoding Packet::get_encoding() const {
+        return encoding_;
+    }
+
     void Packet::read_string(string &val) {
+        if (encoding_ == Encoding::BINARY) {
+            unsigned long long len;
+            read_binary(len);
+
+            if (len > left_to_read()) {
+                handle_error("String out of range");
+                return;
+            }
+
+            val.assign(data_->begin() + read_position_, data_->begin() + read_position_ + len);
+            read_position_ += len;
+            return;
+        }
+
         // Read prefix length
         auto prefix_len = data_->at(read_position_++);
         auto prefix = string(data_->begin() + read_position_, data_->begin() + read_position_ + prefix_len);
@@ -27,7 +73,17 @@ namespace ncnet {
         return data_->at(read_position_++);
     }
 
+    size_t Packet::left_to_read() const {
+        return read_position_ < data_->size() ? data_->size() - read_position_ : 0;
+    }
+
     void Packet::add_string(const string &val) {
+        if (encoding_ == Encoding::BINARY) {
+            add_binary(static_cast<unsigned long long>(val.length()));
+            data_->insert(data_->end(), val.begin(), val.end());
+            return;
+        }
+
         // Add prefix
         auto prefix = to_string(val.length());
         data_->push_back(prefix.length());
@@ -40,51 +96,135 @@ namespace ncnet {
         data_->push_back(val);
     }
 
-    void Packet::handle_error(const string &message) const {
-        Log(ERROR) << "Error in packet (" << message << "), exiting";
-        assert(false);
+    void Packet::add_binary(unsigned long long val) {
+        // 7 bits per byte, high bit marks continuation
+        while (val >= 0x80) {
+            data_->push_back(static_cast<unsigned char>(val) | 0x80);
+            val >>= 7;
+        }
+
+        data_->push_back(static_cast<unsigned char>(val));
+    }
+
+    void Packet::add_binary(long long val) {
+        // Zigzag keeps small negative numbers small
+        auto bits = static_cast<unsigned long long>(val);
+        add_binary((bits << 1) ^ (val < 0 ? ~0ULL : 0ULL));
+    }
+
+    void Packet::add_binary(float val) {
+        uint32_t bits;
+        memcpy(&bits, &val, sizeof bits);
+        add_fixed(bits, sizeof bits);
     }
 
-    bool Packet::has_received_full_packet() const {
-        return full_size_ == 0 ? false : full_size_ == added_;
+    void Packet::add_binary(double val) {
+        uint64_t bits;
+        memcpy(&bits, &val, sizeof bits);
+        add_fixed(bits, sizeof bits);
     }
 
-    size_t Packet::left_in_packet() const {
-        if (full_size_ == 0) {
-            return PACKET_HEADER_SIZE - added_;
-        } else {
-            return full_size_ - added_;
+    void Packet::add_fixed(unsigned long long bits, size_t bytes) {
+        for (size_t i = 0; i < bytes; i++) {
+            data_->push_back(static_cast<unsigned char>(bits >> (i * 8)));
         }
     }
 
-    unsigned char *Packet::get_writable_buffer(size_t size) {
-        // Need to re-allocate if added + size > data_->size()
-        if (added_ + size > data_->size()) {
-            try {
-                data_->resize(added_ + size);
-            } catch (...) {
-                // Bad packet size
-                throw exception();
+    void Packet::read_binary(unsigned long long &val) {
+        val = 0;
+
+        for (int shift = 0; shift < 64; shift += 7) {
+            auto byte = data_->at(read_position_++);
+            val |= static_cast<unsigned long long>(byte & 0x7F) << shift;
+
+            if (!(byte & 0x80)) {
+                return;
             }
         }
-        return data_->data() + added_;
+
+        handle_error("Varint too long");
     }
 
-    bool Packet::added_data(size_t size) {
-        if (added_ + size >= PACKET_HEADER_SIZE && full_size_ == 0) {
-            // Decode header to get full size
-            full_size_ = (data_->at(0) << 24) | (data_->at(1) << 16) | (data_->at(2) << 8) | data_->at(3);
-            Log(DEBUG) << "Decoding packet to " << full_size_ << " bytes size";
+    void Packet::read_binary(long long &val) {
+        unsigned long long bits;
+        read_binary(bits);
+        val = static_cast<long long>((bits >> 1) ^ (~(bits & 1) + 1));
+    }
 
-            if (full_size_ == 0) {
-                Log(ERROR) << "Connection tries to send empty packet, disconnecting";
-                return false;
-            }
+    void Packet::read_binary(float &val) {
+        auto bits = static_cast<uint32_t>(read_fixed(sizeof(uint32_t)));
+        memcpy(&val, &bits, sizeof val);
+    }
+
+    void Packet::read_binary(double &val) {
+        auto bits = static_cast<uint64_t>(read_fixed(sizeof(uint64_t)));
+        memcpy(&val, &bits, sizeof val);
+    }
+
+    unsigned long long Packet::read_fixed(size_t bytes) {
+        unsigned long long bits = 0;
+        for (size_t i = 0; i < bytes; i++) {
+            bits |= static_cast<unsigned long long>(data_->at(read_position_++)) << (i * 8);
+        }
+
+        return bits;
+    }
+
+    void Packet::handle_error(const string &message) const {
+        NCNET_LOG(ERROR) << "Error in packet (" << message << "), exiting";
+        assert(false);
+    }
+
+    Packet::Packet(const unsigned char *frame, size_t size) : Packet(Encoding::TEXT, size) {
+        data_->assign(frame, frame + size);
+        read_header(frame);
+    }
+
+    size_t Packet::frame_size(const unsigned char *header) {
+        return (header[1] << 16) | (header[2] << 8) | header[3];
+    }
+
+    void Packet::read_header(const unsigned char *header) {
+        encoding_ = header[0] & PACKET_FLAG_BINARY ? Encoding::BINARY : Encoding::TEXT;
+        correlation_flag_ = header[0] & (PACKET_FLAG_REQUEST | PACKET_FLAG_RESPONSE);
+        compressed_ = header[0] & PACKET_FLAG_COMPRESSED;
+    }
+
+    void Packet::read_correlation() {
+        if (correlation_flag_ == 0) {
+            return;
+        }
+
+        if (data_->size() < PACKET_HEADER_SIZE + PACKET_CORRELATION_SIZE) {
+            // Ignore
+            correlation_flag_ = 0;
+            return;
+        }
+
+        auto offset = data_->size() - PACKET_CORRELATION_SIZE;
+        correlation_id_ = 0;
+        for (size_t i = 0; i < PACKET_CORRELATION_SIZE; i++) {
+            correlation_id_ |= static_cast<uint32_t>(data_->at(offset + i)) << (i * 8);
         }
 
-        // Data was received
-        added_ += size;
-        return true;
+        data_->resize(offset);
+    }
+
+    void Packet::set_correlation(unsigned char flag, uint32_t id) {
+        correlation_flag_ = flag & (PACKET_FLAG_REQUEST | PACKET_FLAG_RESPONSE);
+        correlation_id_ = id;
+    }
+
+    bool Packet::is_request() const {
+        return correlation_flag_ & PACKET_FLAG_REQUEST;
+    }
+
+    bool Packet::is_response() const {
+        return correlation_flag_ & PACKET_FLAG_RESPONSE;
+    }
+
+    uint32_t Packet::get_correlation_id() const {
+        return correlation_id_;
     }
 
     unsigned char *Packet::get_send_buffer() {
@@ -95,15 +235,30 @@ namespace ncnet {
         return data_->size() - sent_;
     }
 
+    size_t Packet::size() const {
+        return data_->size();
+    }
+
     bool Packet::sent_data(size_t sent) {
         sent_ += sent;
         return sent_ == data_->size();
     }
 
     void Packet::set_packet_size() {
-        for (int i = 0; i < PACKET_HEADER_SIZE; i++) {
+        // Never write a truncated size, the peer would mis-frame the stream
+        if (data_->size() > PACKET_MAX_SIZE) {
+            throw runtime_error("Packet too large");
+        }
+
+        for (int i = 1; i < PACKET_HEADER_SIZE; i++) {
             data_->at(i) = data_->size() >> (24 - i * 8) & 0xFF;
         }
+
+        data_->at(0) = get_flags();
+    }
+
+    unsigned char Packet::get_flags() const {
+        return (encoding_ == Encoding::BINARY ? PACKET_FLAG_BINARY : 0) | (compressed_ ? PACKET_FLAG_COMPRESSED : 0) | correlation_flag_;
     }
 
     void Packet::finalize() {
@@ -112,30 +267,100 @@ namespace ncnet {
         }
 
         set_packet_size();
-        Log(DEBUG) << "Finalizing packet with size " << data_->size() << " and content ";
+        NCNET_LOG(DEBUG) << "Finalizing packet with size " << data_->size() << " and content ";
         fixed_ = true;
     }
 
-    void Packet::encrypt(Security &security) {
-        // Encrypted content
-        DataType new_data = make_shared<vector<unsigned char>>();
-        new_data->resize(PACKET_HEADER_SIZE); // Reserve size of packet
-        // Encrypt current data vector and store it in new_data
-        security.encrypt(data_, PACKET_HEADER_SIZE, new_data);
-        // Replace
-        data_ = new_data;
+    void Packet::compress(size_t threshold) {
+        auto payload = data_->size() - PACKET_HEADER_SIZE;
+        if (threshold == 0 || payload < threshold || compressed_) {
+            return;
+        }
+
+        DataType compressed(PACKET_HEADER_SIZE + PACKET_ORIGINAL_SIZE + Compression::bound(payload) + PACKET_CORRELATION_SIZE + ENCRYPTION_OVERHEAD);
+        compressed->resize(PACKET_HEADER_SIZE);
+
+        for (size_t i = 0; i < PACKET_ORIGINAL_SIZE; i++) {
+            compressed->push_back(payload >> (i * 8) & 0xFF);
+        }
+
+        Compression::compress(data_->data() + PACKET_HEADER_SIZE, payload, *compressed);
+
+        // Incompressible data is sent as is
+        if (compressed->size() < data_->size()) {
+            data_ = compressed;
+            compressed_ = true;
+            set_packet_size();
+        }
+    }
+
+    void Packet::decompress() {
+        if (data_->size() < PACKET_HEADER_SIZE + PACKET_ORIGINAL_SIZE) {
+            throw runtime_error("Compressed packet too small");
+        }
+
+        size_t original = 0;
+        for (size_t i = 0; i < PACKET_ORIGINAL_SIZE; i++) {
+            original |= static_cast<size_t>(data_->at(PACKET_HEADER_SIZE + i)) << (i * 8);
+        }
+
+        DataType plain(PACKET_HEADER_SIZE + original);
+        plain->assign(data_->begin(), data_->begin() + PACKET_HEADER_SIZE);
+
+        auto *input = data_->data() + PACKET_HEADER_SIZE + PACKET_ORIGINAL_SIZE;
+        auto size = data_->size() - PACKET_HEADER_SIZE - PACKET_ORIGINAL_SIZE;
+        if (!Compression::decompress(input, size, *plain, original) || plain->size() != PACKET_HEADER_SIZE + original) {
+            throw runtime_error("Invalid compressed packet");
+        }
+
+        data_ = plain;
+        compressed_ = false;
+    }
+
+    void Packet::encrypt(Security &security, size_t compress_threshold) {
+        // Compressing creates a new buffer, leaving copies intact
+        compress(compress_threshold);
+
+        // Nothing to add, shared buffers are sent as is
+        if (!security.is_enabled() && correlation_flag_ == 0) {
+            if (data_.unique()) {
+                set_packet_size();
+            }
+
+            return;
+        }
+
+        // Copies of this packet might be sent to other connections, keep their data intact
+        if (!data_.unique()) {
+            DataType copy(data_->size() + PACKET_CORRELATION_SIZE + ENCRYPTION_OVERHEAD);
+            copy->assign(data_->begin(), data_->end());
+            data_ = copy;
+        }
+
+        // Correlation ID is encrypted along with the payload
+        if (correlation_flag_ != 0) {
+            for (size_t i = 0; i < PACKET_CORRELATION_SIZE; i++) {
+                data_->push_back(correlation_id_ >> (i * 8) & 0xFF);
+            }
+        }
+
+        // Encrypt in place
+        security.encrypt(*data_, PACKET_HEADER_SIZE, get_flags());
         // Recalculate size
         set_packet_size();
     }
 
-    void Packet::decrypt(Security &security) {
-        // Remove extra allocation for decryption to match
-        data_->resize(added_);
-        // Decrypted content
-        DataType new_data = make_shared<vector<unsigned char>>();
-        new_data->resize(PACKET_HEADER_SIZE); // Reserve size of packet
-        security.decrypt(data_, PACKET_HEADER_SIZE, new_data);
-        data_ = new_data;
+    void Packet::decrypt(Security &security, const unsigned char *frame, size_t size) {
+        // Decrypt straight from the received frame
+        security.decrypt(frame + PACKET_HEADER_SIZE, size - PACKET_HEADER_SIZE, PACKET_HEADER_SIZE, frame[0], *data_);
+        read_header(frame);
+        // Correlation ID follows the compressed payload
+        read_correlation();
+
+        if (compressed_) {
+            decompress();
+        }
+
         // Recalculate size
         set_packet_size();
     }
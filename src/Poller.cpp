@@ -0,0 +1,232 @@
+#include "Poller.h"
+#include "UringPoller.h"
+#include "Log.h"
+
+#include <sys/epoll.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <unordered_map>
+
+using namespace std;
+
+namespace ncnet {
+    // Edge-triggered epoll backend, O(ready) per wakeup
+    class EpollPoller : public Poller {
+    public:
+        explicit EpollPoller() {
+            epoll_ = epoll_create1(EPOLL_CLOEXEC);
+            events_.resize(INITIAL_EVENTS);
+        }
+
+        ~EpollPoller() {
+            if (epoll_ >= 0) {
+                close(epoll_);
+            }
+        }
+
+        bool valid() const {
+            return epoll_ >= 0;
+        }
+
+        bool add(int fd, size_t token, bool write) override {
+            return control(EPOLL_CTL_ADD, fd, token, true, write);
+        }
+
+        bool set_events(int fd, size_t token, bool read, bool write) override {
+            // Modifying re-arms the edge trigger, so data which arrived while paused is reported
+            return control(EPOLL_CTL_MOD, fd, token, read, write);
+        }
+
+        bool remove(int fd) override {
+            epoll_event event = {};
+            return epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, &event) == 0;
+        }
+
+        bool wait(vector<PollResult> &results, int timeout) override {
+            results.clear();
+
+            auto amount = epoll_wait(epoll_, events_.data(), events_.size(), timeout);
+            if (amount < 0) {
+                // Signals are not errors
+                return errno == EINTR;
+            }
+
+            for (int i = 0; i < amount; i++) {
+                auto &event = events_[i];
+                int mask = 0;
+
+                // Hang-ups are reported as readable, recv() tells the rest
+                if (event.events & (EPOLLIN | EPOLLHUP)) {
+                    mask |= POLL_EVENT_READ;
+                }
+
+                if (event.events & EPOLLOUT) {
+                    mask |= POLL_EVENT_WRITE;
+                }
+
+                if (event.events & EPOLLERR) {
+                    mask |= POLL_EVENT_ERROR;
+                }
+
+                results.push_back({ event.data.u64, mask });
+            }
+
+            // Every slot was used, allow more events next time
+            if (static_cast<size_t>(amount) == events_.size()) {
+                events_.resize(events_.size() * 2);
+            }
+
+            return true;
+        }
+
+    private:
+        static constexpr auto INITIAL_EVENTS = 256;
+
+        bool control(int operation, int fd, size_t token, bool read, bool write) {
+            epoll_event event = {};
+            event.events = EPOLLET;
+            event.data.u64 = token;
+
+            if (read) {
+                event.events |= EPOLLIN;
+            }
+
+            if (write) {
+                event.events |= EPOLLOUT;
+            }
+
+            if (epoll_ctl(epoll_, operation, fd, &event) < 0) {
+                NCNET_LOG(WARN) << "epoll_ctl failed for socket " << fd << ", errno = " << errno;
+                return false;
+            }
+
+            return true;
+        }
+
+        int epoll_ = -1;
+        vector<epoll_event> events_;
+    };
+
+    // Level-triggered poll() backend, O(n) per wakeup but portable
+    class PollPoller : public Poller {
+    public:
+        bool add(int fd, size_t token, bool write) override {
+            if (positions_.count(fd)) {
+                return false;
+            }
+
+            positions_[fd] = fds_.size();
+            fds_.push_back({ fd, mask(true, write), 0 });
+            sockets_.push_back(fd);
+            tokens_.push_back(token);
+            return true;
+        }
+
+        bool set_events(int fd, size_t token, bool read, bool write) override {
+            auto iterator = positions_.find(fd);
+            if (iterator == positions_.end()) {
+                return false;
+            }
+
+            auto &entry = fds_[iterator->second];
+            entry.events = mask(read, write);
+            // Hang-ups and errors can't be masked, a paused half-closed socket would be reported on every call.
+            // Negative sockets are skipped by poll() until there is something to wait for again
+            entry.fd = entry.events == 0 ? -1 : sockets_[iterator->second];
+            tokens_[iterator->second] = token;
+            return true;
+        }
+
+        bool remove(int fd) override {
+            auto iterator = positions_.find(fd);
+            if (iterator == positions_.end()) {
+                return false;
+            }
+
+            // Swap with last to keep removal O(1)
+            auto position = iterator->second;
+            positions_.erase(iterator);
+
+            if (position != fds_.size() - 1) {
+                fds_[position] = fds_.back();
+                sockets_[position] = sockets_.back();
+                tokens_[position] = tokens_.back();
+                positions_[sockets_[position]] = position;
+            }
+
+            fds_.pop_back();
+            sockets_.pop_back();
+            tokens_.pop_back();
+            return true;
+        }
+
+        bool wait(vector<PollResult> &results, int timeout) override {
+            results.clear();
+
+            auto amount = poll(fds_.data(), fds_.size(), timeout);
+            if (amount < 0) {
+                return errno == EINTR;
+            }
+
+            for (size_t i = 0; i < fds_.size() && amount > 0; i++) {
+                auto revents = fds_[i].revents;
+                if (revents == 0) {
+                    continue;
+                }
+
+                amount--;
+                int mask = 0;
+
+                if (revents & (POLLIN | POLLHUP)) {
+                    mask |= POLL_EVENT_READ;
+                }
+
+                if (revents & POLLOUT) {
+                    mask |= POLL_EVENT_WRITE;
+                }
+
+                if (revents & (POLLERR | POLLNVAL)) {
+                    mask |= POLL_EVENT_ERROR;
+                }
+
+                results.push_back({ tokens_[i], mask });
+            }
+
+            return true;
+        }
+
+    private:
+        static short mask(bool read, bool write) {
+            return (read ? POLLIN : 0) | (write ? POLLOUT : 0);
+        }
+
+        vector<pollfd> fds_;
+        vector<int> sockets_; // Same as in fds_ unless skipped
+        vector<size_t> tokens_;
+        unordered_map<int, size_t> positions_; // Socket -> position in fds_
+    };
+
+    unique_ptr<Poller> Poller::create(PollerType type) {
+        if (type == PollerType::IO_URING) {
+            unique_ptr<UringPoller> poller(new UringPoller());
+            if (poller->valid()) {
+                return poller;
+            }
+
+            NCNET_LOG(WARN) << "io_uring with multishot recv not supported, falling back to epoll";
+            type = PollerType::EPOLL;
+        }
+
+        if (type == PollerType::EPOLL) {
+            unique_ptr<EpollPoller> poller(new EpollPoller());
+            if (poller->valid()) {
+                return poller;
+            }
+
+            NCNET_LOG(WARN) << "Failed to create epoll instance, falling back to poll()";
+        }
+
+        return unique_ptr<Poller>(new PollPoller());
+    }
+}
\ No newline at end of file
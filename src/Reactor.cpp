@@ -0,0 +1,1486 @@
+#include "Reactor.h"
+#include "Network.h"
+#include "Log.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <unistd.h>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <linux/errqueue.h>
+#include <chrono>
+
+using namespace std;
+
+namespace ncnet {
+    // Poller tokens for non-connection sockets, connection IDs are used for the rest
+    static constexpr auto POLLER_TOKEN_PIPE = SIZE_MAX;
+    static constexpr auto POLLER_TOKEN_LISTEN = SIZE_MAX - 1;
+
+    // Capabilities sent after the encoding during key exchange
+    static constexpr unsigned char FEATURE_COMPRESSION = 1 << 0; // Can receive compressed packets
+    static constexpr unsigned char FEATURE_PLAINTEXT = 1 << 1; // Skip encryption, used if both sides ask for it
+    static constexpr unsigned char FEATURE_TICKET = 1 << 2; // Can store session tickets, set by servers issuing one
+    static constexpr unsigned char FEATURE_RESUME = 1 << 3; // Resuming with a ticket, set by servers accepting it
+
+    static constexpr size_t RESUME_RANDOM_SIZE = 16; // Random bytes from each side when resuming
+
+    Reactor::Reactor(Network &network, size_t index) : network_(network), index_(index), connections_(index) {
+        send_buffers_.resize(IOV_MAX);
+        metrics_ = network_.metrics_.add_shard();
+    }
+
+    // Nanoseconds since start
+    static uint64_t elapsed_ns(chrono::steady_clock::time_point start) {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    }
+
+    size_t Reactor::shard_of(size_t id) {
+        return id & (MAX_REACTORS - 1);
+    }
+
+    Connection &Reactor::add_connection(int fd) {
+        // IDs are unique across reactors since the shard is encoded in them
+        auto &connection = connections_.emplace();
+        connection.set_socket(fd);
+        metrics_->add(Counter::CONNECTIONS_OPENED);
+
+        // Sends through io_uring always copy
+        if (network_.zerocopy_threshold_ > 0 && network_.poller_type_ != PollerType::IO_URING) {
+#ifdef SO_ZEROCOPY
+            int on = 1;
+            if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+                connection.set_zerocopy_threshold(network_.zerocopy_threshold_);
+            } else
+#endif
+            {
+                NCNET_LOG(WARN) << "Zero-copy sending not supported";
+            }
+        }
+
+        // Count unhandled packets if receiving is limited
+        if (network_.receive_limits_.bytes > 0 || network_.receive_limits_.packets > 0 || network_.receive_total_) {
+            auto flow = make_shared<ReceiveFlow>();
+            auto id = connection.get_id();
+            flow->counter.set_limits(network_.receive_limits_);
+            flow->parent = network_.receive_total_;
+            flow->resume = [this, id] { resume_reading(id); };
+            connection.set_receive_flow(flow);
+        }
+
+        // Register once, write interest is enabled when packets are queued
+        if (poller_ && !register_connection(connection)) {
+            NCNET_LOG(WARN) << "Failed to register connection " << connection.get_id();
+            close_connection(connection);
+        }
+
+        return connection;
+    }
+
+    bool Reactor::register_connection(Connection &connection) {
+        auto *channel = connection.get_channel();
+        auto write = channel == nullptr && !completion_ && connection.has_outgoing_packets();
+        if (!poller_->add(connection.get_socket(), connection.get_id(), write)) {
+            return false;
+        }
+
+        // Both report under the connection ID, the eventfd wakes us for reading and writing
+        if (channel != nullptr && !poller_->add(channel->get_socket(), connection.get_id(), false)) {
+            return false;
+        }
+
+        // Packets queued before the event loop started are written by it
+        if (channel != nullptr || completion_) {
+            update_events(connection);
+        }
+
+        return true;
+    }
+
+    void Reactor::start() {
+        // Under the lock since requesters compare thread IDs
+        lock_guard<mutex> lock(metrics_lock_);
+        running_ = true;
+        thread_ = thread([this] {
+            run();
+            answer_metrics_requests(true);
+        });
+    }
+
+    void Reactor::join() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void Reactor::wake() {
+        pipe_.activate();
+    }
+
+    void Reactor::send_packet(Transfer &&transfer) {
+        outgoing_.push(move(transfer));
+
+        // Wake up the pipe unless the reactor is already going to drain the queue
+        if (outgoing_pending_.fetch_add(1, memory_order_acq_rel) == 0) {
+            pipe_.activate();
+        }
+    }
+
+    void Reactor::send_packets(vector<Transfer> &transfers) {
+        auto count = outgoing_.push(transfers.begin(), transfers.end());
+
+        if (count > 0 && outgoing_pending_.fetch_add(count, memory_order_acq_rel) == 0) {
+            pipe_.activate();
+        }
+    }
+
+    void Reactor::disconnect(size_t id) {
+        lock_guard<mutex> lock(disconnect_lock_);
+        disconnect_connections_.push_back(id);
+
+        // Wake pipe to process
+        pipe_.activate();
+    }
+
+    bool Reactor::is_send_blocked(size_t id) {
+        // Senders skip the lock while nothing is blocked
+        if (send_blocked_count_.load(memory_order_acquire) == 0) {
+            return false;
+        }
+
+        lock_guard<mutex> lock(flow_lock_);
+        return send_blocked_.count(id) > 0;
+    }
+
+    bool Reactor::is_live(size_t id) const {
+        return connections_.is_live(id);
+    }
+
+    void Reactor::resume_reading(size_t id) {
+        lock_guard<mutex> lock(flow_lock_);
+        resumes_.push_back(id);
+        pipe_.activate();
+    }
+
+    void Reactor::get_connection_metrics(vector<ConnectionMetrics> &metrics) {
+        unique_lock<mutex> lock(metrics_lock_);
+
+        // Connections are only safe to read from the event loop, or when it's not running
+        if (!running_ || this_thread::get_id() == thread_.get_id()) {
+            connections_.for_each([&metrics] (auto &connection) {
+                if (connection.get_connected()) {
+                    metrics.push_back(connection.get_metrics());
+                }
+            });
+
+            return;
+        }
+
+        auto answers = metrics_answers_;
+        metrics_requests_.push_back(&metrics);
+        pipe_.activate();
+
+        metrics_cv_.wait(lock, [this, answers] {
+            return metrics_answers_ != answers;
+        });
+    }
+
+    void Reactor::answer_metrics_requests(bool exiting) {
+        {
+            lock_guard<mutex> lock(metrics_lock_);
+            if (metrics_requests_.empty() && !exiting) {
+                return;
+            }
+
+            for (auto *metrics : metrics_requests_) {
+                connections_.for_each([metrics] (auto &connection) {
+                    if (connection.get_connected()) {
+                        metrics->push_back(connection.get_metrics());
+                    }
+                });
+            }
+
+            metrics_requests_.clear();
+            metrics_answers_++;
+
+            if (exiting) {
+                running_ = false;
+            }
+        }
+
+        metrics_cv_.notify_all();
+    }
+
+    void Reactor::adopt(int fd) {
+        lock_guard<mutex> lock(adopted_lock_);
+        adopted_.push_back(fd);
+        pipe_.activate();
+    }
+
+    void Reactor::adopt_sockets() {
+        vector<int> adopted;
+        {
+            lock_guard<mutex> lock(adopted_lock_);
+            adopted.swap(adopted_);
+        }
+
+        for (auto fd : adopted) {
+            add_connection(fd);
+        }
+    }
+
+    void Reactor::prepare_keys(Connection &connection) {
+        auto &security = connection.get_security();
+        if (security.has_keys()) {
+            return;
+        }
+
+        SecurityKeys keys;
+        if (!network_.key_pool_ || !network_.key_pool_->take(keys)) {
+            keys = Security::create_keys();
+        }
+
+        security.set_keys(move(keys));
+    }
+
+    void Reactor::start_key_exchange(Connection &connection) {
+        Packet packet;
+        auto &security = connection.get_security();
+        auto session = network_.get_session();
+
+        // Hello without public keys when resuming or asking for plaintext on a local transport, the server
+        // refuses it unless it accepts either and the client then starts over with a full key exchange
+        auto keyless = !security.has_keys() && (!session.empty() || (network_.local_ && !network_.encryption_));
+        auto resume = keyless && !session.empty();
+
+        if (resume) {
+            connection.set_resume_random(security.create_random(RESUME_RANDOM_SIZE));
+        }
+
+        if (keyless) {
+            packet << string() << string();
+        } else {
+            // Send opening packet containing generated public keys
+            prepare_keys(connection);
+            packet << security.get_pub_dh_key();
+            packet << security.get_pub_sign_key();
+        }
+
+        // Request preferred encoding and features
+        packet.add_byte(static_cast<unsigned char>(network_.encoding_));
+        auto features = FEATURE_COMPRESSION | FEATURE_TICKET | (network_.encryption_ ? 0 : FEATURE_PLAINTEXT);
+
+        if (resume) {
+            packet.add_byte(features | FEATURE_RESUME);
+            packet << session.ticket << connection.get_resume_random();
+        } else {
+            packet.add_byte(features);
+        }
+
+        // Bypass send_packet to avoid encryption
+        packet.finalize();
+        queue_packet(connection, move(packet));
+    }
+
+    bool Reactor::respond_key_exchange(Connection &connection, Packet &packet) {
+        // Read supplied keys, empty when resuming
+        string dh_pub;
+        string sign_pub;
+        packet >> dh_pub;
+        packet >> sign_pub;
+
+        // Encrypted CEK sent from server
+        string encrypted_cek;
+        // Peers without encoding negotiation only understand text
+        auto encoding = Encoding::TEXT;
+        unsigned char features = 0;
+        auto &security = connection.get_security();
+
+        if (!network_.is_client_) {
+            // Binary is used when both sides prefer it
+            if (packet.left_to_read() > 0 && packet.read_byte() == static_cast<unsigned char>(Encoding::BINARY)) {
+                encoding = network_.encoding_;
+            }
+
+            if (packet.left_to_read() > 0) {
+                features = packet.read_byte();
+            }
+
+            // Confirm plaintext only if both sides asked for it
+            if (network_.encryption_) {
+                features &= ~FEATURE_PLAINTEXT;
+            }
+
+            // Keyless hellos skip DH, plaintext is preferred over resuming as it needs no secret at all
+            auto keyless = dh_pub.empty();
+            auto plaintext = keyless && (features & FEATURE_PLAINTEXT);
+            if (plaintext) {
+                features &= ~(FEATURE_RESUME | FEATURE_TICKET);
+            }
+
+            auto &tickets = network_.session_tickets_;
+            string client_random;
+            string server_random;
+            string secret;
+
+            if (features & FEATURE_RESUME) {
+                string ticket;
+                try {
+                    packet >> ticket >> client_random;
+                } catch (std::exception &e) {
+                    return false;
+                }
+
+                if (!tickets || !tickets->open(ticket, secret)) {
+                    features &= ~FEATURE_RESUME;
+                }
+            }
+
+            if (keyless && !plaintext && !(features & FEATURE_RESUME)) {
+                // Refuse by answering without keys, the client starts over with a full key exchange
+                Packet refusal;
+                refusal << string() << string() << string();
+                refusal.add_byte(static_cast<unsigned char>(encoding));
+                refusal.add_byte(0);
+                refusal.finalize();
+                queue_packet(connection, move(refusal));
+                return true;
+            }
+
+            if (features & FEATURE_RESUME) {
+                server_random = security.create_random(RESUME_RANDOM_SIZE);
+                try {
+                    security.resume(secret, client_random, server_random, true);
+                } catch (std::runtime_error &e) {
+                    return false;
+                }
+            } else if (!plaintext) {
+                // Client -> server means respond with CEK
+                prepare_keys(connection);
+                try {
+                    encrypted_cek = security.compute_shared_key(dh_pub, sign_pub);
+                } catch (std::runtime_error &e) {
+                    // Disconnect client
+                    return false;
+                }
+            }
+
+            // Return our public DH key and public sign key along with CEK, or the server random when resuming
+            Packet key_response;
+            if (keyless) {
+                key_response << string() << string() << string();
+            } else {
+                key_response << security.get_pub_dh_key() << security.get_pub_sign_key() << encrypted_cek;
+            }
+
+            key_response.add_byte(static_cast<unsigned char>(encoding));
+            auto issue_ticket = tickets && (features & FEATURE_TICKET);
+            key_response.add_byte(FEATURE_COMPRESSION | (features & (FEATURE_PLAINTEXT | FEATURE_RESUME)) | (issue_ticket ? FEATURE_TICKET : 0));
+
+            if (features & FEATURE_RESUME) {
+                key_response << server_random;
+            }
+
+            // A new ticket every time, the client resumes with the latest one
+            if (issue_ticket) {
+                key_response << tickets->issue(security.get_resumption_secret());
+            }
+
+            // Bypass send_packet
+            key_response.finalize();
+            queue_packet(connection, move(key_response));
+        } else {
+            // Read encrypted CEK
+            packet >> encrypted_cek;
+
+            // Agreed encoding
+            if (packet.left_to_read() > 0 && packet.read_byte() == static_cast<unsigned char>(Encoding::BINARY)) {
+                encoding = Encoding::BINARY;
+            }
+
+            if (packet.left_to_read() > 0) {
+                features = packet.read_byte();
+            }
+
+            auto keyless = !security.has_keys();
+            if (keyless && !(features & (FEATURE_PLAINTEXT | FEATURE_RESUME))) {
+                // Refused, forget a rejected ticket and start over with keys
+                if (!connection.get_resume_random().empty()) {
+                    NCNET_LOG(DEBUG) << "Session resumption refused, doing a full key exchange";
+                    network_.set_session(Session());
+                } else {
+                    NCNET_LOG(DEBUG) << "Plaintext refused, doing a full key exchange";
+                }
+
+                connection.set_resume_random(string());
+                prepare_keys(connection);
+                start_key_exchange(connection);
+                return true;
+            }
+
+            try {
+                if (features & FEATURE_RESUME) {
+                    string server_random;
+                    packet >> server_random;
+                    security.resume(network_.get_session().secret, connection.get_resume_random(), server_random, false);
+                } else if (!keyless) {
+                    // Compute shared key and set new CEK
+                    security.compute_shared_key(dh_pub, sign_pub);
+                    security.set_encrypted_cek(encrypted_cek);
+                }
+
+                connection.set_resume_random(string());
+
+                // Keep the ticket for resuming later
+                if (features & FEATURE_TICKET) {
+                    string ticket;
+                    packet >> ticket;
+                    network_.set_session({ ticket, security.get_resumption_secret() });
+                }
+            } catch (std::exception &e) {
+                // Disconnect from server
+                return false;
+            }
+        }
+
+        connection.set_encoding(encoding);
+        connection.set_key_exchange(false);
+        // Peers send no keys for plaintext and resumed handshakes
+        if (features & FEATURE_RESUME) {
+            metrics_->add(Counter::HANDSHAKES_RESUMED);
+        } else {
+            metrics_->add(dh_pub.empty() ? Counter::HANDSHAKES_PLAINTEXT : Counter::HANDSHAKES_FULL);
+        }
+
+        if ((features & FEATURE_PLAINTEXT) && !network_.encryption_) {
+            security.set_enabled(false);
+        }
+
+        // Only compress for peers knowing the header flag
+        if (features & FEATURE_COMPRESSION) {
+            connection.set_compression_threshold(network_.compression_threshold_);
+        }
+
+        // All good
+        return true;
+    }
+
+    bool Reactor::read_data(Connection& connection) {
+        auto &receive_buffer = connection.get_receive_buffer();
+        auto &flow = connection.get_receive_flow();
+
+        // Leave data in the socket until transfer loops catch up
+        if (connection.get_read_paused()) {
+            return true;
+        }
+
+        // Edge-triggered polling only reports new data once, read until the socket is drained
+        while (true) {
+            size_t space;
+            auto *buffer = receive_buffer.get_writable_buffer(space);
+
+            // Fill as much as possible, possibly receiving many packets at once
+            auto *channel = connection.get_channel();
+            auto received = channel != nullptr ? channel->read(buffer, space) : recv(connection.get_socket(), buffer, space, 0);
+            if (received == 0 && channel != nullptr) {
+                return true; // Drained, the peer wakes us when writing again
+            }
+
+            if (received <= 0) {
+                if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return true; // Wait until next call
+                }
+
+                if (received == -1 && errno == EINTR) {
+                    continue;
+                }
+
+                if (received == 0) {
+                    connection.set_close_reason(Counter::DISCONNECTS_PEER);
+                }
+
+                return false; // Error or disconnect
+            }
+
+            if (!process_received(connection, received)) {
+                return false;
+            }
+
+            // Stop reading, the kernel buffer fills up and TCP slows down the peer
+            if (flow && pause_reading(connection)) {
+                return true;
+            }
+
+            // A short read means the socket is drained, skip the recv() returning EAGAIN
+            if (static_cast<size_t>(received) < space) {
+                return true;
+            }
+        }
+    }
+
+    bool Reactor::process_received(Connection &connection, size_t received) {
+        auto &receive_buffer = connection.get_receive_buffer();
+        auto &flow = connection.get_receive_flow();
+
+        // Notify data was added
+        receive_buffer.added_data(received);
+        connection.received(received);
+        metrics_->add(Counter::BYTES_RECEIVED, received);
+
+        list<Transfer> incoming;
+        Frame frame;
+        FrameStatus status;
+
+        // Slice out every complete packet
+        while ((status = receive_buffer.next_frame(frame)) == FrameStatus::COMPLETE) {
+            if (connection.get_key_exchange()) {
+                // When in secure transfer, the client should only send an auth packet and wait for server secret response
+                Packet packet(frame.data, frame.size);
+                if (!respond_key_exchange(connection, packet)) {
+                    // Disconnect
+                    NCNET_LOG(WARN) << "Disconnecting client due to invalid security protocol";
+                    connection.set_close_reason(Counter::DISCONNECTS_PROTOCOL);
+                    return false;
+                }
+
+                continue;
+            }
+
+            // Decrypt directly from the receive buffer
+            Packet packet;
+            auto decrypt_start = chrono::steady_clock::now();
+            try {
+                packet.decrypt(connection.get_security(), frame.data, frame.size);
+            } catch (runtime_error &e) {
+                // Disconnect client
+                NCNET_LOG(WARN) << "Decrypting failed, disconnecting client";
+                connection.set_close_reason(Counter::DISCONNECTS_PROTOCOL);
+                return false;
+            }
+
+            metrics_->record(Histogram::DECRYPT_NS, elapsed_ns(decrypt_start));
+            metrics_->add(Counter::PACKETS_RECEIVED);
+            connection.received_packet();
+
+            // Responses go straight to the waiting request
+            if (packet.is_response()) {
+                if (!complete_request(connection.get_id(), packet)) {
+                    NCNET_LOG(DEBUG) << "Dropping response " << packet.get_correlation_id() << " without request";
+                }
+
+                continue;
+            }
+
+            if (flow) {
+                FlowTicket ticket(flow, frame.size);
+                incoming.emplace_back(connection.get_id(), move(packet), move(ticket));
+            } else {
+                incoming.emplace_back(connection.get_id(), move(packet));
+            }
+        }
+
+        if (status == FrameStatus::INVALID) {
+            NCNET_LOG(WARN) << "Bad packet size detected, disconnecting client";
+            connection.set_close_reason(Counter::DISCONNECTS_PROTOCOL);
+            return false;
+        }
+
+        if (!incoming.empty()) {
+            // Add to process queue
+            metrics_->record(Histogram::INCOMING_QUEUE, network_.add_incoming(incoming));
+        }
+
+        return true;
+    }
+
+    bool Reactor::receive_completed(Connection &connection, int result, const unsigned char *data) {
+        if (result <= 0) {
+            if (result == 0) {
+                connection.set_close_reason(Counter::DISCONNECTS_PEER);
+            }
+
+            return false;
+        }
+
+        // The kernel picked its own buffer, copy into the receive buffer which reassembles packets
+        auto size = static_cast<size_t>(result);
+        size_t offset = 0;
+        while (offset < size) {
+            size_t space;
+            auto *buffer = connection.get_receive_buffer().get_writable_buffer(space);
+            auto length = min(space, size - offset);
+            memcpy(buffer, data + offset, length);
+            offset += length;
+
+            if (!process_received(connection, length)) {
+                return false;
+            }
+        }
+
+        // Chunks received until the cancel takes effect are still processed
+        if (connection.get_receive_flow() && !connection.get_read_paused()) {
+            pause_reading(connection);
+        }
+
+        return true;
+    }
+
+    bool Reactor::write_data(Connection& connection) {
+        if (completion_) {
+            return submit_send(connection);
+        }
+
+        // Send until the queue is empty or the socket is full
+        while (connection.has_outgoing_packets()) {
+            // Coalesce queued packets into a single call
+            bool zerocopy;
+            auto count = connection.get_send_buffers(send_buffers_.data(), send_buffers_.size(), zerocopy);
+
+            size_t requested = 0;
+            for (size_t i = 0; i < count; i++) {
+                requested += send_buffers_[i].iov_len;
+            }
+
+            msghdr message = {};
+            message.msg_iov = send_buffers_.data();
+            message.msg_iovlen = count;
+
+            int flags = MSG_NOSIGNAL;
+#ifdef MSG_ZEROCOPY
+            if (zerocopy) {
+                flags |= MSG_ZEROCOPY;
+            }
+#endif
+
+            NCNET_LOG(DEBUG) << "Writing " << count << " packets to " << connection.get_id();
+            auto *channel = connection.get_channel();
+            auto sent = channel != nullptr ? channel->write(send_buffers_.data(), count) : sendmsg(connection.get_socket(), &message, flags);
+            if (sent == 0 && channel != nullptr) {
+                return true; // Ring is full, the peer wakes us once it read
+            }
+
+            if (sent <= 0) {
+                if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return true; // Wait for next writable event
+                }
+
+                if (sent == -1 && errno == EINTR) {
+                    continue;
+                }
+
+                if (sent == -1 && errno == ENOBUFS && zerocopy) {
+                    // Out of memory for pinned pages, copy from now on
+                    NCNET_LOG(WARN) << "Zero-copy unavailable for connection " << connection.get_id() << ", disabling";
+                    connection.set_zerocopy_threshold(0);
+                    continue;
+                }
+
+                return false; // Error or disconnected
+            }
+
+            sent_bytes(connection, sent, zerocopy);
+
+            // A short write means the socket is full, wait for the next writable event
+            if (static_cast<size_t>(sent) < requested) {
+                return true;
+            }
+        }
+
+        // Nothing left to send, stop listening for writability
+        update_events(connection);
+        return true;
+    }
+
+    void Reactor::sent_bytes(Connection &connection, size_t sent, bool zerocopy) {
+        auto bytes = connection.get_queued_bytes();
+        auto packets = connection.get_queued_packets();
+        connection.sent_data(sent, zerocopy);
+        auto sent_packets = packets - connection.get_queued_packets();
+        sent_queued(bytes - connection.get_queued_bytes(), sent_packets);
+        connection.sent(sent, sent_packets);
+        metrics_->add(Counter::BYTES_SENT, sent);
+        metrics_->add(Counter::PACKETS_SENT, sent_packets);
+        check_send_watermark(connection);
+    }
+
+    bool Reactor::submit_send(Connection &connection) {
+        if (connection.get_send_in_flight() || !connection.has_outgoing_packets()) {
+            return true;
+        }
+
+        // Queued packets stay put until the send completes, the poller submits it with the next wait
+        bool zerocopy;
+        auto count = connection.get_send_buffers(send_buffers_.data(), send_buffers_.size(), zerocopy);
+        if (!poller_->send(connection.get_socket(), connection.get_id(), send_buffers_.data(), count)) {
+            return false;
+        }
+
+        NCNET_LOG(DEBUG) << "Writing " << count << " packets to " << connection.get_id();
+        connection.set_send_in_flight(true);
+        return true;
+    }
+
+    bool Reactor::send_completed(Connection &connection, int result) {
+        connection.set_send_in_flight(false);
+        if (result == -EAGAIN || result == -EINTR) {
+            return submit_send(connection);
+        }
+
+        if (result <= 0) {
+            return false; // Error or disconnected
+        }
+
+        // Short sends continue with the rest of the queue
+        sent_bytes(connection, result, false);
+        return submit_send(connection);
+    }
+
+    bool Reactor::check_socket_error(Connection &connection) {
+#if defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+        // Zero-copy completions are reported through the error queue, drained even after zero-copy is disabled
+        // since pending packets are only released by them and unread ones keep the error event raised
+        while (connection.sent_zerocopy()) {
+            char control[CMSG_SPACE(sizeof(sock_extended_err)) * 4];
+            msghdr message = {};
+            message.msg_control = control;
+            message.msg_controllen = sizeof control;
+
+            if (recvmsg(connection.get_socket(), &message, MSG_ERRQUEUE) < 0) {
+                break; // Drained
+            }
+
+            for (auto *cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+                auto is_ip = cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR;
+                auto is_ip6 = cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR;
+                if (!is_ip && !is_ip6) {
+                    continue;
+                }
+
+                auto *error = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cmsg));
+                if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY || error->ee_errno != 0) {
+                    continue;
+                }
+
+                // Notification covers zero-copy sends [ee_info, ee_data]
+                connection.zerocopy_completed(error->ee_data);
+
+                if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                    // Kernel had to copy anyway (e.g. loopback), stop new zero-copy sends
+                    NCNET_LOG(DEBUG) << "Zero-copy fell back to copying for connection " << connection.get_id() << ", disabling";
+                    connection.set_zerocopy_threshold(0);
+                }
+            }
+        }
+#endif
+
+        int error = 0;
+        socklen_t length = sizeof error;
+        if (getsockopt(connection.get_socket(), SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+            return false;
+        }
+
+        return error == 0;
+    }
+
+    void Reactor::queue_packet(Connection &connection, Packet &&packet) {
+        auto was_empty = !connection.has_outgoing_packets();
+
+        // Counted until written, including the encryption overhead and packets bypassing send_packet
+        if (network_.send_total_.enabled()) {
+            network_.send_total_.add(packet.size());
+        }
+
+        connection.add_outgoing_packet(move(packet));
+        metrics_->record(Histogram::CONNECTION_QUEUE, connection.get_queued_packets());
+
+        // Write interest is only toggled when the queue goes from empty to non-empty
+        if (was_empty && poller_) {
+            update_events(connection);
+        }
+
+        check_send_watermark(connection);
+    }
+
+    void Reactor::update_events(Connection &connection) {
+        // Nothing tells us a ring has space, and completion-based sends are submitted by us, write before polling instead
+        auto *channel = connection.get_channel();
+        if (channel != nullptr || completion_) {
+            if (connection.has_outgoing_packets()) {
+                pending_writes_.push_back(connection.get_id());
+            }
+
+            if (channel != nullptr) {
+                return;
+            }
+        }
+
+        poller_->set_events(connection.get_socket(), connection.get_id(), !connection.get_read_paused(), connection.has_outgoing_packets());
+    }
+
+    void Reactor::write_pending() {
+        writing_.swap(pending_writes_);
+
+        for (auto id : writing_) {
+            auto *connection = find_connection(id);
+            if (connection != nullptr && connection->get_connected() && !write_data(*connection)) {
+                close_connection(*connection);
+            }
+        }
+
+        writing_.clear();
+    }
+
+    bool Reactor::service_channel(Connection &connection) {
+        auto *channel = connection.get_channel();
+        if (channel == nullptr) {
+            // Accepted connection, the client sends its rings first
+            bool would_block;
+            auto received = SharedChannel::receive(connection.get_socket(), would_block);
+            if (!received) {
+                connection.set_close_reason(Counter::DISCONNECTS_PROTOCOL);
+                return would_block;
+            }
+
+            channel = received.get();
+            connection.set_channel(move(received));
+            if (!poller_->add(channel->get_socket(), connection.get_id(), false)) {
+                return false;
+            }
+        } else if (!channel->reset()) {
+            // Not signaled, so the socket woke us. It only becomes readable once the peer is gone
+            char data;
+            auto received = recv(connection.get_socket(), &data, sizeof data, MSG_DONTWAIT);
+            if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                connection.set_close_reason(received == 0 ? Counter::DISCONNECTS_PEER : Counter::DISCONNECTS_ERROR);
+                return false;
+            }
+        }
+
+        // A wakeup means data arrived or the ring we write has space again
+        return read_data(connection) && write_data(connection);
+    }
+
+    void Reactor::check_send_watermark(Connection &connection) {
+        auto &limits = network_.send_limits_;
+        auto bytes = connection.get_queued_bytes();
+        auto packets = connection.get_queued_packets();
+
+        if (!connection.get_send_blocked() && above_high(limits, bytes, packets)) {
+            connection.set_send_blocked(true);
+            {
+                lock_guard<mutex> lock(flow_lock_);
+                send_blocked_.insert(connection.get_id());
+                send_blocked_count_++;
+            }
+
+            network_.notify_watermark(connection.get_id(), Watermark::SEND_HIGH);
+        } else if (connection.get_send_blocked() && below_low(limits, bytes, packets)) {
+            connection.set_send_blocked(false);
+            {
+                lock_guard<mutex> lock(flow_lock_);
+                send_blocked_.erase(connection.get_id());
+                send_blocked_count_--;
+            }
+
+            network_.notify_watermark(connection.get_id(), Watermark::SEND_LOW);
+        }
+    }
+
+    void Reactor::sent_queued(size_t bytes, size_t packets) {
+        if (network_.send_total_.enabled()) {
+            network_.send_total_.remove(bytes, packets);
+        }
+    }
+
+    bool Reactor::pause_reading(Connection &connection) {
+        auto &flow = connection.get_receive_flow();
+        auto *total = flow->parent.get();
+        auto total_high = total && total->counter.above_high();
+
+        if (!flow->counter.above_high() && !total_high) {
+            return false;
+        }
+
+        // Whoever drops a counter below the low watermark sees the paused flag and resumes us
+        connection.set_read_paused(true);
+        flow->paused.store(true);
+        if (total_high) {
+            total->paused.store(true);
+        }
+
+        update_events(connection);
+        network_.notify_watermark(connection.get_id(), Watermark::RECEIVE_HIGH);
+
+        // Transfer loops might have caught up before the flag was set
+        if (flow->counter.below_low() && (!total || total->counter.below_low()) && flow->paused.exchange(false)) {
+            resume_connection(connection);
+            return false;
+        }
+
+        return true;
+    }
+
+    void Reactor::resume_connection(Connection &connection) {
+        if (!connection.get_read_paused()) {
+            return;
+        }
+
+        connection.set_read_paused(false);
+        connection.get_receive_flow()->paused.store(false);
+        update_events(connection);
+
+        // The ring was left unread, there is no edge to re-arm
+        if (connection.get_channel() != nullptr) {
+            connection.get_channel()->wake();
+        }
+        network_.notify_watermark(connection.get_id(), Watermark::RECEIVE_LOW);
+    }
+
+    void Reactor::resume_connections() {
+        vector<size_t> resumes;
+        {
+            lock_guard<mutex> lock(flow_lock_);
+            resumes.swap(resumes_);
+        }
+
+        for (auto id : resumes) {
+            if (id != RESUME_ALL) {
+                auto *connection = find_connection(id);
+                if (connection != nullptr && connection->get_connected()) {
+                    resume_connection(*connection);
+                }
+
+                continue;
+            }
+
+            // Network total dropped, resume connections which are below their own limits
+            connections_.for_each([this] (auto &connection) {
+                auto &flow = connection.get_receive_flow();
+                if (connection.get_connected() && connection.get_read_paused() && flow->counter.below_low()) {
+                    resume_connection(connection);
+                }
+            });
+        }
+    }
+
+    Connection *Reactor::find_connection(size_t id) {
+        return connections_.find(id);
+    }
+
+    void Reactor::close_connection(Connection &connection) {
+        if (!connection.get_connected()) {
+            return;
+        }
+
+        if (poller_) {
+            poller_->remove(connection.get_socket());
+            if (connection.get_channel() != nullptr) {
+                poller_->remove(connection.get_channel()->get_socket());
+            }
+        }
+
+        // Queued packets will never be sent
+        sent_queued(connection.get_queued_bytes(), connection.get_queued_packets());
+        if (connection.get_send_blocked()) {
+            connection.set_send_blocked(false);
+            lock_guard<mutex> lock(flow_lock_);
+            send_blocked_.erase(connection.get_id());
+            send_blocked_count_--;
+        }
+
+        // Transfers still holding tickets must not call back into a stopped reactor
+        if (connection.get_receive_flow()) {
+            connection.get_receive_flow()->detach();
+        }
+
+        metrics_->add(connection.get_close_reason());
+        connection.disconnect();
+        closed_.push_back(connection.get_id());
+    }
+
+    bool Reactor::add_request(uint32_t id, size_t connection_id, const ResponseFunction &func, int timeout) {
+        // Removed connections stop being live before their requests are failed, so checking under the lock
+        // either rejects the request or registers it in time to be failed
+        lock_guard<mutex> lock(requests_lock_);
+        if (exited_ || !is_live(connection_id)) {
+            return false;
+        }
+
+        requests_[id] = { connection_id, func };
+
+        if (timeout >= 0) {
+            request_deadlines_.emplace(chrono::steady_clock::now() + chrono::milliseconds(timeout), id);
+            has_deadlines_.store(true, memory_order_release);
+        }
+
+        return true;
+    }
+
+    bool Reactor::complete_request(size_t connection_id, Packet &packet) {
+        ResponseFunction func;
+        {
+            lock_guard<mutex> lock(requests_lock_);
+            auto iterator = requests_.find(packet.get_correlation_id());
+            // Only the requested peer may answer
+            if (iterator == requests_.end() || iterator->second.connection_id != connection_id) {
+                return false;
+            }
+
+            func = move(iterator->second.func);
+            requests_.erase(iterator);
+        }
+
+        // Call without lock, the callback might send new requests
+        func(&packet);
+        return true;
+    }
+
+    int Reactor::expire_requests() {
+        // Avoid the lock when no request has a timeout, the request itself wakes the reactor
+        if (!has_deadlines_.load(memory_order_acquire)) {
+            return -1;
+        }
+
+        vector<ResponseFunction> expired;
+        int next = -1;
+        {
+            lock_guard<mutex> lock(requests_lock_);
+            auto now = chrono::steady_clock::now();
+
+            while (!request_deadlines_.empty()) {
+                auto &deadline = request_deadlines_.top();
+                auto iterator = requests_.find(deadline.second);
+
+                if (iterator == requests_.end()) {
+                    // Already completed
+                    request_deadlines_.pop();
+                    continue;
+                }
+
+                if (deadline.first > now) {
+                    // Round up to not wake up early
+                    auto left = chrono::duration_cast<chrono::milliseconds>(deadline.first - now).count() + 1;
+                    next = static_cast<int>(min<long long>(left, INT_MAX));
+                    break;
+                }
+
+                expired.push_back(move(iterator->second.func));
+                requests_.erase(iterator);
+                request_deadlines_.pop();
+            }
+
+            if (request_deadlines_.empty()) {
+                has_deadlines_.store(false, memory_order_release);
+            }
+        }
+
+        for (auto &func : expired) {
+            func(nullptr);
+        }
+
+        return next;
+    }
+
+    void Reactor::fail_request(uint32_t id) {
+        ResponseFunction func;
+        {
+            lock_guard<mutex> lock(requests_lock_);
+            auto iterator = requests_.find(id);
+            if (iterator == requests_.end()) {
+                return;
+            }
+
+            func = move(iterator->second.func);
+            requests_.erase(iterator);
+        }
+
+        func(nullptr);
+    }
+
+    void Reactor::fail_requests(size_t connection_id) {
+        vector<ResponseFunction> failed;
+        {
+            lock_guard<mutex> lock(requests_lock_);
+            for (auto iterator = requests_.begin(); iterator != requests_.end();) {
+                if (iterator->second.connection_id == connection_id) {
+                    failed.push_back(move(iterator->second.func));
+                    iterator = requests_.erase(iterator);
+                } else {
+                    ++iterator;
+                }
+            }
+        }
+
+        for (auto &func : failed) {
+            func(nullptr);
+        }
+    }
+
+    void Reactor::accept_connections() {
+        // Edge-triggered, accept until there are no more pending connections
+        while (true) {
+            struct sockaddr in_addr;
+            socklen_t in_len = sizeof in_addr;
+            int new_fd = accept(listen_socket_, &in_addr, &in_len);
+            if (new_fd == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    NCNET_LOG(WARN) << "Failed to accept new connection";
+                }
+
+                return;
+            }
+
+            if (!network_.local_) {
+                auto ip = inet_ntoa(((sockaddr_in*)&in_addr)->sin_addr);
+                NCNET_LOG(DEBUG) << "Client connected (IP:" << ip << ")";
+            }
+
+            accepted(new_fd);
+        }
+    }
+
+    void Reactor::accepted(int fd) {
+        auto &reactors = network_.reactors_;
+        Network::prepare_socket(fd, !network_.local_);
+
+        // Hand out sockets round-robin if this is the only accepting reactor
+        auto target = index_;
+        if (network_.single_acceptor_) {
+            target = next_acceptor_target_++ % reactors.size();
+        }
+
+        if (target == index_) {
+            add_connection(fd);
+        } else {
+            reactors[target]->adopt(fd);
+        }
+    }
+
+    bool Reactor::dispatch_transfer(Transfer &transfer) {
+        // Counted against the total send limit until it reaches a connection queue
+        auto size = transfer.get_packet().size();
+
+        // Find right connection
+        auto *connection = find_connection(transfer.get_connection_id());
+        if (connection == nullptr) {
+            NCNET_LOG(DEBUG) << "Did not find connection with ID " << transfer.get_connection_id();
+            // Not found, ignore
+            if (transfer.get_packet().is_request()) {
+                fail_request(transfer.get_packet().get_correlation_id());
+            }
+
+            sent_queued(size, 1);
+            return true;
+        }
+
+        // If we're in key exchange, all packets should be held-off until key exchange is done
+        if (connection->get_key_exchange()) {
+            return false;
+        }
+
+        // Peer can't decode binary packets unless it agreed to it
+        if (transfer.get_packet().get_encoding() != Encoding::TEXT && connection->get_encoding() == Encoding::TEXT) {
+            NCNET_LOG(WARN) << "Dropping binary packet to connection " << connection->get_id() << " which only supports text";
+            if (transfer.get_packet().is_request()) {
+                fail_request(transfer.get_packet().get_correlation_id());
+            }
+
+            sent_queued(size, 1);
+            return true;
+        }
+
+        // Encrypt by default
+        auto encrypt_start = chrono::steady_clock::now();
+        transfer.get_packet().encrypt(connection->get_security(), connection->get_compression_threshold());
+        metrics_->record(Histogram::ENCRYPT_NS, elapsed_ns(encrypt_start));
+        sent_queued(size, 1);
+        queue_packet(*connection, move(transfer.get_packet()));
+        return true;
+    }
+
+    void Reactor::dispatch_broadcast(Transfer &transfer) {
+        auto &targets = *transfer.get_broadcast();
+        auto &packet = transfer.get_packet();
+        Packet compressed;
+        auto compressed_ready = false;
+
+        auto send = [&] (Connection &connection) {
+            // Skipped like send_packet refusing a connection above its send limits
+            if (!connection.get_connected() || connection.get_send_blocked()) {
+                return;
+            }
+
+            // Compress once for every peer supporting it, encrypting copies the shared buffer
+            auto threshold = connection.get_compression_threshold();
+            if (threshold > 0 && !compressed_ready) {
+                compressed = packet.share();
+                compressed.compress(threshold);
+                compressed_ready = true;
+            }
+
+            Transfer copy(connection.get_id(), threshold > 0 ? compressed.share() : packet.share());
+            if (network_.send_total_.enabled()) {
+                network_.send_total_.add(copy.get_packet().size());
+            }
+
+            if (!dispatch_transfer(copy)) {
+                held_.push_back(move(copy));
+            }
+        };
+
+        if (targets.predicate) {
+            connections_.for_each([&targets, &send] (auto &connection) {
+                if (targets.predicate(connection.get_id())) {
+                    send(connection);
+                }
+            });
+
+            return;
+        }
+
+        for (auto id : targets.ids) {
+            auto *connection = find_connection(id);
+            if (connection != nullptr) {
+                send(*connection);
+            }
+        }
+    }
+
+    bool Reactor::sort_outgoing_packets() {
+        // Packets held back during key exchange go first to keep the order
+        auto held = held_.begin();
+
+        for (auto &transfer : held_) {
+            if (!dispatch_transfer(transfer)) {
+                *held++ = move(transfer);
+            }
+        }
+
+        held_.erase(held, held_.end());
+
+        size_t popped = 0;
+        Transfer transfer;
+
+        while (outgoing_.pop(transfer)) {
+            popped++;
+
+            if (transfer.get_broadcast()) {
+                dispatch_broadcast(transfer);
+                continue;
+            }
+
+            if (!dispatch_transfer(transfer)) {
+                held_.push_back(move(transfer));
+            }
+        }
+
+        if (popped > 0) {
+            outgoing_pending_.fetch_sub(popped, memory_order_acq_rel);
+            metrics_->record(Histogram::OUTGOING_QUEUE, popped);
+        }
+
+        // Anything left was pushed while draining, the producer saw a non-empty queue and did not wake us
+        return outgoing_pending_.load(memory_order_acquire) > 0;
+    }
+
+    void Reactor::run() {
+        // Register sockets once, the poller keeps track of them from now on.
+        // Shared memory connections receive their rings over the socket, which io_uring would read first
+        auto type = network_.poller_type_;
+        if (type == PollerType::IO_URING && network_.shared_memory_) {
+            type = PollerType::EPOLL;
+        }
+
+        poller_ = Poller::create(type);
+        completion_ = poller_->is_completion_based();
+        poller_->add(pipe_.get_socket(), POLLER_TOKEN_PIPE, false);
+
+        // Client mode and reactors fed by another acceptor have no listening socket
+        if (listen_socket_ >= 0) {
+            if (completion_) {
+                poller_->accept(listen_socket_, POLLER_TOKEN_LISTEN);
+            } else {
+                poller_->add(listen_socket_, POLLER_TOKEN_LISTEN, false);
+            }
+        }
+
+        connections_.for_each([this] (auto &connection) {
+            register_connection(connection);
+        });
+
+        vector<PollResult> events;
+
+        auto loop_start = chrono::steady_clock::now();
+
+        while (true) {
+            // Don't block if producers are still pushing, wake up for the next request timeout
+            auto pending = sort_outgoing_packets();
+            write_pending();
+            auto timeout = expire_requests();
+            metrics_->record(Histogram::LOOP_NS, elapsed_ns(loop_start));
+
+            if (!poller_->wait(events, pending ? 0 : timeout)) {
+                NCNET_LOG(ERROR) << "Failed to poll sockets";
+                return;
+            }
+
+            loop_start = chrono::steady_clock::now();
+
+            if (network_.stopping()) {
+                // Close all socket connections
+                connections_.for_each([this] (auto &connection) {
+                    connection.set_close_reason(Counter::DISCONNECTS_LOCAL);
+                    close_connection(connection);
+                });
+
+                // Nobody will answer now
+                {
+                    lock_guard<mutex> lock(requests_lock_);
+                    exited_ = true;
+                }
+
+                for (auto id : closed_) {
+                    fail_requests(id);
+                }
+
+                // Completion-based pollers hold references to sockets until their operations are cancelled
+                poller_.reset();
+
+                // Close server socket
+                if (listen_socket_ >= 0) {
+                    close(listen_socket_);
+                }
+
+                // Gracefully exit
+                NCNET_LOG(DEBUG) << "Exiting";
+                return;
+            }
+
+            for (auto &event : events) {
+                if (event.token == POLLER_TOKEN_LISTEN) {
+                    if (event.events & POLL_EVENT_ERROR) {
+                        // Error
+                        NCNET_LOG(ERROR) << "Error in accepting socket";
+                        return;
+                    }
+
+                    if (event.events & POLL_EVENT_READ) {
+                        // Got connection
+                        accept_connections();
+                    }
+
+                    if (event.events & POLL_EVENT_ACCEPTED) {
+                        if (event.result >= 0) {
+                            accepted(event.result);
+                        } else {
+                            NCNET_LOG(WARN) << "Failed to accept new connection, errno = " << -event.result;
+                        }
+                    }
+
+                    continue;
+                }
+
+                if (event.token == POLLER_TOKEN_PIPE) {
+                    if (event.events & POLL_EVENT_ERROR) {
+                        NCNET_LOG(ERROR) << "Got pipe error";
+                        return;
+                    }
+
+                    NCNET_LOG(DEBUG) << "Activating pipe";
+                    pipe_.reset();
+                    adopt_sockets();
+                    resume_connections();
+                    answer_metrics_requests(false);
+                    continue;
+                }
+
+                auto *connection = find_connection(event.token);
+                if (connection == nullptr || !connection->get_connected()) {
+                    // Already gone
+                    continue;
+                }
+
+                if ((event.events & POLL_EVENT_ERROR) && !check_socket_error(*connection)) {
+                    NCNET_LOG(WARN) << "Error on socket " << connection->get_socket();
+                    close_connection(*connection);
+                    continue;
+                }
+
+                if (event.events & POLL_EVENT_READ) {
+                    // Read data from connection, shared memory connections also write as the same eventfd is used
+                    if (!(network_.shared_memory_ ? service_channel(*connection) : read_data(*connection))) {
+                        close_connection(*connection);
+                        continue;
+                    }
+                }
+
+                if (event.events & POLL_EVENT_WRITE) {
+                    // Write data to connection
+                    if (!write_data(*connection)) {
+                        close_connection(*connection);
+                        continue;
+                    }
+                }
+
+                // Completion-based poller did the reading and writing
+                if ((event.events & POLL_EVENT_RECEIVED) && !receive_completed(*connection, event.result, event.data)) {
+                    close_connection(*connection);
+                    continue;
+                }
+
+                if ((event.events & POLL_EVENT_SENT) && !send_completed(*connection, event.result)) {
+                    close_connection(*connection);
+                }
+            }
+
+            // Check for disconnecting connections
+            {
+                lock_guard<mutex> lock(disconnect_lock_);
+                for (auto &id : disconnect_connections_) {
+                    auto *connection = find_connection(id);
+                    if (connection == nullptr) {
+                        NCNET_LOG(WARN) << "Failed to find disconnecting client " << id;
+                        continue;
+                    }
+
+                    // Disconnect
+                    connection->set_close_reason(Counter::DISCONNECTS_LOCAL);
+                    close_connection(*connection);
+                }
+
+                // Removed everything
+                disconnect_connections_.clear();
+            }
+
+            // Remove disconnected sockets
+            for (auto id : closed_) {
+                NCNET_LOG(DEBUG) << "Removing connection " << id;
+                connections_.erase(id);
+                fail_requests(id);
+                network_.leave_groups(id);
+
+                // Call disconnect callback if registered
+                if (network_.disconnect_callback_ != nullptr) {
+                    network_.disconnect_callback_(id);
+                }
+            }
+
+            closed_.clear();
+
+            // If we're in client mode, losing the connection is fatal
+            if (network_.is_client_ && connections_.empty()) {
+                NCNET_LOG(ERROR) << "Lost connection to server!";
+                // Simulate exit
+                network_.stop(false);
+            }
+        }
+    }
+
+}
\ No newline at end of file
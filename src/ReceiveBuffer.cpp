@@ -0,0 +1,70 @@
+#include "ReceiveBuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace ncnet {
+    ReceiveBuffer::ReceiveBuffer(size_t capacity) : data_(capacity), capacity_(capacity) {}
+
+    size_t ReceiveBuffer::pending_frame_size() const {
+        if (end_ - begin_ < PACKET_HEADER_SIZE) {
+            return 0;
+        }
+
+        return Packet::frame_size(data_.data() + begin_);
+    }
+
+    unsigned char *ReceiveBuffer::get_writable_buffer(size_t &size) {
+        if (begin_ == end_) {
+            // Everything parsed, start over and release memory used by large frames
+            begin_ = end_ = 0;
+
+            if (data_.size() > capacity_) {
+                data_.resize(capacity_);
+                data_.shrink_to_fit();
+            }
+        }
+
+        // Make sure the pending frame fits, moving the partial frame to the front if needed
+        auto needed = max<size_t>(pending_frame_size(), PACKET_HEADER_SIZE);
+        if (begin_ > 0 && (begin_ + needed > data_.size() || begin_ >= data_.size() / 2)) {
+            memmove(data_.data(), data_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+
+        if (needed > data_.size()) {
+            data_.resize(needed);
+        }
+
+        size = data_.size() - end_;
+        return data_.data() + end_;
+    }
+
+    void ReceiveBuffer::added_data(size_t size) {
+        end_ += size;
+    }
+
+    FrameStatus ReceiveBuffer::next_frame(Frame &frame) {
+        if (end_ - begin_ < PACKET_HEADER_SIZE) {
+            return FrameStatus::INCOMPLETE;
+        }
+
+        auto size = pending_frame_size();
+        if (size < PACKET_HEADER_SIZE) {
+            return FrameStatus::INVALID;
+        }
+
+        if (end_ - begin_ < size) {
+            return FrameStatus::INCOMPLETE;
+        }
+
+        frame.data = data_.data() + begin_;
+        frame.size = size;
+        begin_ += size;
+
+        return FrameStatus::COMPLETE;
+    }
+}
\ No newline at end of file
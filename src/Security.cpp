@@ -31,30 +31,56 @@ static const Integer g("0xA4D1CBD5C3FD34126765A442EFB99905F8104DD258AC507F"
 
 static const Integer q("0xF518AA8781A8DF278ABA4E7D64B7CB9D49462353");
 
-// GCM AES tag size
-static constexpr auto TAG_SIZE = 12;
+// GCM nonce size, [Direction][Counter]
+static constexpr auto NONCE_SIZE = 4 + ncnet::ENCRYPTION_COUNTER_SIZE;
 
-// Default IV size
-static constexpr auto IV_SIZE = AES::BLOCKSIZE * 16;
+// Nonce directions
+static constexpr uint32_t NONCE_SERVER = 1;
+static constexpr uint32_t NONCE_CLIENT = 2;
 
 // Default key length (AES-128)
 static constexpr auto AES_KEY_LENGTH = 16;
 
+// Label mixed into the CEK when deriving the resumption secret
+static const char RESUMPTION_LABEL[] = "ncnet resumption";
+
 namespace ncnet {
-    Security::Security() {
-        // Initialize DH and create key-pairs
+    Security::Security(bool generate_keys) {
+        // Initialize DH, key-pairs are only needed for a full key exchange
         dh_ = std::make_shared<DH>();
         dh_->AccessGroupParameters().Initialize(p, q, g);
-
         dh2_ = make_shared<DH2>(*dh_);
-        dh_key_.priv = make_shared<SecByteBlock>(dh2_->StaticPrivateKeyLength());
-        dh_key_.pub = make_shared<SecByteBlock>(dh2_->StaticPublicKeyLength());
-        sign_key_.priv = make_shared<SecByteBlock>(dh2_->EphemeralPrivateKeyLength());
-        sign_key_.pub = make_shared<SecByteBlock>(dh2_->EphemeralPublicKeyLength());
-
         rnd_ = make_shared<AutoSeededRandomPool>();
-        dh2_->GenerateStaticKeyPair(*rnd_, *dh_key_.priv, *dh_key_.pub);
-        dh2_->GenerateEphemeralKeyPair(*rnd_, *sign_key_.priv, *sign_key_.pub);
+
+        if (generate_keys) {
+            set_keys(create_keys());
+        }
+    }
+
+    SecurityKeys Security::create_keys() {
+        DH dh;
+        dh.AccessGroupParameters().Initialize(p, q, g);
+        DH2 dh2(dh);
+        AutoSeededRandomPool rnd;
+
+        SecurityKeys keys;
+        keys.dh.priv = make_shared<SecByteBlock>(dh2.StaticPrivateKeyLength());
+        keys.dh.pub = make_shared<SecByteBlock>(dh2.StaticPublicKeyLength());
+        keys.sign.priv = make_shared<SecByteBlock>(dh2.EphemeralPrivateKeyLength());
+        keys.sign.pub = make_shared<SecByteBlock>(dh2.EphemeralPublicKeyLength());
+
+        dh2.GenerateStaticKeyPair(rnd, *keys.dh.priv, *keys.dh.pub);
+        dh2.GenerateEphemeralKeyPair(rnd, *keys.sign.priv, *keys.sign.pub);
+        return keys;
+    }
+
+    void Security::set_keys(SecurityKeys &&keys) {
+        dh_key_ = std::move(keys.dh);
+        sign_key_ = std::move(keys.sign);
+    }
+
+    bool Security::has_keys() const {
+        return dh_key_.pub != nullptr;
     }
 
     string Security::get_pub_dh_key() const {
@@ -70,6 +96,10 @@ namespace ncnet {
     }
 
     std::string Security::compute_shared_key(const string &client_dh_pub, const string &client_sign_pub) {
+        if (!has_keys()) {
+            throw runtime_error("Key pairs not set");
+        }
+
         SecByteBlock dh_pub(reinterpret_cast<const byte*>(&client_dh_pub[0]), client_dh_pub.size());
         SecByteBlock sign_pub(reinterpret_cast<const byte*>(&client_sign_pub[0]), client_sign_pub.size());
 
@@ -89,6 +119,7 @@ namespace ncnet {
         // Generate a random CEK
         cek_ = make_shared<SecByteBlock>(AES_KEY_LENGTH);
         rnd_->GenerateBlock(cek_->BytePtr(), cek_->SizeInBytes());
+        set_cek(*cek_, true);
 
         // AES in ECB mode is fine - we're encrypting 1 block, so we don't need padding
         ECB_Mode<AES>::Encryption aes;
@@ -130,63 +161,123 @@ namespace ncnet {
 
         // Store CEK
         cek_ = make_shared<SecByteBlock>(out);
+        set_cek(*cek_, false);
+    }
+
+    void Security::set_cek(const SecByteBlock &cek, bool server) {
+        // Both ciphers are keyed once, nonces are passed per packet
+        byte nonce[NONCE_SIZE] = {};
+        encryption_.SetKeyWithIV(cek, cek.size(), nonce, sizeof nonce);
+        decryption_.SetKeyWithIV(cek, cek.size(), nonce, sizeof nonce);
+
+        send_direction_ = server ? NONCE_SERVER : NONCE_CLIENT;
+        receive_direction_ = server ? NONCE_CLIENT : NONCE_SERVER;
+        send_counter_ = receive_counter_ = 0;
+    }
+
+    // Nonce is [Direction:4][Counter:8], the counter is also sent after the tag
+    static void write_nonce(byte *nonce, uint32_t direction, uint64_t counter) {
+        for (int i = 0; i < 4; i++) {
+            nonce[i] = direction >> (i * 8) & 0xFF;
+        }
+
+        for (size_t i = 0; i < ENCRYPTION_COUNTER_SIZE; i++) {
+            nonce[4 + i] = counter >> (i * 8) & 0xFF;
+        }
     }
 
-    void Security::encrypt(const shared_ptr<vector<byte>> &plain, size_t start, shared_ptr<vector<byte>> &cipher) {
-        byte iv[IV_SIZE];
-        rnd_->GenerateBlock(iv, sizeof iv);
+    void Security::set_enabled(bool enabled) {
+        enabled_ = enabled;
+    }
 
-        // Encrypted, with Tag
-        string cipher2;
+    bool Security::is_enabled() const {
+        return enabled_;
+    }
 
-        try {
-            GCM<AES>::Encryption e;
-            e.SetKeyWithIV(*cek_, cek_->size(), iv, sizeof iv);
+    string Security::get_resumption_secret() const {
+        if (!cek_) {
+            throw runtime_error("No key exchange done");
+        }
 
-            // Make room for padding
-            cipher->resize(plain->size() + AES::BLOCKSIZE + start);
-            ArraySink cs(&(*cipher)[start], cipher->size() - start);
+        // CMAC as PRF keyed with the CEK, the CEK itself is never reused
+        SecByteBlock secret(AES_KEY_LENGTH);
+        CMAC<AES> cmac(cek_->BytePtr(), cek_->SizeInBytes());
+        cmac.CalculateTruncatedDigest(secret.BytePtr(), secret.SizeInBytes(),
+                                      reinterpret_cast<const byte*>(RESUMPTION_LABEL), sizeof RESUMPTION_LABEL - 1);
 
-            ArraySource(plain->data() + start, plain->size() - start, true,
-                new AuthenticatedEncryptionFilter(e,
-                    new Redirector(cs), false, TAG_SIZE
-                ) // AuthenticatedEncryptionFilter
-            ); // ArraySource
+        return string(reinterpret_cast<const char*>(secret.BytePtr()), secret.size());
+    }
 
-            // Set cipher text length now that its known
-            cipher->resize(cs.TotalPutLength() + start);
-        } catch (CryptoPP::Exception &e) {
-            // Programming error
-            throw runtime_error("Encryption failed");
+    void Security::resume(const string &secret, const string &client_random, const string &server_random, bool server) {
+        if (secret.size() != AES_KEY_LENGTH) {
+            throw runtime_error("Invalid resumption secret");
         }
 
-        // Add IV for decrypting
-        cipher->insert(cipher->end(), iv, iv + sizeof iv);
+        // Fresh randoms from both sides give a new CEK, nonces restart from zero
+        auto randoms = client_random + server_random;
+        CMAC<AES> cmac(reinterpret_cast<const byte*>(secret.data()), secret.size());
+        cek_ = make_shared<SecByteBlock>(AES_KEY_LENGTH);
+        cmac.CalculateTruncatedDigest(cek_->BytePtr(), cek_->SizeInBytes(),
+                                      reinterpret_cast<const byte*>(randoms.data()), randoms.size());
+        set_cek(*cek_, server);
     }
 
-    void Security::decrypt(const shared_ptr<vector<byte>> &cipher, size_t start, shared_ptr<vector<byte>> &plain) {
-        byte *iv = &cipher->data()[cipher->size() - IV_SIZE];
+    string Security::create_random(size_t size) {
+        string random(size, '\0');
+        rnd_->GenerateBlock(reinterpret_cast<byte*>(&random[0]), size);
+        return random;
+    }
 
-        try {
-            GCM<AES>::Decryption d;
-            d.SetKeyWithIV(*cek_, cek_->size(), iv, IV_SIZE);
+    void Security::encrypt(vector<byte> &data, size_t start, byte flags) {
+        if (!enabled_) {
+            return;
+        }
+
+        byte nonce[NONCE_SIZE];
+        write_nonce(nonce, send_direction_, ++send_counter_);
 
-            // Make room
-            plain->resize(cipher->size() - IV_SIZE);
-            ArraySink cs(&(*plain)[start], plain->size() - start);
+        auto size = data.size() - start;
+        data.resize(data.size() + ENCRYPTION_TAG_SIZE);
 
-            ArraySource(cipher->data() + start, cipher->size() - start - IV_SIZE, true,
-                new AuthenticatedDecryptionFilter(d,
-                    new Redirector(cs),
-                    AuthenticatedDecryptionFilter::DEFAULT_FLAGS,
-                    TAG_SIZE
-                )
-            );
+        encryption_.EncryptAndAuthenticate(&data[start], &data[start + size], ENCRYPTION_TAG_SIZE,
+                                           nonce, sizeof nonce, &flags, 1, &data[start], size);
 
-            // Set cipher text length now that its known
-            plain->resize(cs.TotalPutLength() + start);
-        } catch (CryptoPP::Exception &e) {
+        // Add counter for decrypting
+        data.insert(data.end(), nonce + 4, nonce + sizeof nonce);
+    }
+
+    void Security::decrypt(const byte *cipher, size_t size, size_t start, byte flags, vector<byte> &plain) {
+        if (!enabled_) {
+            plain.resize(start);
+            plain.insert(plain.end(), cipher, cipher + size);
+            return;
+        }
+
+        if (size < ENCRYPTION_OVERHEAD) {
+            throw runtime_error("Cipher too short");
+        }
+
+        uint64_t counter = 0;
+        for (size_t i = 0; i < ENCRYPTION_COUNTER_SIZE; i++) {
+            counter |= static_cast<uint64_t>(cipher[size - ENCRYPTION_COUNTER_SIZE + i]) << (i * 8);
+        }
+
+        // Reject replayed or reordered packets
+        if (counter <= receive_counter_) {
+            throw runtime_error("Nonce counter did not increase");
+        }
+
+        byte nonce[NONCE_SIZE];
+        write_nonce(nonce, receive_direction_, counter);
+
+        auto length = size - ENCRYPTION_OVERHEAD;
+        plain.resize(start + length);
+
+        if (!decryption_.DecryptAndVerify(plain.data() + start, cipher + length, ENCRYPTION_TAG_SIZE,
+                                          nonce, sizeof nonce, &flags, 1, cipher, length)) {
             throw runtime_error("Decryption failed");
         }
+
+        receive_counter_ = counter;
     }
 }
\ No newline at end of file
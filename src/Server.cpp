@@ -2,20 +2,17 @@
 #include "Log.h"
 
 #include <unistd.h>
+#include <cerrno>
 #include <cstring>
 #include <netdb.h>
+#include <arpa/inet.h>
+#include <algorithm>
 
 using namespace std;
 
 namespace ncnet {
-    static void networking(Server& server) {
-        server.run();
-    }
-
-    bool Server::start(const string &hostname, int port) {
-        // hostname is not used in server-mode
-        (void)hostname;
-
+    // Returns listening socket bound to port on all interfaces or -1
+    static int create_listener(int port, bool reuse_port) {
         struct addrinfo hints;
 
         memset(&hints, 0, sizeof(struct addrinfo));
@@ -26,52 +23,186 @@ namespace ncnet {
         struct addrinfo* resulting_hints;
         int result = getaddrinfo(NULL, to_string(port).c_str(), &hints, &resulting_hints);
         if (result != 0) {
-            Log(ERROR) << "getaddrinfo failed with code " << result;
-            return false;
+            NCNET_LOG(ERROR) << "getaddrinfo failed with code " << result;
+            return -1;
         }
 
-        bool success = false;
+        int fd = -1;
         for (struct addrinfo* i = resulting_hints; i != nullptr; i = i->ai_next) {
-            socket_ = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
-            if (socket_ == -1) {
+            fd = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
+            if (fd == -1) {
                 continue; // Continue until success
             }
 
             // Set re-usable
             int on = 1;
-            if (setsockopt(socket_, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on)) < 0) {
-                Log(WARN) << "Not reusable address";
+            if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on)) < 0) {
+                NCNET_LOG(WARN) << "Not reusable address";
             }
 
-            result = bind(socket_, i->ai_addr, i->ai_addrlen);
+            // Let the kernel balance connections between listeners on the same port
+            if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*)&on, sizeof(on)) < 0) {
+                NCNET_LOG(WARN) << "SO_REUSEPORT not supported";
+                close(fd);
+                fd = -1;
+                break;
+            }
+
+            result = bind(fd, i->ai_addr, i->ai_addrlen);
             if (result == 0) {
-                success = true;
                 break; // Success
             }
 
-            close(socket_);
+            close(fd);
+            fd = -1;
         }
 
         freeaddrinfo(resulting_hints);
 
-        if (!success) {
-            Log(ERROR) << "Failed to bind to any interface on port " << port;
-            return success;
+        if (fd == -1) {
+            return -1;
+        }
+
+        // Non-blocking mode
+        Network::prepare_socket(fd);
+
+        if (listen(fd, SOMAXCONN) == -1) {
+            NCNET_LOG(ERROR) << "Failed to listen to socket";
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    // Returns the port a TCP socket is bound to or -1, used to find the one picked for port 0
+    static int bound_port(int fd) {
+        sockaddr_storage address;
+        socklen_t length = sizeof address;
+        if (getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+            return -1;
+        }
+
+        if (address.ss_family == AF_INET6) {
+            return ntohs(reinterpret_cast<sockaddr_in6*>(&address)->sin6_port);
+        }
+
+        return ntohs(reinterpret_cast<sockaddr_in*>(&address)->sin_port);
+    }
+
+    // Returns listening unix domain socket or -1, a stale socket file left by a dead server is replaced
+    static int create_local_listener(const sockaddr_un &address, socklen_t length) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            return -1;
+        }
+
+        auto *addr = reinterpret_cast<const sockaddr*>(&address);
+        auto bound = bind(fd, addr, length) == 0;
+
+        if (!bound && errno == EADDRINUSE && address.sun_path[0] != '\0') {
+            // Only remove the file if nobody is listening on it
+            int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+            auto alive = probe != -1 && connect(probe, addr, length) == 0;
+            if (probe != -1) {
+                close(probe);
+            }
+
+            bound = !alive && unlink(address.sun_path) == 0 && bind(fd, addr, length) == 0;
+        }
+
+        if (!bound) {
+            close(fd);
+            return -1;
         }
 
         // Non-blocking mode
-        prepare_socket(socket_);
+        Network::prepare_socket(fd, false);
 
-        if (listen(socket_, SOMAXCONN) == -1) {
-            Log(ERROR) << "Failed to listen to socket";
-            close(socket_);
-            return false;
+        if (listen(fd, SOMAXCONN) == -1) {
+            NCNET_LOG(ERROR) << "Failed to listen to socket";
+            close(fd);
+            return -1;
         }
 
-        // Create networking thread and start processing
-        network_ = thread(networking, ref(*this));
+        return fd;
+    }
+
+    bool Server::start(const string &hostname, int port) {
+        auto count = max<size_t>(1, min(reactor_count_, MAX_REACTORS));
+        create_reactors(count);
+
+        // Hostname is only used for unix domain sockets, TCP listens on all interfaces
+        sockaddr_un local;
+        socklen_t local_length;
+        bool shared;
+        vector<int> listeners;
+
+        if (unix_address(hostname, local, local_length, shared)) {
+            auto fd = local_length > 0 ? create_local_listener(local, local_length) : -1;
+            if (fd == -1) {
+                NCNET_LOG(ERROR) << "Failed to listen on " << hostname;
+                return false;
+            }
+
+            use_local_transport();
+            shared_memory_ = shared;
+            if (local.sun_path[0] != '\0') {
+                local_path_ = local.sun_path;
+            }
+
+            // One listener, the first reactor hands out sockets
+            listeners.push_back(fd);
+            single_acceptor_ = count > 1;
+        }
+
+        // Prefer one listener per reactor, sharing the port with SO_REUSEPORT
+        for (size_t i = 0; i < count && !local_; i++) {
+            auto fd = create_listener(port, count > 1);
+            if (fd == -1) {
+                break;
+            }
+
+            // Every listener has to share the port the kernel picked for the first one
+            if (port == 0) {
+                port = bound_port(fd);
+            }
+
+            listeners.push_back(fd);
+        }
+
+        if (!local_ && listeners.size() != count) {
+            for (auto fd : listeners) {
+                close(fd);
+            }
+
+            listeners.clear();
+
+            // Fall back to the first reactor accepting and handing out sockets round-robin
+            auto fd = create_listener(port, false);
+            if (fd == -1) {
+                NCNET_LOG(ERROR) << "Failed to bind to any interface on port " << port;
+                return false;
+            }
+
+            if (port == 0) {
+                port = bound_port(fd);
+            }
+
+            listeners.push_back(fd);
+            single_acceptor_ = count > 1;
+        }
+
+        for (size_t i = 0; i < listeners.size(); i++) {
+            reactors_[i]->set_listen_socket(listeners[i]);
+        }
+
+        socket_ = listeners.front();
+
+        // Create networking threads and start processing
+        start_reactors();
         port_ = port;
 
-        return success;
+        return true;
     }
 }
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include "Session.h"
+#include "Log.h"
+
+#include <cryptopp/aes.h>
+#include <cryptopp/gcm.h>
+#include <cryptopp/osrng.h>
+
+#include <chrono>
+
+using namespace CryptoPP;
+using namespace std;
+
+// Ticket is [Nonce][Encrypted [Secret][Expiry]][Tag]
+static constexpr size_t TICKET_KEY_SIZE = 16;
+static constexpr size_t TICKET_NONCE_SIZE = 12;
+static constexpr size_t TICKET_TAG_SIZE = 12;
+static constexpr size_t TICKET_EXPIRY_SIZE = 8;
+
+static uint64_t now_seconds() {
+    return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+namespace ncnet {
+    SessionTickets::SessionTickets(int lifetime) : key_(TICKET_KEY_SIZE), lifetime_(lifetime) {
+        AutoSeededRandomPool rnd;
+        rnd.GenerateBlock(key_.BytePtr(), key_.SizeInBytes());
+    }
+
+    string SessionTickets::issue(const string &secret) {
+        string plain = secret;
+        auto expiry = now_seconds() + lifetime_;
+        for (size_t i = 0; i < TICKET_EXPIRY_SIZE; i++) {
+            plain.push_back(static_cast<char>(expiry >> (i * 8) & 0xFF));
+        }
+
+        string ticket(TICKET_NONCE_SIZE + plain.size() + TICKET_TAG_SIZE, '\0');
+        auto *data = reinterpret_cast<byte*>(&ticket[0]);
+
+        // Random nonces, tickets are issued far too rarely to collide
+        AutoSeededRandomPool rnd;
+        rnd.GenerateBlock(data, TICKET_NONCE_SIZE);
+
+        GCM<AES>::Encryption encryption;
+        encryption.SetKeyWithIV(key_, key_.size(), data, TICKET_NONCE_SIZE);
+        encryption.EncryptAndAuthenticate(data + TICKET_NONCE_SIZE, data + TICKET_NONCE_SIZE + plain.size(), TICKET_TAG_SIZE,
+                                          data, TICKET_NONCE_SIZE, nullptr, 0,
+                                          reinterpret_cast<const byte*>(plain.data()), plain.size());
+        return ticket;
+    }
+
+    bool SessionTickets::open(const string &ticket, string &secret) {
+        if (ticket.size() <= TICKET_NONCE_SIZE + TICKET_EXPIRY_SIZE + TICKET_TAG_SIZE) {
+            return false;
+        }
+
+        auto *data = reinterpret_cast<const byte*>(ticket.data());
+        auto length = ticket.size() - TICKET_NONCE_SIZE - TICKET_TAG_SIZE;
+        string plain(length, '\0');
+
+        GCM<AES>::Decryption decryption;
+        decryption.SetKeyWithIV(key_, key_.size(), data, TICKET_NONCE_SIZE);
+        if (!decryption.DecryptAndVerify(reinterpret_cast<byte*>(&plain[0]), data + TICKET_NONCE_SIZE + length, TICKET_TAG_SIZE,
+                                         data, TICKET_NONCE_SIZE, nullptr, 0, data + TICKET_NONCE_SIZE, length)) {
+            NCNET_LOG(DEBUG) << "Rejecting session ticket which failed to decrypt";
+            return false;
+        }
+
+        uint64_t expiry = 0;
+        for (size_t i = 0; i < TICKET_EXPIRY_SIZE; i++) {
+            expiry |= static_cast<uint64_t>(static_cast<unsigned char>(plain[length - TICKET_EXPIRY_SIZE + i])) << (i * 8);
+        }
+
+        if (expiry < now_seconds()) {
+            NCNET_LOG(DEBUG) << "Rejecting expired session ticket";
+            return false;
+        }
+
+        secret = plain.substr(0, length - TICKET_EXPIRY_SIZE);
+        return true;
+    }
+
+    KeyPool::KeyPool(size_t size) : size_(size) {
+        thread_ = thread(&KeyPool::run, this);
+    }
+
+    KeyPool::~KeyPool() {
+        {
+            lock_guard<mutex> lock(lock_);
+            stop_ = true;
+        }
+
+        cv_.notify_one();
+        thread_.join();
+    }
+
+    bool KeyPool::take(SecurityKeys &keys) {
+        bool refill;
+        {
+            lock_guard<mutex> lock(lock_);
+            if (keys_.empty()) {
+                return false;
+            }
+
+            keys = move(keys_.front());
+            keys_.pop_front();
+            // The generator sleeps while the pool is full
+            refill = keys_.size() + 1 == size_;
+        }
+
+        if (refill) {
+            cv_.notify_one();
+        }
+
+        return true;
+    }
+
+    void KeyPool::run() {
+        while (true) {
+            {
+                unique_lock<mutex> lock(lock_);
+                cv_.wait(lock, [this] {
+                    return stop_ || keys_.size() < size_;
+                });
+
+                if (stop_) {
+                    return;
+                }
+            }
+
+            // Generate without the lock, network threads keep taking keys meanwhile
+            auto keys = Security::create_keys();
+
+            lock_guard<mutex> lock(lock_);
+            keys_.push_back(move(keys));
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,303 @@
+#include "SharedChannel.h"
+#include "Log.h"
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+using namespace std;
+
+namespace ncnet {
+    static constexpr uint64_t SEGMENT_MAGIC = 0x6e636e6574726e67; // "ncnetrng"
+    static constexpr size_t SEGMENT_DESCRIPTORS = 3; // Segment, client eventfd, server eventfd
+    // The size is fixed before handing the segment over, resizing it would fault the server on its next access
+    static constexpr int SEGMENT_SEALS = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+    // Shared between processes, only lock-free atomics are address-free
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "Shared rings need lock-free atomics");
+
+    struct alignas(64) SegmentHeader {
+        uint64_t magic;
+        uint64_t capacity;
+    };
+
+    // Positions only grow, the offset in the ring is the position modulo capacity.
+    // Each index is written by one side only and kept on its own cache line.
+    struct SharedRing {
+        alignas(64) atomic<uint64_t> head{0}; // Written by the producer
+        alignas(64) atomic<uint64_t> tail{0}; // Written by the consumer
+        alignas(64) atomic<uint32_t> producer_waiting{0}; // Producer ran out of space
+    };
+
+    // Segment is [Header][Ring client -> server][Data][Ring server -> client][Data]
+    static size_t ring_offset(size_t capacity, size_t index) {
+        return sizeof(SegmentHeader) + index * (sizeof(SharedRing) + capacity);
+    }
+
+    static void notify(int fd) {
+        uint64_t value = 1;
+        if (write(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+            NCNET_LOG(ERROR) << "Shared channel peer could not be woken";
+        }
+    }
+
+    // The peer can write the whole segment, never copy based on indices further apart than the ring
+    static bool corrupted(uint64_t head, uint64_t tail, size_t capacity) {
+        if (head - tail <= capacity) {
+            return false;
+        }
+
+        NCNET_LOG(WARN) << "Shared ring indices corrupted by peer, head = " << head << ", tail = " << tail;
+        errno = EPROTO;
+        return true;
+    }
+
+    static void close_all(const int *fds, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+    }
+
+    SharedChannel::SharedChannel(void *memory, size_t size, size_t capacity, bool client, int own_event, int peer_event)
+        : memory_(memory), size_(size), capacity_(capacity), own_event_(own_event), peer_event_(peer_event) {
+        auto *base = static_cast<char*>(memory);
+        auto *first = base + ring_offset(capacity, 0);
+        auto *second = base + ring_offset(capacity, 1);
+
+        // Clients write the first ring and read the second
+        auto *out = client ? first : second;
+        auto *in = client ? second : first;
+        out_ = reinterpret_cast<SharedRing*>(out);
+        in_ = reinterpret_cast<SharedRing*>(in);
+        out_data_ = out + sizeof(SharedRing);
+        in_data_ = in + sizeof(SharedRing);
+    }
+
+    SharedChannel::~SharedChannel() {
+        munmap(memory_, size_);
+        int fds[] = { memory_fd_, own_event_, peer_event_ };
+        close_all(fds, SEGMENT_DESCRIPTORS);
+    }
+
+    unique_ptr<SharedChannel> SharedChannel::create(size_t capacity) {
+        // Power of two keeps the offset a mask and data aligned after the ring indices
+        if (capacity < sizeof(SharedRing) || (capacity & (capacity - 1)) != 0) {
+            NCNET_LOG(ERROR) << "Shared ring size must be a power of two, got " << capacity;
+            return nullptr;
+        }
+
+        auto size = ring_offset(capacity, 2);
+        int fds[] = { memfd_create("ncnet", MFD_CLOEXEC | MFD_ALLOW_SEALING), eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                      eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) };
+
+        if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0 || ftruncate(fds[0], size) < 0 ||
+            fcntl(fds[0], F_ADD_SEALS, SEGMENT_SEALS) < 0) {
+            NCNET_LOG(ERROR) << "Failed to create shared memory segment, errno = " << errno;
+            close_all(fds, SEGMENT_DESCRIPTORS);
+            return nullptr;
+        }
+
+        auto *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+        if (memory == MAP_FAILED) {
+            NCNET_LOG(ERROR) << "Failed to map shared memory segment, errno = " << errno;
+            close_all(fds, SEGMENT_DESCRIPTORS);
+            return nullptr;
+        }
+
+        auto *base = static_cast<char*>(memory);
+        auto *header = new (base) SegmentHeader();
+        header->magic = SEGMENT_MAGIC;
+        header->capacity = capacity;
+        new (base + ring_offset(capacity, 0)) SharedRing();
+        new (base + ring_offset(capacity, 1)) SharedRing();
+
+        unique_ptr<SharedChannel> channel(new SharedChannel(memory, size, capacity, true, fds[1], fds[2]));
+        channel->memory_fd_ = fds[0];
+        return channel;
+    }
+
+    bool SharedChannel::send_descriptors(int socket) {
+        int fds[] = { memory_fd_, own_event_, peer_event_ };
+        char control[CMSG_SPACE(sizeof(fds))] = {};
+        char data = 0;
+        iovec buffer = { &data, 1 };
+
+        msghdr message = {};
+        message.msg_iov = &buffer;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof control;
+
+        auto *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        if (sendmsg(socket, &message, MSG_NOSIGNAL) != 1) {
+            NCNET_LOG(ERROR) << "Failed to send shared memory segment, errno = " << errno;
+            return false;
+        }
+
+        // The mapping stays valid, the server keeps its own descriptor
+        close(memory_fd_);
+        memory_fd_ = -1;
+        return true;
+    }
+
+    unique_ptr<SharedChannel> SharedChannel::receive(int socket, bool &would_block) {
+        int fds[SEGMENT_DESCRIPTORS] = { -1, -1, -1 };
+        char control[CMSG_SPACE(sizeof(fds))] = {};
+        char data;
+        iovec buffer = { &data, 1 };
+
+        msghdr message = {};
+        message.msg_iov = &buffer;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof control;
+
+        would_block = false;
+        auto received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            would_block = true;
+            return nullptr;
+        }
+
+        auto *cmsg = CMSG_FIRSTHDR(&message);
+        if (received == 1 && cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fds, CMSG_DATA(cmsg), min(sizeof(fds), static_cast<size_t>(cmsg->cmsg_len - CMSG_LEN(0))));
+        }
+
+        // The size must be sealed and match the header before trusting any offsets
+        struct stat info;
+        auto valid = cmsg != nullptr && cmsg->cmsg_len == CMSG_LEN(sizeof(fds)) && !(message.msg_flags & MSG_CTRUNC) &&
+                     fds[0] >= 0 && fcntl(fds[0], F_GET_SEALS) == SEGMENT_SEALS && fstat(fds[0], &info) == 0 &&
+                     static_cast<size_t>(info.st_size) > sizeof(SegmentHeader);
+
+        void *memory = MAP_FAILED;
+        size_t size = valid ? info.st_size : 0;
+        if (valid) {
+            memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+        }
+
+        if (memory != MAP_FAILED) {
+            auto *header = static_cast<SegmentHeader*>(memory);
+            auto capacity = header->capacity;
+            auto power_of_two = capacity >= sizeof(SharedRing) && (capacity & (capacity - 1)) == 0;
+
+            if (header->magic == SEGMENT_MAGIC && power_of_two && capacity < size && ring_offset(capacity, 2) == size) {
+                close(fds[0]);
+                return unique_ptr<SharedChannel>(new SharedChannel(memory, size, capacity, false, fds[2], fds[1]));
+            }
+
+            munmap(memory, size);
+        }
+
+        NCNET_LOG(WARN) << "Invalid shared memory segment received";
+        close_all(fds, SEGMENT_DESCRIPTORS);
+        return nullptr;
+    }
+
+    ssize_t SharedChannel::write(const iovec *buffers, size_t count) {
+        // Only we move the head, the consumer moves the tail
+        auto head = out_->head.load(memory_order_relaxed);
+        auto tail = out_->tail.load(memory_order_acquire);
+        if (corrupted(head, tail, capacity_)) {
+            return -1;
+        }
+
+        auto space = capacity_ - (head - tail);
+        size_t requested = 0;
+        size_t written = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            requested += buffers[i].iov_len;
+            auto length = min(buffers[i].iov_len, space - written);
+            if (length == 0) {
+                continue;
+            }
+
+            // Split at the end of the ring
+            auto offset = (head + written) & (capacity_ - 1);
+            auto first = min(length, capacity_ - offset);
+            auto *source = static_cast<const char*>(buffers[i].iov_base);
+            memcpy(out_data_ + offset, source, first);
+            memcpy(out_data_, source + first, length - first);
+            written += length;
+        }
+
+        if (written > 0) {
+            // Sequentially consistent, pairs with the consumer storing its tail before reading our head again.
+            // The consumer only waits for a wakeup after it read everything.
+            out_->head.store(head + written);
+            if (out_->tail.load() == head) {
+                notify(peer_event_);
+            }
+        }
+
+        if (written < requested) {
+            // Ask to be woken once there is space, retry ourselves if the consumer read before seeing the flag
+            out_->producer_waiting.store(1);
+            if (out_->tail.load() != tail) {
+                wake();
+            }
+        }
+
+        return written;
+    }
+
+    ssize_t SharedChannel::read(void *buffer, size_t size) {
+        auto *target = static_cast<char*>(buffer);
+        auto tail = in_->tail.load(memory_order_relaxed);
+        size_t copied = 0;
+
+        // Read the head again after every tail update, the producer skips the wakeup if we were behind
+        while (copied < size) {
+            auto head = in_->head.load();
+            if (corrupted(head, tail, capacity_)) {
+                return -1;
+            }
+
+            auto length = min<size_t>({ head - tail, size - copied, capacity_ });
+            if (length == 0) {
+                break;
+            }
+
+            auto offset = tail & (capacity_ - 1);
+            auto first = min(length, capacity_ - offset);
+            memcpy(target + copied, in_data_ + offset, first);
+            memcpy(target + copied + first, in_data_, length - first);
+            tail += length;
+            copied += length;
+            in_->tail.store(tail);
+        }
+
+        if (copied > 0 && in_->producer_waiting.load() != 0 && in_->producer_waiting.exchange(0) != 0) {
+            notify(peer_event_);
+        }
+
+        return copied;
+    }
+
+    bool SharedChannel::reset() {
+        // Reading clears the counter
+        uint64_t value;
+        return ::read(own_event_, &value, sizeof(value)) > 0;
+    }
+
+    void SharedChannel::wake() {
+        notify(own_event_);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,511 @@
+#include "UringPoller.h"
+#include "Log.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <numeric>
+
+using namespace std;
+
+namespace ncnet {
+    static constexpr unsigned QUEUE_ENTRIES = 256;
+    static constexpr unsigned COMPLETION_ENTRIES = 4096; // Multishot operations complete many times per submission
+    static constexpr uint16_t BUFFER_GROUP = 0;
+    static constexpr unsigned BUFFER_COUNT = 128; // Power of two
+    static constexpr size_t BUFFER_SIZE = 16384;
+
+    enum UringOperation : uint8_t {
+        URING_RECV = 1,
+        URING_POLL,
+        URING_ACCEPT,
+        URING_SEND,
+        URING_CANCEL
+    };
+
+    // User data is the registration ID followed by the operation in the lowest byte
+    static uint64_t user_data(uint64_t id, uint8_t operation) {
+        return id << 8 | operation;
+    }
+
+    // No liburing, the three syscalls are all we need
+    static int uring_setup(unsigned entries, io_uring_params *params) {
+        return syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    static int uring_enter(int fd, unsigned submit, unsigned min_complete, unsigned flags, const void *arg, size_t size) {
+        return syscall(__NR_io_uring_enter, fd, submit, min_complete, flags, arg, size);
+    }
+
+    static int uring_register(int fd, unsigned opcode, const void *arg, unsigned count) {
+        return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+    }
+
+    // Ring indices are shared with the kernel
+    static unsigned load_acquire(const unsigned *index) {
+        return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+    }
+
+    static void store_release(unsigned *index, unsigned value) {
+        __atomic_store_n(index, value, __ATOMIC_RELEASE);
+    }
+
+    UringPoller::UringPoller() {
+        // Deferred task work only runs completions while we wait, older kernels take the plain setup
+        auto deferred = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        if ((setup(deferred) || setup(IORING_SETUP_CQSIZE)) && !register_buffers()) {
+            teardown();
+        }
+    }
+
+    UringPoller::~UringPoller() {
+        if (ring_fd_ >= 0 && in_flight_ > 0) {
+            // The kernel may still write to provided buffers or read send buffers, cancel and wait
+            auto *sqe = get_sqe(URING_CANCEL, -1, 0);
+            if (sqe != nullptr) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+            }
+
+            registrations_.clear();
+            vector<PollResult> discarded;
+            vector<uint16_t> buffers;
+
+            for (int i = 0; i < 100 && in_flight_ > 0 && enter(1, 10); i++) {
+                reap(discarded, buffers);
+            }
+        }
+
+        teardown();
+    }
+
+    bool UringPoller::valid() const {
+        return ring_fd_ >= 0;
+    }
+
+    bool UringPoller::setup(unsigned flags) {
+        io_uring_params params = {};
+        params.flags = flags;
+        params.cq_entries = COMPLETION_ENTRIES;
+
+        ring_fd_ = uring_setup(QUEUE_ENTRIES, &params);
+        if (ring_fd_ < 0) {
+            return false;
+        }
+
+        // Timeouts while entering, no dropped completions and both rings in one mapping
+        auto required = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP | IORING_FEAT_SINGLE_MMAP;
+        if ((params.features & required) != required) {
+            teardown();
+            return false;
+        }
+
+        ring_size_ = max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                 params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+
+        auto *ring = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        auto *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+        ring_ = ring == MAP_FAILED ? nullptr : ring;
+        sqes_ = sqes == MAP_FAILED ? nullptr : static_cast<io_uring_sqe*>(sqes);
+        if (ring_ == nullptr || sqes_ == nullptr) {
+            teardown();
+            return false;
+        }
+
+        auto *base = static_cast<char*>(ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        sq_array_ = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        sq_mask_ = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_local_tail_ = *sq_tail_;
+        cq_head_ = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+        // Multishot recv arrived in 6.0 together with zero-copy send, which the probe can tell
+        vector<char> memory(sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op));
+        auto *probe = reinterpret_cast<io_uring_probe*>(memory.data());
+        if (uring_register(ring_fd_, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+            teardown();
+            return false;
+        }
+
+        for (auto operation : { IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_ACCEPT, IORING_OP_POLL_ADD,
+                                IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC }) {
+            if (operation > probe->last_op || !(probe->ops[operation].flags & IO_URING_OP_SUPPORTED)) {
+                teardown();
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void UringPoller::teardown() {
+        if (buffer_ring_ != nullptr) {
+            munmap(buffer_ring_, buffer_ring_size_);
+            buffer_ring_ = nullptr;
+        }
+
+        if (sqes_ != nullptr) {
+            munmap(sqes_, sqes_size_);
+            sqes_ = nullptr;
+        }
+
+        if (ring_ != nullptr) {
+            munmap(ring_, ring_size_);
+            ring_ = nullptr;
+        }
+
+        if (ring_fd_ >= 0) {
+            close(ring_fd_);
+            ring_fd_ = -1;
+        }
+    }
+
+    bool UringPoller::register_buffers() {
+        buffer_ring_size_ = BUFFER_COUNT * sizeof(io_uring_buf);
+        auto *memory = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return false;
+        }
+
+        buffer_ring_ = static_cast<io_uring_buf_ring*>(memory);
+
+        io_uring_buf_reg registration = {};
+        registration.ring_addr = reinterpret_cast<uint64_t>(memory);
+        registration.ring_entries = BUFFER_COUNT;
+        registration.bgid = BUFFER_GROUP;
+        if (uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+            NCNET_LOG(WARN) << "Failed to register io_uring buffer ring, errno = " << errno;
+            return false;
+        }
+
+        buffers_.resize(BUFFER_COUNT * BUFFER_SIZE);
+        vector<uint16_t> all(BUFFER_COUNT);
+        iota(all.begin(), all.end(), 0);
+        recycle(all);
+        return true;
+    }
+
+    io_uring_sqe *UringPoller::get_sqe(uint8_t operation, int fd, uint64_t id) {
+        if (sq_local_tail_ - load_acquire(sq_head_) >= sq_entries_) {
+            // Full, hand everything to the kernel first
+            enter(0, 0);
+            if (sq_local_tail_ - load_acquire(sq_head_) >= sq_entries_) {
+                NCNET_LOG(ERROR) << "io_uring submission queue is full";
+                return nullptr;
+            }
+        }
+
+        auto index = sq_local_tail_ & sq_mask_;
+        auto *sqe = &sqes_[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = fd;
+        sqe->user_data = user_data(id, operation);
+
+        sq_array_[index] = index;
+        sq_local_tail_++;
+        in_flight_++;
+        return sqe;
+    }
+
+    bool UringPoller::arm(uint64_t id, Registration &registration) {
+        auto *sqe = get_sqe(registration.operation, registration.fd, id);
+        if (sqe == nullptr) {
+            return false;
+        }
+
+        switch (registration.operation) {
+            case URING_RECV:
+                // Every chunk lands in a provided buffer picked by the kernel
+                sqe->opcode = IORING_OP_RECV;
+                sqe->ioprio = IORING_RECV_MULTISHOT;
+                sqe->flags = IOSQE_BUFFER_SELECT;
+                sqe->buf_group = BUFFER_GROUP;
+                break;
+            case URING_ACCEPT:
+                sqe->opcode = IORING_OP_ACCEPT;
+                sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+                sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+                break;
+            default:
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->poll32_events = POLLIN;
+                sqe->len = IORING_POLL_ADD_MULTI;
+                break;
+        }
+
+        registration.armed = true;
+        registration.cancelling = false;
+        return true;
+    }
+
+    void UringPoller::cancel(uint64_t id, uint8_t operation) {
+        auto *sqe = get_sqe(URING_CANCEL, -1, id);
+        if (sqe != nullptr) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = user_data(id, operation);
+        }
+    }
+
+    bool UringPoller::enter(unsigned min_complete, int timeout) {
+        store_release(sq_tail_, sq_local_tail_);
+
+        __kernel_timespec time = {};
+        io_uring_getevents_arg arg = {};
+        if (min_complete > 0 && timeout >= 0) {
+            time.tv_sec = timeout / 1000;
+            time.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = reinterpret_cast<uint64_t>(&time);
+        }
+
+        // Getting events also runs deferred task work, even without waiting
+        auto submit = sq_local_tail_ - load_acquire(sq_head_);
+        auto flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (uring_enter(ring_fd_, submit, min_complete, flags, &arg, sizeof(arg)) < 0) {
+            // Timeouts and signals are not errors, busy means completions are waiting to be reaped
+            return errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY;
+        }
+
+        return true;
+    }
+
+    void UringPoller::reap(vector<PollResult> &results, vector<uint16_t> &buffers) {
+        auto head = *cq_head_;
+        auto tail = load_acquire(cq_tail_);
+
+        for (; head != tail; head++) {
+            auto &cqe = cqes_[head & cq_mask_];
+            auto operation = static_cast<uint8_t>(cqe.user_data & 0xFF);
+            auto id = cqe.user_data >> 8;
+            auto more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+            const unsigned char *data = nullptr;
+
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                auto buffer = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                buffers.push_back(buffer);
+                data = buffers_.data() + buffer * BUFFER_SIZE;
+            }
+
+            if (!more) {
+                in_flight_--;
+            }
+
+            // Removed registrations only have their buffers recycled
+            auto iterator = registrations_.find(id);
+            if (operation == URING_CANCEL || iterator == registrations_.end()) {
+                continue;
+            }
+
+            auto &registration = iterator->second;
+            auto token = registration.token;
+
+            if (operation == URING_SEND) {
+                registration.sending = false;
+                results.push_back({ token, POLL_EVENT_SENT, cqe.res });
+                continue;
+            }
+
+            if (!more) {
+                registration.armed = false;
+                registration.cancelling = false;
+            }
+
+            // Stopped for lack of buffers or by a cancel, the next wait restarts it if still wanted
+            if (cqe.res == -ENOBUFS || cqe.res == -ECANCELED) {
+                if (!more) {
+                    rearm_.push_back(id);
+                }
+
+                continue;
+            }
+
+            if (operation == URING_RECV && cqe.res <= 0) {
+                // Closed or failed, nothing more to receive
+                registration.read = false;
+            } else if (!more) {
+                rearm_.push_back(id);
+            }
+
+            if (operation == URING_RECV) {
+                results.push_back({ token, POLL_EVENT_RECEIVED, cqe.res, data });
+            } else if (operation == URING_ACCEPT) {
+                results.push_back({ token, POLL_EVENT_ACCEPTED, cqe.res });
+            } else {
+                auto error = cqe.res < 0 || (cqe.res & (POLLERR | POLLNVAL));
+                results.push_back({ token, error ? POLL_EVENT_ERROR : POLL_EVENT_READ });
+            }
+        }
+
+        store_release(cq_head_, head);
+    }
+
+    void UringPoller::recycle(vector<uint16_t> &buffers) {
+        if (buffers.empty()) {
+            return;
+        }
+
+        // The ring is an array of entries with the tail overlaid on the first one. The header's flexible
+        // array member is placed after an empty struct, which takes a byte in C++, so index it ourselves
+        auto *entries = reinterpret_cast<io_uring_buf*>(buffer_ring_);
+        for (auto buffer : buffers) {
+            auto &entry = entries[buffer_tail_ & (BUFFER_COUNT - 1)];
+            entry.addr = reinterpret_cast<uint64_t>(buffers_.data() + buffer * BUFFER_SIZE);
+            entry.len = BUFFER_SIZE;
+            entry.bid = buffer;
+            buffer_tail_++;
+        }
+
+        // Publish the entries before the tail
+        __atomic_store_n(&buffer_ring_->tail, buffer_tail_, __ATOMIC_RELEASE);
+        buffers.clear();
+    }
+
+    bool UringPoller::add_registration(int fd, size_t token, uint8_t operation) {
+        if (ids_.count(fd)) {
+            return false;
+        }
+
+        auto id = next_id_++;
+        auto &registration = registrations_[id];
+        registration.fd = fd;
+        registration.token = token;
+        registration.operation = operation;
+        ids_[fd] = id;
+
+        return arm(id, registration);
+    }
+
+    bool UringPoller::add(int fd, size_t token, bool /* write */) {
+        // Sockets are read for the user, anything else only reports readiness
+        struct stat info;
+        auto socket = fstat(fd, &info) == 0 && S_ISSOCK(info.st_mode);
+        return add_registration(fd, token, socket ? URING_RECV : URING_POLL);
+    }
+
+    bool UringPoller::accept(int fd, size_t token) {
+        return add_registration(fd, token, URING_ACCEPT);
+    }
+
+    bool UringPoller::set_events(int fd, size_t token, bool read, bool /* write */) {
+        auto iterator = ids_.find(fd);
+        if (iterator == ids_.end()) {
+            return false;
+        }
+
+        auto id = iterator->second;
+        auto &registration = registrations_[id];
+        registration.token = token;
+        registration.read = read;
+
+        if (read && !registration.armed) {
+            return arm(id, registration);
+        }
+
+        // Chunks received before the cancel is processed are still reported
+        if (!read && registration.armed && !registration.cancelling) {
+            cancel(id, registration.operation);
+            registration.cancelling = true;
+        }
+
+        return true;
+    }
+
+    bool UringPoller::remove(int fd) {
+        auto iterator = ids_.find(fd);
+        if (iterator == ids_.end()) {
+            return false;
+        }
+
+        auto id = iterator->second;
+        ids_.erase(iterator);
+        auto &registration = registrations_[id];
+
+        if (registration.armed && !registration.cancelling) {
+            cancel(id, registration.operation);
+        }
+
+        if (registration.sending) {
+            // The kernel may still read the buffers of the send, the caller frees them after removing
+            cancel(id, URING_SEND);
+            while (registration.sending && enter(1, -1)) {
+                reap(deferred_, deferred_buffers_);
+            }
+        }
+
+        registrations_.erase(id);
+        return true;
+    }
+
+    bool UringPoller::send(int fd, size_t token, const iovec *buffers, size_t count) {
+        auto iterator = ids_.find(fd);
+        if (iterator == ids_.end()) {
+            return false;
+        }
+
+        auto id = iterator->second;
+        auto &registration = registrations_[id];
+        if (registration.sending) {
+            return false;
+        }
+
+        registration.token = token;
+        registration.send_buffers.assign(buffers, buffers + count);
+        registration.message = {};
+        registration.message.msg_iov = registration.send_buffers.data();
+        registration.message.msg_iovlen = count;
+
+        auto *sqe = get_sqe(URING_SEND, fd, id);
+        if (sqe == nullptr) {
+            return false;
+        }
+
+        // Submitted together with the next wait
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = reinterpret_cast<uint64_t>(&registration.message);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        registration.sending = true;
+        return true;
+    }
+
+    bool UringPoller::wait(vector<PollResult> &results, int timeout) {
+        results.clear();
+
+        // Results of the last wait were handled, their buffers can be reused
+        recycle(used_buffers_);
+
+        for (auto id : rearm_) {
+            auto iterator = registrations_.find(id);
+            if (iterator != registrations_.end() && iterator->second.read && !iterator->second.armed) {
+                arm(id, iterator->second);
+            }
+        }
+
+        rearm_.clear();
+
+        // Completions reaped while removing a socket go first
+        if (!deferred_.empty()) {
+            results.swap(deferred_);
+            used_buffers_.swap(deferred_buffers_);
+            timeout = 0;
+        }
+
+        if (!enter(timeout == 0 ? 0 : 1, timeout)) {
+            NCNET_LOG(ERROR) << "io_uring_enter failed, errno = " << errno;
+            return false;
+        }
+
+        reap(results, used_buffers_);
+        return true;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,372 @@
+#include <ncnet/Compression.h>
+#include <ncnet/Flow.h>
+#include <ncnet/Metrics.h>
+#include <ncnet/Packet.h>
+#include <ncnet/Session.h>
+
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <vector>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+using namespace ncnet;
+
+// Simulate sending packet over the network by copying the finalized frame into a new packet
+ncnet::Packet transmit(ncnet::Packet &packet) {
+    packet.finalize();
+
+    auto size = packet.left_to_send();
+    assert(ncnet::Packet::frame_size(packet.get_send_buffer()) == size);
+
+    return ncnet::Packet(packet.get_send_buffer(), size);
+}
+
+template<class T>
+void check_value(ncnet::Encoding encoding, T value) {
+    ncnet::Packet packet(encoding);
+    packet << value;
+
+    auto received = transmit(packet);
+    assert(received.get_encoding() == encoding);
+
+    T result;
+    received >> result;
+    assert(result == value);
+    assert(received.left_to_read() == 0);
+}
+
+template<class T>
+void check_limits(ncnet::Encoding encoding) {
+    check_value<T>(encoding, 0);
+    check_value<T>(encoding, 1);
+    check_value<T>(encoding, numeric_limits<T>::max());
+    check_value<T>(encoding, numeric_limits<T>::min());
+}
+
+void check_encoding(ncnet::Encoding encoding) {
+    check_value(encoding, true);
+    check_value(encoding, false);
+    check_limits<short>(encoding);
+    check_limits<unsigned short>(encoding);
+    check_limits<int>(encoding);
+    check_limits<unsigned int>(encoding);
+    check_limits<long>(encoding);
+    check_limits<unsigned long>(encoding);
+    check_limits<long long>(encoding);
+    check_limits<unsigned long long>(encoding);
+    check_value(encoding, -1);
+    check_value(encoding, -1000000000LL);
+
+    // Text mode only keeps 6 decimals
+    check_value(encoding, 1.5f);
+    check_value(encoding, -0.25);
+    check_value(encoding, 1024.125L);
+
+    check_value(encoding, string(""));
+    check_value(encoding, string("string"));
+    check_value(encoding, string(1000, 'x'));
+    check_value(encoding, string("with\0null", 9));
+
+    // const char * is read back as string
+    ncnet::Packet packet(encoding);
+    packet << "c string" << 5 << "both";
+    packet.add_byte(2);
+    auto received = transmit(packet);
+    string str;
+    int val;
+    received >> str >> val;
+    assert(str == "c string" && val == 5);
+    received >> str;
+    assert(str == "both" && received.read_byte() == 2);
+}
+
+void check_binary_precision() {
+    // Binary mode keeps floats exact
+    check_value(ncnet::Encoding::BINARY, numeric_limits<float>::max());
+    check_value(ncnet::Encoding::BINARY, numeric_limits<double>::min());
+    check_value(ncnet::Encoding::BINARY, 0.1);
+    check_value(ncnet::Encoding::BINARY, 3.14159265358979);
+}
+
+void check_binary_size() {
+    ncnet::Packet text;
+    ncnet::Packet binary(ncnet::Encoding::BINARY);
+    text << -1000000000 << 1 << string(300, 'x');
+    binary << -1000000000 << 1 << string(300, 'x');
+
+    // 12 bytes for the integers in text, 5 + 1 in binary, 2 byte string length instead of 4
+    assert(binary.left_to_send() < text.left_to_send());
+    assert(binary.left_to_send() == PACKET_HEADER_SIZE + 5 + 1 + 2 + 300);
+}
+
+void check_max_size() {
+    ncnet::Packet packet;
+    packet << string(PACKET_MAX_SIZE, 'x');
+
+    // The 24-bit size can't be written
+    auto thrown = false;
+    try {
+        packet.finalize();
+    } catch (const runtime_error &) {
+        thrown = true;
+    }
+
+    assert(thrown);
+}
+
+void check_buffer_reuse() {
+    auto before = ncnet::BufferPool::get_stats();
+
+    for (int i = 0; i < 100; i++) {
+        ncnet::Packet packet;
+        packet << string(1000, 'x');
+        auto received = transmit(packet);
+    }
+
+    // Buffers of destroyed packets are reused by the next ones
+    auto after = ncnet::BufferPool::get_stats();
+    assert(after.misses - before.misses < 10);
+    assert(after.hits - before.hits > 190);
+    assert(after.bytes_held > 0);
+}
+
+void check_encryption() {
+    ncnet::Security server, client;
+    auto cek = server.compute_shared_key(client.get_pub_dh_key(), client.get_pub_sign_key());
+    client.compute_shared_key(server.get_pub_dh_key(), server.get_pub_sign_key());
+    client.set_encrypted_cek(cek);
+
+    ncnet::Packet packet(ncnet::Encoding::BINARY);
+    packet << string("secret") << 42;
+    packet.finalize();
+    auto copy = packet.clone();
+    packet.encrypt(server);
+
+    // 8 byte counter and tag are added
+    assert(packet.size() == copy.size() + ncnet::ENCRYPTION_OVERHEAD);
+
+    // Header flags are authenticated, turning the packet into a request is noticed
+    vector<unsigned char> tampered(packet.get_send_buffer(), packet.get_send_buffer() + packet.size());
+    tampered[0] ^= ncnet::PACKET_FLAG_REQUEST;
+    bool rejected = false;
+    try {
+        ncnet::Packet forged;
+        forged.decrypt(client, tampered.data(), tampered.size());
+    } catch (runtime_error &e) {
+        rejected = true;
+    }
+    assert(rejected);
+
+    ncnet::Packet received;
+    received.decrypt(client, packet.get_send_buffer(), packet.size());
+    string str;
+    int val;
+    received >> str >> val;
+    assert(str == "secret" && val == 42);
+    assert(received.get_encoding() == ncnet::Encoding::BINARY);
+
+    // Replaying the same frame is refused
+    bool refused = false;
+    try {
+        received.decrypt(client, packet.get_send_buffer(), packet.size());
+    } catch (runtime_error &e) {
+        refused = true;
+    }
+    assert(refused);
+
+    // Clones have their own buffer
+    copy >> str;
+    assert(str == "secret");
+
+    // Shared copies keep the original intact when encrypted, and send the same buffer when not
+    auto shared = copy.share();
+    shared.encrypt(server);
+    assert(shared.size() == copy.size() + ncnet::ENCRYPTION_OVERHEAD);
+
+    ncnet::Security plaintext(false);
+    plaintext.set_enabled(false);
+    auto unencrypted = copy.share();
+    unencrypted.encrypt(plaintext);
+    assert(unencrypted.get_send_buffer() == copy.get_send_buffer() && unencrypted.size() == copy.size());
+
+    // Correlation ID is carried after the payload and stripped on receive
+    ncnet::Packet request;
+    request << 7;
+    request.set_correlation(ncnet::PACKET_FLAG_REQUEST, 0xDEADBEEF);
+    request.finalize();
+    request.encrypt(client);
+
+    ncnet::Packet received_request;
+    received_request.decrypt(server, request.get_send_buffer(), request.size());
+    assert(received_request.is_request() && !received_request.is_response());
+    assert(received_request.get_correlation_id() == 0xDEADBEEF);
+    received_request >> val;
+    assert(val == 7 && received_request.left_to_read() == 0);
+}
+
+void check_compression() {
+    ncnet::Security server, client;
+    auto cek = server.compute_shared_key(client.get_pub_dh_key(), client.get_pub_sign_key());
+    client.compute_shared_key(server.get_pub_dh_key(), server.get_pub_sign_key());
+    client.set_encrypted_cek(cek);
+
+    ncnet::Packet packet;
+    for (int i = 0; i < 200; i++) {
+        packet << i << string("repeated");
+    }
+
+    packet.set_correlation(ncnet::PACKET_FLAG_REQUEST, 5);
+    packet.finalize();
+    auto original = packet.size();
+    packet.encrypt(server, 64);
+    assert(packet.size() < original / 2);
+
+    ncnet::Packet received;
+    received.decrypt(client, packet.get_send_buffer(), packet.size());
+    assert(received.size() == original && received.get_correlation_id() == 5);
+    for (int i = 0; i < 200; i++) {
+        int val;
+        string str;
+        received >> val >> str;
+        assert(val == i && str == "repeated");
+    }
+
+    // Small packets are left alone
+    ncnet::Packet small;
+    small << string("tiny");
+    small.finalize();
+    original = small.size();
+    small.encrypt(server, 64);
+    assert(small.size() == original + ncnet::ENCRYPTION_OVERHEAD);
+
+    // Overlapping matches and malformed input
+    string text = "abcabcabcabcabcabcabcabcabcabcabcabc0123456789";
+    vector<unsigned char> compressed, restored;
+    ncnet::Compression::compress(reinterpret_cast<const unsigned char*>(text.data()), text.size(), compressed);
+    assert(ncnet::Compression::decompress(compressed.data(), compressed.size(), restored, text.size()));
+    assert(string(restored.begin(), restored.end()) == text);
+
+    restored.clear();
+    assert(!ncnet::Compression::decompress(compressed.data(), compressed.size(), restored, text.size() - 1));
+    restored.clear();
+    assert(!ncnet::Compression::decompress(compressed.data(), compressed.size() - 1, restored, text.size()));
+}
+
+void check_flow() {
+    // Received packets count against their connection and the network total
+    auto total = make_shared<ncnet::ReceiveFlow>();
+    total->counter.set_limits({ 0, 4 });
+    auto flow = make_shared<ncnet::ReceiveFlow>();
+    flow->counter.set_limits({ 100, 0 });
+    flow->parent = total;
+
+    int resumed = 0;
+    flow->resume = [&resumed] { resumed++; };
+
+    vector<ncnet::FlowTicket> tickets;
+    tickets.emplace_back(flow, 60);
+    assert(!flow->counter.above_high());
+    tickets.emplace_back(flow, 40);
+    assert(flow->counter.above_high() && !total->counter.above_high());
+
+    // Resumes once when dropping to the low watermark
+    flow->paused = true;
+    tickets.pop_back();
+    assert(resumed == 0);
+    tickets.pop_back();
+    assert(resumed == 1 && !flow->paused);
+    assert(total->counter.below_low());
+}
+
+void check_session() {
+    ncnet::Security server, client;
+    auto cek = server.compute_shared_key(client.get_pub_dh_key(), client.get_pub_sign_key());
+    client.compute_shared_key(server.get_pub_dh_key(), server.get_pub_sign_key());
+    client.set_encrypted_cek(cek);
+    assert(server.get_resumption_secret() == client.get_resumption_secret());
+
+    // The server gets the secret back from its own ticket
+    ncnet::SessionTickets tickets(60);
+    string secret;
+    auto ticket = tickets.issue(server.get_resumption_secret());
+    assert(tickets.open(ticket, secret) && secret == client.get_resumption_secret());
+
+    // Tampered tickets are refused
+    auto tampered = ticket;
+    tampered[tampered.size() / 2] ^= 1;
+    assert(!tickets.open(tampered, secret));
+    assert(!tickets.open(ticket.substr(0, 8), secret));
+
+    // Resumed sides agree without key pairs
+    ncnet::Security resumed_server(false), resumed_client(false);
+    assert(!resumed_server.has_keys());
+    resumed_server.resume(secret, "client random", "server random", true);
+    resumed_client.resume(client.get_resumption_secret(), "client random", "server random", false);
+
+    ncnet::Packet packet;
+    packet << 42;
+    packet.finalize();
+    packet.encrypt(resumed_client);
+
+    ncnet::Packet received;
+    received.decrypt(resumed_server, packet.get_send_buffer(), packet.size());
+    int val;
+    received >> val;
+    assert(val == 42);
+
+    ncnet::KeyPool pool(2);
+    ncnet::SecurityKeys keys;
+    while (!pool.take(keys)) {}
+    resumed_server.set_keys(move(keys));
+    assert(resumed_server.has_keys());
+}
+
+void check_metrics() {
+    // Every value maps into a bucket starting at most 12.5% below it
+    for (uint64_t value : { 0ULL, 7ULL, 8ULL, 9ULL, 15ULL, 16ULL, 1000ULL, 123456789ULL, ~0ULL }) {
+        auto lower = ncnet::HistogramSnapshot::bucket_value(ncnet::HistogramSnapshot::bucket_of(value));
+        assert(lower <= value && value - lower <= value / 8);
+    }
+
+    assert(ncnet::HistogramSnapshot::bucket_of(~0ULL) == ncnet::HISTOGRAM_BUCKETS - 1);
+
+    ncnet::Metrics metrics;
+    auto *first = metrics.add_shard();
+    auto *second = metrics.add_shard();
+    first->add(ncnet::Counter::PACKETS_SENT, 3);
+    second->add(ncnet::Counter::PACKETS_SENT);
+
+    for (uint64_t i = 1; i <= 100; i++) {
+        (i % 2 ? first : second)->record(ncnet::Histogram::LOOP_NS, i * 1000);
+    }
+
+    auto snapshot = metrics.snapshot();
+    assert(snapshot.get(ncnet::Counter::PACKETS_SENT) == 4);
+
+    auto &loop = snapshot.get(ncnet::Histogram::LOOP_NS);
+    assert(loop.count == 100 && loop.max == 100000 && loop.mean() == 50500);
+    assert(loop.percentile(0.5) <= 51000 && loop.percentile(0.5) >= 51000 * 7 / 8);
+    assert(loop.percentile(1) == 100000);
+    assert(snapshot.to_prometheus().find("ncnet_packets_sent_total 4\n") != string::npos);
+}
+
+int main() {
+    check_encoding(ncnet::Encoding::TEXT);
+    check_encoding(ncnet::Encoding::BINARY);
+    check_binary_precision();
+    check_binary_size();
+    check_max_size();
+    check_buffer_reuse();
+    check_encryption();
+    check_compression();
+    check_flow();
+    check_session();
+    check_metrics();
+
+    cout << "All packet tests passed\n";
+    return 0;
+}
\ No newline at end of file
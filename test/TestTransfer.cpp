@@ -1,5 +1,6 @@
 #include <ncnet/Server.h>
 #include <ncnet/Client.h>
+#include <ncnet/ClientPool.h>
 #include <ncnet/Log.h>
 
 #include <iostream>
@@ -37,7 +38,7 @@ bool verify_response(ncnet::Packet &packet) {
     assert(byte == 2);
     packet >> tmp;
     assert(tmp == "after");
-    return false;
+    return true;
 }
 
 ncnet::Packet create_test_packet() {
@@ -56,30 +57,37 @@ ncnet::Packet create_test_packet() {
     return packet;
 }
 
-int main() {
-    //ncnet::Log::enable(true);
-
+// Round trip of the test packet through an echo server
+bool echo(const string &server_host, const string &client_host, int port, ncnet::PollerType poller = ncnet::PollerType::EPOLL) {
     ncnet::Server server;
-    auto port = 15500;
-    server.start("", port);
+    server.set_poller_type(poller);
+    server.start(server_host, port);
     server.register_transfer_loop([&server] (auto &transfer) {
         // Echo
-        server.send_packet(transfer.get_packet(), transfer.get_connection_id());
+        server.send_packet(move(transfer.get_packet()), transfer.get_connection_id());
     });
 
     ncnet::Client client;
-    client.start("localhost", port);
+    client.set_poller_type(poller);
+    client.start(client_host, port);
     mutex lock;
     auto quit = false;
     auto failed = true;
     client.register_transfer_loop([&client, &quit, &failed, &lock] (auto &transfer) {
         lock_guard<mutex> failed_lock(lock);
-        failed = verify_response(transfer.get_packet());
+        failed = !verify_response(transfer.get_packet());
         quit = true;
     });
 
-    auto test_packet = create_test_packet();
-    client.send_packet(test_packet);
+    // Refused instead of being framed with a truncated size
+    ncnet::Packet oversized;
+    oversized << string(ncnet::PACKET_SEND_MAX_SIZE, 'x');
+    assert(client.send_packet(oversized) == ncnet::SendResult::FAILED);
+    assert(client.request(move(oversized), [] (auto *) {}) == ncnet::SendResult::FAILED);
+    // Owned by an existing network thread but never connected, would otherwise wait forever
+    assert(server.request(create_test_packet(), [] (auto *) {}, 1000 << 8) == ncnet::SendResult::FAILED);
+
+    client.send_packet(create_test_packet());
 
     // Wait
     while (true) {
@@ -94,7 +102,163 @@ int main() {
         this_thread::sleep_for(1ms);
     }
 
+    // Local transports skip the key exchange
+    assert(client.get_metrics().get(ncnet::Counter::HANDSHAKES_PLAINTEXT) == (client_host.find(':') != string::npos ? 1 : 0));
+
     client.stop();
     server.stop();
-    return failed ? 0 : -1;
+    return !failed;
+}
+
+// Requests spread over a pool of connections, each answered with its value doubled
+bool pool_requests(Balance balance) {
+    ncnet::Server server;
+    server.start("", 15502);
+    server.register_transfer_loop([&server] (auto &transfer) {
+        int value;
+        transfer.get_packet() >> value;
+        ncnet::Packet reply;
+        reply << value * 2;
+        server.send_reply(transfer, move(reply));
+    });
+
+    ncnet::ClientPool pool;
+    pool.set_balance(balance);
+    pool.start("localhost", 15502, 4);
+    assert(pool.size() == 4);
+
+    vector<future<ncnet::Packet>> responses;
+    for (int i = 0; i < 400; i++) {
+        ncnet::Packet packet;
+        packet << i;
+        responses.push_back(pool.request(move(packet), 5000));
+    }
+
+    auto passed = true;
+    for (int i = 0; i < 400; i++) {
+        int value;
+        responses[i].get() >> value;
+        passed = passed && value == i * 2;
+    }
+
+    // Every connection carried requests
+    for (size_t i = 0; i < pool.size(); i++) {
+        passed = passed && pool.get_client(i)->get_metrics().get(ncnet::Counter::PACKETS_SENT) > 1;
+    }
+
+    pool.stop();
+    server.stop();
+    return passed;
+}
+
+// Port 0 picks one free port shared by the listeners of every network thread
+bool ephemeral_port() {
+    ncnet::Server server;
+    server.set_reactor_count(4);
+    server.start("", 0);
+    server.register_transfer_loop([&server] (auto &transfer) {
+        server.send_reply(transfer, move(transfer.get_packet()));
+    });
+
+    auto passed = server.get_port() > 0;
+    vector<unique_ptr<ncnet::Client>> clients;
+    for (int i = 0; i < 8 && passed; i++) {
+        clients.emplace_back(new ncnet::Client());
+        passed = clients.back()->start("localhost", server.get_port());
+
+        ncnet::Packet packet;
+        packet << i;
+        int value;
+        clients.back()->request(move(packet), 0, 5000).get() >> value;
+        passed = passed && value == i;
+    }
+
+    for (auto &client : clients) {
+        client->stop();
+    }
+
+    server.stop();
+    return passed;
+}
+
+// Packets and requests skip a stopped connection instead of being lost with it, and the pool reconnects
+bool pool_failover() {
+    ncnet::Server server;
+    atomic<int> received{0};
+    server.start("", 15503);
+    server.register_transfer_loop([&server, &received] (auto &transfer) {
+        if (transfer.get_packet().is_request()) {
+            server.send_reply(transfer, move(transfer.get_packet()));
+        } else {
+            received++;
+        }
+    });
+
+    ncnet::ClientPool pool;
+    pool.start("localhost", 15503, 3);
+    assert(pool.size() == 3);
+    auto stopped = pool.get_client(1);
+    stopped->stop();
+
+    auto passed = true;
+    for (int i = 0; i < 30; i++) {
+        ncnet::Packet packet;
+        packet << i;
+        passed = passed && pool.send_packet(move(packet)) == ncnet::SendResult::QUEUED;
+    }
+
+    for (int i = 0; i < 5000 && received < 30; i++) {
+        using namespace literals::chrono_literals;
+        this_thread::sleep_for(1ms);
+    }
+
+    passed = passed && received == 30;
+
+    for (int i = 0; i < 30; i++) {
+        ncnet::Packet packet;
+        packet << i;
+
+        int value;
+        pool.request(move(packet), 5000).get() >> value;
+        passed = passed && value == i;
+    }
+
+    passed = passed && pool.get_outstanding(1) == 0;
+    passed = passed && stopped->get_metrics().get(ncnet::Counter::PACKETS_SENT) <= 1;
+
+    // Back to three connections, the replacement carries packets again
+    for (int i = 0; i < 5000 && pool.connected() < 3; i++) {
+        using namespace literals::chrono_literals;
+        this_thread::sleep_for(1ms);
+    }
+
+    auto replacement = pool.get_client(1);
+    passed = passed && pool.connected() == 3 && replacement && replacement != stopped;
+
+    for (int i = 0; i < 3; i++) {
+        ncnet::Packet packet;
+        packet << i;
+        passed = passed && pool.send_packet(move(packet)) == ncnet::SendResult::QUEUED;
+    }
+
+    passed = passed && replacement->get_metrics().get(ncnet::Counter::PACKETS_SENT) >= 1;
+
+    pool.stop();
+    server.stop();
+    return passed;
+}
+
+int main() {
+    //ncnet::Log::enable(true);
+
+    auto passed = echo("", "localhost", 15500);
+    passed = passed && echo("unix:@ncnet_test_transfer", "unix:@ncnet_test_transfer", 0);
+    passed = passed && echo("shm:@ncnet_test_transfer", "shm:@ncnet_test_transfer", 0);
+    // Falls back to epoll on kernels without multishot recv
+    passed = passed && echo("", "localhost", 15501, ncnet::PollerType::IO_URING);
+    passed = passed && echo("unix:@ncnet_test_transfer", "unix:@ncnet_test_transfer", 0, ncnet::PollerType::IO_URING);
+    passed = passed && pool_requests(Balance::ROUND_ROBIN) && pool_requests(Balance::LEAST_OUTSTANDING);
+    passed = passed && pool_failover();
+    passed = passed && ephemeral_port();
+    return passed ? 0 : 1;
 }
\ No newline at end of file